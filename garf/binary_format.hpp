@@ -0,0 +1,227 @@
+#ifndef GARF_BINARY_FORMAT_HPP
+#define GARF_BINARY_FORMAT_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <boost/serialization/access.hpp>
+#include <boost/serialization/version.hpp>
+
+#include "types.hpp"
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define GARF_BINARY_BIG_ENDIAN
+#endif
+
+namespace garf {
+
+    // Binary forest files, as written by RegressionForest::save_forest. Everything is little
+    // endian, with integers at their in memory size (indices are all 64 bit, see types.hpp),
+    // bools as single bytes and enums as 32 bit ints. A file is
+    //
+    //     8 byte magic (binary_forest_magic), uint32 format version
+    //     uint8 feature type, uint8 label type (binary_scalar_code), split type name
+    //     trained flag, ForestStats, then the four options structs
+    //     uint64 offset[num_trees], uint64 size[num_trees] of each tree's block, with offsets
+    //     counted from the end of this table
+    //     every tree's block
+    //
+    // ForestStats and the options go through their usual serialize() functions, each preceded
+    // by the class version they were written with, so adding an option works the same way for
+    // these files as for Boost archives. Within a tree each field of the nodes is stored as one
+    // contiguous block, in depth first order, so loading is mostly big memcpys - see
+    // RegressionTree::save_binary for the details. Trees don't depend on each other, so with the
+    // offset table they are encoded and decoded in parallel. Version 1 files had no table,
+    // just the trees one after another, and are still loaded (a tree at a time).
+
+    const char binary_forest_magic[8] = {'G', 'A', 'R', 'F', 'B', 'I', 'N', '\0'};
+    const uint32_t binary_forest_format_version = 2;
+
+    // How feature and label types are recorded in the header
+    template<typename T> inline uint8_t binary_scalar_code();
+    template<> inline uint8_t binary_scalar_code<float>() { return 1; }
+    template<> inline uint8_t binary_scalar_code<double>() { return 2; }
+
+    inline const char * binary_scalar_name(const uint8_t code) {
+        switch (code) {
+        case 1: return "float";
+        case 2: return "double";
+        default: return "unknown";
+        }
+    }
+
+    // Whether the first bytes of a file are the binary magic
+    inline bool is_binary_forest(const char * const data, const size_t size) {
+        return (size >= sizeof(binary_forest_magic)) &&
+               (std::memcmp(data, binary_forest_magic, sizeof(binary_forest_magic)) == 0);
+    }
+
+    // What a value is written as - itself for numbers, except that bools are a byte and enums an int32
+    template<typename T, bool IsEnum = std::is_enum<T>::value>
+    struct binary_storage { typedef T type; };
+    template<typename T>
+    struct binary_storage<T, true> { typedef int32_t type; };
+    template<>
+    struct binary_storage<bool, false> { typedef uint8_t type; };
+
+    // Appends to a buffer. Also works as an archive for the serialize() functions of the
+    // options, as long as all they do is "ar & field" on numbers, bools and enums.
+    class BinaryWriter {
+        std::vector<char> & buffer;
+    public:
+        explicit BinaryWriter(std::vector<char> & _buffer) : buffer(_buffer) {}
+
+        inline size_t size() const { return buffer.size(); }
+
+        inline void write_bytes(const std::vector<char> & bytes) {
+            buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+        }
+
+        template<typename T>
+        void write_array(const T * const values, const size_t count) {
+            static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value,
+                          "only numbers can be written as arrays");
+            if (count == 0) {
+                return;
+            }
+            const size_t start = buffer.size();
+            buffer.resize(start + (count * sizeof(T)));
+            char * const out = &buffer[start];
+#ifdef GARF_BINARY_BIG_ENDIAN
+            for (size_t i = 0; i < count; i++) {
+                std::memcpy(out + (i * sizeof(T)), &values[i], sizeof(T));
+                std::reverse(out + (i * sizeof(T)), out + ((i + 1) * sizeof(T)));
+            }
+#else
+            std::memcpy(out, values, count * sizeof(T));
+#endif
+        }
+
+        template<typename T>
+        inline void write(const T & value) {
+            const typename binary_storage<T>::type stored = static_cast<typename binary_storage<T>::type>(value);
+            write_array(&stored, 1);
+        }
+
+        template<typename T>
+        inline BinaryWriter & operator& (const T & value) {
+            write(value);
+            return *this;
+        }
+
+        inline void write_string(const std::string & str) {
+            write(static_cast<uint32_t>(str.size()));
+            write_array(str.data(), str.size());
+        }
+
+        // An object's fields through its serialize(), as they are for the given class version
+        template<class T>
+        inline void write_fields(const T & obj, const unsigned int version) {
+            boost::serialization::access::serialize(*this, const_cast<T &>(obj), version);
+        }
+
+        // The current class version, then the fields
+        template<class T>
+        inline void write_versioned(const T & obj) {
+            const uint32_t version = boost::serialization::version<T>::value;
+            write(version);
+            write_fields(obj, version);
+        }
+    };
+
+    // Reads from a range of memory, the reverse of BinaryWriter. Running off the end throws
+    // std::invalid_argument rather than reading garbage.
+    class BinaryReader {
+        const char * pos;
+        const char * const end;
+    public:
+        BinaryReader(const char * const begin, const char * const _end) : pos(begin), end(_end) {}
+
+        inline size_t remaining() const { return end - pos; }
+        inline const char * position() const { return pos; }
+
+        inline void skip(const size_t num_bytes) {
+            require(num_bytes, 1);
+            pos += num_bytes;
+        }
+
+        // Throw unless there are count items of item_size bytes left. Call this before allocating
+        // anything for a count read from the file, so a corrupt count can't ask for terabytes.
+        inline void require(const size_t count, const size_t item_size) const {
+            if ((item_size != 0) && (count > (remaining() / item_size))) {
+                throw std::invalid_argument("forest file is truncated or corrupt");
+            }
+        }
+
+        template<typename T>
+        void read_array(T * const values, const size_t count) {
+            static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value,
+                          "only numbers can be read as arrays");
+            require(count, sizeof(T));
+            if (count == 0) {
+                return;
+            }
+#ifdef GARF_BINARY_BIG_ENDIAN
+            for (size_t i = 0; i < count; i++) {
+                char bytes[sizeof(T)];
+                std::reverse_copy(pos + (i * sizeof(T)), pos + ((i + 1) * sizeof(T)), bytes);
+                std::memcpy(&values[i], bytes, sizeof(T));
+            }
+#else
+            std::memcpy(values, pos, count * sizeof(T));
+#endif
+            pos += count * sizeof(T);
+        }
+
+        // Resize values to count (checking there is enough data first) and fill it
+        template<typename T>
+        inline void read_vector(std::vector<T> * const values, const size_t count) {
+            require(count, sizeof(T));
+            values->resize(count);
+            read_array(values->data(), count);
+        }
+
+        template<typename T>
+        inline void read(T & value) {
+            typename binary_storage<T>::type stored;
+            read_array(&stored, 1);
+            value = static_cast<T>(stored);
+        }
+
+        template<typename T>
+        inline BinaryReader & operator& (T & value) {
+            read(value);
+            return *this;
+        }
+
+        inline std::string read_string() {
+            uint32_t length;
+            read(length);
+            require(length, 1);
+            std::string str(pos, length);
+            pos += length;
+            return str;
+        }
+
+        template<class T>
+        inline void read_fields(T & obj, const unsigned int version) {
+            boost::serialization::access::serialize(*this, obj, version);
+        }
+
+        template<class T>
+        void read_versioned(T & obj) {
+            uint32_t version;
+            read(version);
+            if (version > static_cast<uint32_t>(boost::serialization::version<T>::value)) {
+                throw std::invalid_argument("forest file was written by a newer version of garf");
+            }
+            read_fields(obj, version);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef GARF_CODEGEN_HPP
+#define GARF_CODEGEN_HPP
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "regression_forest.hpp"
+
+namespace garf {
+
+    // Turn a trained forest into a self contained C++ source file, for ahead of time compiled
+    // models. Each tree becomes a function of nested ifs, with the splits and leaf means
+    // written in as literal constants, and the file ends with
+    //
+    //     void predict(const float * features, float * labels_out);
+    //
+    // which writes the mean prediction over all trees for one datapoint. Comparisons and sums
+    // are done in the forest's own feature / label types, so given the same feature values
+    // the generated code reaches the same leaves and gives the same means as
+    // RegressionForest::predict. The forest's predict_options.maximum_depth is baked in.
+    // Nothing in the output depends on garf, Eigen or Boost. Only AxisAlignedSplt and
+    // TwoDimSplt forests are supported (see write_split_condition below).
+
+    // How deeply ifs are nested before the rest of a subtree is moved into its own function,
+    // so huge trees don't hit compiler limits on bracket depth
+    const depth_idx_t codegen_max_nesting = 64;
+
+    template<typename T> inline const char * codegen_type_name();
+    template<> inline const char * codegen_type_name<float>() { return "float"; }
+    template<> inline const char * codegen_type_name<double>() { return "double"; }
+
+    // Write a value with enough digits that the compiler reads back exactly the same value
+    template<typename T>
+    inline void write_literal(std::ostream & out, const T value) {
+        if (!std::isfinite(value)) {
+            throw std::invalid_argument("cannot generate code for a forest with non finite values");
+        }
+        std::ostringstream literal;
+        literal << std::setprecision(std::numeric_limits<T>::max_digits10) << value;
+        std::string str = literal.str();
+        if (str.find_first_of(".e") == std::string::npos) {
+            str += ".0";
+        }
+        out << str;
+        if (sizeof(T) == sizeof(float)) {
+            out << "f";
+        }
+    }
+
+    // Condition for a datapoint going left, written in terms of a "const float * f" argument.
+    // These mirror the evaluate() functions in splitter.hpp.
+    template<typename FeatT>
+    inline void write_split_condition(std::ostream & out, const AxisAlignedSplt<FeatT> & split) {
+        out << "static_cast<feature_t>(f[" << split.feat_idx << "]) <= ";
+        write_literal<FeatT>(out, split.thresh);
+    }
+
+    template<typename FeatT>
+    inline void write_split_condition(std::ostream & out, const TwoDimSplt<FeatT> & split) {
+        out << "((static_cast<feature_t>(f[" << split.feat_1 << "]) * ";
+        write_literal<weight_t>(out, split.weight_feat_1);
+        out << ") + (static_cast<feature_t>(f[" << split.feat_2 << "]) * ";
+        write_literal<weight_t>(out, split.weight_feat_2);
+        out << ")) <= ";
+        write_literal<FeatT>(out, split.thresh);
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    class ForestCodeGenerator {
+        typedef RegressionNode<FeatT, LabT, SplitT, SplFitterT> node_t;
+
+        const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & forest;
+        const depth_idx_t maximum_depth;
+
+        // Function bodies, and the declarations which need to go before them all
+        std::ostringstream declarations;
+        std::ostringstream definitions;
+
+        // Subtrees moved into functions of their own so far, for naming them. Node ids can't
+        // be used, they overflow long before trees get deep enough to need this.
+        std::vector<const node_t *> deferred;
+
+        inline static std::string function_name(const tree_idx_t t, const size_t part) {
+            std::ostringstream name;
+            name << "tree_" << t;
+            if (part > 0) {
+                name << "_part_" << part;
+            }
+            return name.str();
+        }
+
+        inline static void indent(std::ostream & out, const depth_idx_t level) {
+            out << std::string(4 * (level + 2), ' ');
+        }
+
+        // One function for tree t which adds the means of whichever leaf under the root is
+        // reached onto sum, followed by one for each subtree too deep to nest in there
+        void write_tree(const tree_idx_t t, const node_t & root) {
+            deferred.assign(1, &root);
+            for (size_t part = 0; part < deferred.size(); part++) {
+                const std::string name = function_name(t, part);
+                declarations << "        inline void " << name << "(const float * f, label_t * sum);" << std::endl;
+
+                std::ostringstream body;
+                write_node(body, t, *deferred[part], 0);
+                definitions << "        inline void " << name << "(const float * f, label_t * sum) {" << std::endl
+                            << body.str()
+                            << "        }" << std::endl << std::endl;
+            }
+        }
+
+        void write_node(std::ostream & out, const tree_idx_t t, const node_t & node, const depth_idx_t nesting) {
+            // Prediction stops at maximum_depth, so anything there is effectively a leaf
+            if (node.is_leaf || (node.depth >= maximum_depth)) {
+                for (label_idx_t l = 0; l < forest.stats().label_dimensions; l++) {
+                    indent(out, nesting + 1);
+                    out << "sum[" << l << "] += ";
+                    write_literal<LabT>(out, node.dist.mean(l));
+                    out << ";" << std::endl;
+                }
+                return;
+            }
+            if (nesting >= codegen_max_nesting) {
+                indent(out, nesting + 1);
+                out << function_name(t, deferred.size()) << "(f, sum);" << std::endl;
+                deferred.push_back(&node);
+                return;
+            }
+
+            indent(out, nesting + 1);
+            out << "if (";
+            write_split_condition(out, node.split);
+            out << ") {" << std::endl;
+            write_node(out, t, node.get_left(), nesting + 1);
+            indent(out, nesting + 1);
+            out << "} else {" << std::endl;
+            write_node(out, t, node.get_right(), nesting + 1);
+            indent(out, nesting + 1);
+            out << "}" << std::endl;
+        }
+
+    public:
+        ForestCodeGenerator(const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & _forest)
+            : forest(_forest), maximum_depth(_forest.predict_options.maximum_depth) {
+            if (!forest.is_trained()) {
+                throw std::invalid_argument("cannot generate code, forest not trained yet");
+            }
+        }
+
+        void write(std::ostream & out, const std::string & name_space) {
+            const ForestStats & stats = forest.stats();
+            declarations.str("");
+            definitions.str("");
+            for (tree_idx_t t = 0; t < stats.num_trees; t++) {
+                write_tree(t, forest.get_tree(t).get_root());
+            }
+
+            out << "// Generated by garf from a forest of " << stats.num_trees << " trees over "
+                << stats.data_dimensions << " features and " << stats.label_dimensions << " labels." << std::endl
+                << "// Compile with optimisation on (eg -O3). Does not depend on garf, Eigen or Boost." << std::endl
+                << std::endl
+                << "namespace " << name_space << " {" << std::endl
+                << std::endl
+                << "    const int num_features = " << stats.data_dimensions << ";" << std::endl
+                << "    const int num_labels = " << stats.label_dimensions << ";" << std::endl
+                << "    const int num_trees = " << stats.num_trees << ";" << std::endl
+                << std::endl
+                << "    // Types the forest was trained with, which all comparisons and sums are done in" << std::endl
+                << "    typedef " << codegen_type_name<FeatT>() << " feature_t;" << std::endl
+                << "    typedef " << codegen_type_name<LabT>() << " label_t;" << std::endl
+                << std::endl
+                << "    namespace {" << std::endl
+                << declarations.str()
+                << std::endl
+                << definitions.str()
+                << "    }" << std::endl
+                << std::endl
+                << "    // Mean prediction of all trees for a single datapoint. features holds num_features" << std::endl
+                << "    // values, labels_out has space for num_labels" << std::endl
+                << "    void predict(const float * features, float * labels_out) {" << std::endl
+                << "        label_t sum[num_labels];" << std::endl
+                << "        for (int l = 0; l < num_labels; l++) {" << std::endl
+                << "            sum[l] = 0;" << std::endl
+                << "        }" << std::endl;
+            for (tree_idx_t t = 0; t < stats.num_trees; t++) {
+                out << "        tree_" << t << "(features, sum);" << std::endl;
+            }
+            out << "        for (int l = 0; l < num_labels; l++) {" << std::endl
+                << "            labels_out[l] = static_cast<float>(sum[l] / num_trees);" << std::endl
+                << "        }" << std::endl
+                << "    }" << std::endl
+                << "}" << std::endl;
+        }
+    };
+
+    // Write the generated source for forest to out, with everything inside name_space
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void write_cpp_predictor(const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & forest,
+                             std::ostream & out, const std::string & name_space = "garf_model") {
+        ForestCodeGenerator<FeatT, LabT, SplitT, SplFitterT> generator(forest);
+        generator.write(out, name_space);
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void save_cpp_predictor(const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & forest,
+                            std::string filename, std::string name_space) {
+        std::ofstream ofs(filename.c_str());
+        if (!ofs) {
+            throw std::invalid_argument("couldn't open " + filename + " for writing");
+        }
+        write_cpp_predictor(forest, ofs, name_space);
+    }
+}
+
+#endif
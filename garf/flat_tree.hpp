@@ -0,0 +1,210 @@
+#ifndef GARF_FLAT_TREE_HPP
+#define GARF_FLAT_TREE_HPP
+
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "types.hpp"
+#include "flat_tree_simd.hpp"
+
+namespace garf {
+
+    // What a single tree predicts for a datapoint - the label mean of the node it stopped
+    // at (label_dimensions values) and that node's id
+    template<typename LabT>
+    struct PredictedLeaf {
+        const LabT * mean;
+        node_idx_t node_id;
+    };
+
+    // Read only FlatTree over arrays which live somewhere else - a FlatTree's own vectors (see
+    // FlatTree::view) or a memory mapped file (see MappedForest). All evaluation goes through here.
+    template<typename FeatT, typename LabT, template<typename> class SplitT>
+    struct FlatTreeView {
+        label_idx_t label_dims;
+        int32_t root;
+        const SplitT<FeatT> * splits;
+        const int32_t * children;
+        const LabT * leaf_means;
+        const node_idx_t * leaf_node_ids;
+        const LabT * internal_means;
+        const node_idx_t * internal_node_ids;
+
+        // Follow the splits from the root, stopping at a leaf or at maximum_depth. fvec is any
+        // Eigen vector of features, see AxisAlignedSplt::evaluate
+        template<class FeatVecT>
+        inline PredictedLeaf<LabT> evaluate(const FeatVecT & fvec, const depth_idx_t maximum_depth) const {
+            int32_t current = root;
+            depth_idx_t current_depth = 0;
+            while ((current >= 0) && (current_depth < maximum_depth)) {
+                current = children[2 * current + ((splits[current].evaluate(fvec) == LEFT) ? 0 : 1)];
+                current_depth++;
+            }
+
+            return predicted_leaf(current);
+        }
+
+        // As evaluate(), but in one pass down the tree fill leaves_out[k] with where we would have
+        // stopped for a maximum depth of depths[k]. depths must be in increasing order.
+        template<class FeatVecT>
+        inline void evaluate_at_depths(const FeatVecT & fvec, const depth_idx_t * const depths, const size_t num_depths,
+                                       PredictedLeaf<LabT> * const leaves_out) const {
+            int32_t current = root;
+            depth_idx_t current_depth = 0;
+            for (size_t k = 0; k < num_depths; k++) {
+                while ((current >= 0) && (current_depth < depths[k])) {
+                    current = children[2 * current + ((splits[current].evaluate(fvec) == LEFT) ? 0 : 1)];
+                    current_depth++;
+                }
+                leaves_out[k] = predicted_leaf(current);
+            }
+        }
+
+        // Mean and node id for a reference to a leaf or internal node
+        inline PredictedLeaf<LabT> predicted_leaf(const int32_t ref) const {
+            PredictedLeaf<LabT> result;
+            if (ref < 0) {
+                result.mean = &leaf_means[static_cast<size_t>(~ref) * label_dims];
+                result.node_id = leaf_node_ids[~ref];
+            } else {
+                result.mean = &internal_means[static_cast<size_t>(ref) * label_dims];
+                result.node_id = internal_node_ids[ref];
+            }
+            return result;
+        }
+    };
+
+    // Inference only copy of a trained tree, held in a handful of contiguous arrays rather
+    // than heap nodes linked by shared_ptrs. Internal nodes are numbered in depth first
+    // order, and each has a split and two 32 bit child references. A non negative child
+    // reference is another internal node, a negative one v is leaf ~v. Label means are
+    // packed into flat tables, label_dims values per node. See RegressionForest::compile_for_inference
+    template<typename FeatT, typename LabT, template<typename> class SplitT>
+    class FlatTree {
+    public:
+        label_idx_t label_dims;
+
+        // Reference to the root, encoded the same way as a child (so a tree which is
+        // a single leaf has root == ~0)
+        int32_t root;
+
+        std::vector<SplitT<FeatT> > splits;
+        std::vector<int32_t> children;  // left then right, for each internal node
+
+        std::vector<LabT> leaf_means;
+        std::vector<node_idx_t> leaf_node_ids;
+
+        // Only needed when PredictOptions::maximum_depth stops a datapoint before it reaches
+        // a leaf, so kept out of the way of the leaf table
+        std::vector<LabT> internal_means;
+        std::vector<node_idx_t> internal_node_ids;
+
+        // The splits again, laid out for evaluate_rows to use vector instructions where it can
+        SimdNodes<FeatT, SplitT> simd_nodes;
+
+        FlatTree() : label_dims(0), root(~0) {}
+
+        // Flatten the tree below root_node (any RegressionNode instantiation)
+        template<class NodeT>
+        void compile(const NodeT & root_node, const label_idx_t _label_dims) {
+            label_dims = _label_dims;
+            splits.clear();
+            children.clear();
+            leaf_means.clear();
+            leaf_node_ids.clear();
+            internal_means.clear();
+            internal_node_ids.clear();
+            root = add_node(root_node);
+            simd_nodes.build(splits);
+        }
+
+        inline int32_t num_internal_nodes() const { return splits.size(); }
+        inline int32_t num_leaves() const { return leaf_node_ids.size(); }
+
+        // Only valid until this tree is compiled again (or destroyed)
+        inline FlatTreeView<FeatT, LabT, SplitT> view() const {
+            FlatTreeView<FeatT, LabT, SplitT> v;
+            v.label_dims = label_dims;
+            v.root = root;
+            v.splits = splits.data();
+            v.children = children.data();
+            v.leaf_means = leaf_means.data();
+            v.leaf_node_ids = leaf_node_ids.data();
+            v.internal_means = internal_means.data();
+            v.internal_node_ids = internal_node_ids.data();
+            return v;
+        }
+
+        // See FlatTreeView
+        template<class FeatVecT>
+        inline PredictedLeaf<LabT> evaluate(const FeatVecT & fvec, const depth_idx_t maximum_depth) const {
+            return view().evaluate(fvec, maximum_depth);
+        }
+        template<class FeatVecT>
+        inline void evaluate_at_depths(const FeatVecT & fvec, const depth_idx_t * const depths, const size_t num_depths,
+                                       PredictedLeaf<LabT> * const leaves_out) const {
+            view().evaluate_at_depths(fvec, depths, num_depths, leaves_out);
+        }
+        inline PredictedLeaf<LabT> predicted_leaf(const int32_t ref) const {
+            return view().predicted_leaf(ref);
+        }
+
+        // Evaluate rows [begin_row, end_row) of features, putting the leaf each row reaches into
+        // leaves_out[row - begin_row]. Where SimdNodes has kernels for this kind of tree, up to
+        // simd_level is used to send several rows down at once, and any rows left over go one at a
+        // time. row_scratch and refs_scratch (with room for end_row - begin_row) are just workspace.
+        void evaluate_rows(const feature_mtx<FeatT> & features,
+                           const datapoint_idx_t begin_row, const datapoint_idx_t end_row,
+                           const depth_idx_t maximum_depth, const simd_level_t simd_level,
+                           feature_vec<FeatT> * const row_scratch, int32_t * const refs_scratch,
+                           PredictedLeaf<LabT> * const leaves_out) const {
+            const FlatTreeView<FeatT, LabT, SplitT> tree = view();
+            datapoint_idx_t row = begin_row;
+            if (simd_level != SIMD_NONE) {
+                row = simd_nodes.evaluate_rows(features, begin_row, end_row, root, children.data(),
+                                               maximum_depth, simd_level, refs_scratch);
+                for (datapoint_idx_t i = begin_row; i < row; i++) {
+                    leaves_out[i - begin_row] = tree.predicted_leaf(refs_scratch[i - begin_row]);
+                }
+            }
+            for (; row < end_row; row++) {
+                *row_scratch = features.row(row);
+                leaves_out[row - begin_row] = tree.evaluate(*row_scratch, maximum_depth);
+            }
+        }
+
+    private:
+        template<class NodeT>
+        int32_t add_node(const NodeT & node) {
+            if (node.is_leaf) {
+                if (leaf_node_ids.size() >= static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+                    throw std::logic_error("tree has too many leaves to compile for inference");
+                }
+                const int32_t leaf_idx = leaf_node_ids.size();
+                leaf_means.insert(leaf_means.end(), node.dist.mean.data(), node.dist.mean.data() + label_dims);
+                leaf_node_ids.push_back(node.node_id);
+                return ~leaf_idx;
+            }
+
+            if (splits.size() >= static_cast<size_t>(std::numeric_limits<int32_t>::max() / 2)) {
+                throw std::logic_error("tree has too many nodes to compile for inference");
+            }
+            const int32_t node_idx = splits.size();
+            splits.push_back(node.split);
+            children.push_back(0);
+            children.push_back(0);
+            internal_means.insert(internal_means.end(), node.dist.mean.data(), node.dist.mean.data() + label_dims);
+            internal_node_ids.push_back(node.node_id);
+
+            // Children are added after this node, so these can't be references into children
+            const int32_t left_ref = add_node(node.get_left());
+            children[2 * node_idx] = left_ref;
+            const int32_t right_ref = add_node(node.get_right());
+            children[2 * node_idx + 1] = right_ref;
+            return node_idx;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,327 @@
+#ifndef GARF_FLAT_TREE_SIMD_HPP
+#define GARF_FLAT_TREE_SIMD_HPP
+
+#include <stdint.h>
+#include <limits>
+#include <vector>
+
+#include "types.hpp"
+#include "splitter.hpp"
+
+// The vector kernels are compiled with target attributes, so the rest of the library doesn't need
+// building with -mavx2 etc. and still runs on CPUs without them
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define GARF_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace garf {
+
+    // Best vector instruction set the CPU we are running on supports, only worked out once
+    inline simd_level_t detect_simd_level() {
+#ifdef GARF_SIMD_X86
+        static const simd_level_t level = (__builtin_cpu_init(),
+                                           __builtin_cpu_supports("avx512f") ? SIMD_AVX512 :
+                                           __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_NONE);
+        return level;
+#else
+        return SIMD_NONE;
+#endif
+    }
+
+    // The vector kernels gather features with 32 bit offsets into the (column major) feature matrix
+    template<typename FeatT>
+    inline bool simd_offsets_fit(const feature_mtx<FeatT> & features) {
+        return (features.rows() * features.cols()) <= static_cast<eigen_idx_t>(std::numeric_limits<int32_t>::max());
+    }
+
+    // A FlatTree's splits rearranged so that a vector of rows can be sent down the tree together,
+    // each lane following its own path with gathered loads. Only float features with axis aligned
+    // or two dimensional splits have vector kernels - for anything else evaluate_rows() does
+    // nothing, and FlatTree::evaluate_rows goes one row at a time.
+    //
+    // evaluate_rows() sends whole vectors of rows from begin_row onwards through the tree, writing
+    // the FlatTree reference each stops at into refs_out[row - begin_row], and returns the first
+    // row it didn't do. Splits are evaluated exactly as their evaluate() functions do it.
+    template<typename FeatT, template<typename> class SplitT>
+    struct SimdNodes {
+        inline void build(const std::vector<SplitT<FeatT> > & splits) {}
+        inline datapoint_idx_t evaluate_rows(const feature_mtx<FeatT> & features,
+                                             const datapoint_idx_t begin_row, const datapoint_idx_t end_row,
+                                             const int32_t root, const int32_t * const children,
+                                             const depth_idx_t maximum_depth, const simd_level_t simd_level,
+                                             int32_t * const refs_out) const {
+            return begin_row;
+        }
+    };
+
+    template<>
+    struct SimdNodes<float, AxisAlignedSplt> {
+        std::vector<int32_t> feat_idx;
+        std::vector<float> thresh;
+
+        inline void build(const std::vector<AxisAlignedSplt<float> > & splits) {
+            feat_idx.resize(splits.size());
+            thresh.resize(splits.size());
+            for (size_t i = 0; i < splits.size(); i++) {
+                feat_idx[i] = splits[i].feat_idx;
+                thresh[i] = splits[i].thresh;
+            }
+        }
+
+        inline datapoint_idx_t evaluate_rows(const feature_mtx<float> & features,
+                                             const datapoint_idx_t begin_row, const datapoint_idx_t end_row,
+                                             const int32_t root, const int32_t * const children,
+                                             const depth_idx_t maximum_depth, const simd_level_t simd_level,
+                                             int32_t * const refs_out) const {
+#ifdef GARF_SIMD_X86
+            if (simd_offsets_fit(features)) {
+                if (simd_level >= SIMD_AVX512) {
+                    return evaluate_rows_avx512(features.data(), features.rows(), begin_row, end_row,
+                                                root, children, maximum_depth, refs_out);
+                } else if (simd_level >= SIMD_AVX2) {
+                    return evaluate_rows_avx2(features.data(), features.rows(), begin_row, end_row,
+                                              root, children, maximum_depth, refs_out);
+                }
+            }
+#endif
+            return begin_row;
+        }
+
+#ifdef GARF_SIMD_X86
+        // 8 rows at a time. Lanes which have already reached a leaf (negative reference) read node 0,
+        // which exists as long as any lane is still going, and then keep their reference.
+        __attribute__((target("avx2")))
+        datapoint_idx_t evaluate_rows_avx2(const float * const features, const int32_t stride,
+                                           const datapoint_idx_t begin_row, const datapoint_idx_t end_row,
+                                           const int32_t root, const int32_t * const children,
+                                           const depth_idx_t maximum_depth, int32_t * const refs_out) const {
+            const __m256i lane_offsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i strides = _mm256_set1_epi32(stride);
+            const __m256i ones = _mm256_set1_epi32(1);
+            const __m256i minus_ones = _mm256_set1_epi32(-1);
+
+            datapoint_idx_t row = begin_row;
+            for (; row + 8 <= end_row; row += 8) {
+                const __m256i rows = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int32_t>(row)), lane_offsets);
+                __m256i current = _mm256_set1_epi32(root);
+                for (depth_idx_t depth = 0; depth < maximum_depth; depth++) {
+                    const __m256i active = _mm256_cmpgt_epi32(current, minus_ones);
+                    if (_mm256_testz_si256(active, active)) {
+                        break;
+                    }
+                    const __m256i node = _mm256_and_si256(current, active);
+                    const __m256i feat = _mm256_i32gather_epi32(&feat_idx[0], node, 4);
+                    const __m256 node_thresh = _mm256_i32gather_ps(&thresh[0], node, 4);
+                    const __m256 value = _mm256_i32gather_ps(features, _mm256_add_epi32(_mm256_mullo_epi32(feat, strides), rows), 4);
+                    // value <= thresh goes left, and is false for NaN like the scalar test
+                    const __m256i go_left = _mm256_castps_si256(_mm256_cmp_ps(value, node_thresh, _CMP_LE_OQ));
+                    const __m256i child_idx = _mm256_add_epi32(_mm256_add_epi32(node, node), _mm256_andnot_si256(go_left, ones));
+                    const __m256i child = _mm256_i32gather_epi32(children, child_idx, 4);
+                    current = _mm256_blendv_epi8(current, child, active);
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(refs_out + (row - begin_row)), current);
+            }
+            return row;
+        }
+
+        // 16 rows at a time, masking off lanes which have reached a leaf
+        __attribute__((target("avx512f")))
+        datapoint_idx_t evaluate_rows_avx512(const float * const features, const int32_t stride,
+                                             const datapoint_idx_t begin_row, const datapoint_idx_t end_row,
+                                             const int32_t root, const int32_t * const children,
+                                             const depth_idx_t maximum_depth, int32_t * const refs_out) const {
+            const __m512i lane_offsets = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+            const __m512i strides = _mm512_set1_epi32(stride);
+            const __m512i ones = _mm512_set1_epi32(1);
+            const __m512i zeros = _mm512_setzero_si512();
+            const __m512 zeros_ps = _mm512_setzero_ps();
+
+            datapoint_idx_t row = begin_row;
+            for (; row + 16 <= end_row; row += 16) {
+                const __m512i rows = _mm512_add_epi32(_mm512_set1_epi32(static_cast<int32_t>(row)), lane_offsets);
+                __m512i current = _mm512_set1_epi32(root);
+                for (depth_idx_t depth = 0; depth < maximum_depth; depth++) {
+                    const __mmask16 active = _mm512_cmpge_epi32_mask(current, zeros);
+                    if (active == 0) {
+                        break;
+                    }
+                    const __m512i feat = _mm512_mask_i32gather_epi32(zeros, active, current, &feat_idx[0], 4);
+                    const __m512 node_thresh = _mm512_mask_i32gather_ps(zeros_ps, active, current, &thresh[0], 4);
+                    const __m512i offsets = _mm512_add_epi32(_mm512_mullo_epi32(feat, strides), rows);
+                    const __m512 value = _mm512_mask_i32gather_ps(zeros_ps, active, offsets, features, 4);
+                    const __mmask16 go_left = _mm512_cmp_ps_mask(value, node_thresh, _CMP_LE_OQ);
+                    const __m512i twice = _mm512_add_epi32(current, current);
+                    const __m512i child_idx = _mm512_mask_add_epi32(twice, static_cast<__mmask16>(~go_left), twice, ones);
+                    current = _mm512_mask_i32gather_epi32(current, active, child_idx, children, 4);
+                }
+                _mm512_storeu_si512(refs_out + (row - begin_row), current);
+            }
+            return row;
+        }
+#endif
+    };
+
+    template<>
+    struct SimdNodes<float, TwoDimSplt> {
+        std::vector<int32_t> feat_1;
+        std::vector<int32_t> feat_2;
+        std::vector<weight_t> weight_feat_1;
+        std::vector<weight_t> weight_feat_2;
+        std::vector<float> thresh;
+
+        inline void build(const std::vector<TwoDimSplt<float> > & splits) {
+            feat_1.resize(splits.size());
+            feat_2.resize(splits.size());
+            weight_feat_1.resize(splits.size());
+            weight_feat_2.resize(splits.size());
+            thresh.resize(splits.size());
+            for (size_t i = 0; i < splits.size(); i++) {
+                feat_1[i] = splits[i].feat_1;
+                feat_2[i] = splits[i].feat_2;
+                weight_feat_1[i] = splits[i].weight_feat_1;
+                weight_feat_2[i] = splits[i].weight_feat_2;
+                thresh[i] = splits[i].thresh;
+            }
+        }
+
+        inline datapoint_idx_t evaluate_rows(const feature_mtx<float> & features,
+                                             const datapoint_idx_t begin_row, const datapoint_idx_t end_row,
+                                             const int32_t root, const int32_t * const children,
+                                             const depth_idx_t maximum_depth, const simd_level_t simd_level,
+                                             int32_t * const refs_out) const {
+#ifdef GARF_SIMD_X86
+            if (simd_offsets_fit(features)) {
+                if (simd_level >= SIMD_AVX512) {
+                    return evaluate_rows_avx512(features.data(), features.rows(), begin_row, end_row,
+                                                root, children, maximum_depth, refs_out);
+                } else if (simd_level >= SIMD_AVX2) {
+                    return evaluate_rows_avx2(features.data(), features.rows(), begin_row, end_row,
+                                              root, children, maximum_depth, refs_out);
+                }
+            }
+#endif
+            return begin_row;
+        }
+
+#ifdef GARF_SIMD_X86
+        // TwoDimSplt::evaluate weights the features in double precision, so each half of the 8 lanes is
+        // widened to doubles for that. Separate multiplies and an add, as the scalar code does it -
+        // if that gets compiled with floating point contraction (fused multiply adds) the two can differ.
+        __attribute__((target("avx2")))
+        datapoint_idx_t evaluate_rows_avx2(const float * const features, const int32_t stride,
+                                           const datapoint_idx_t begin_row, const datapoint_idx_t end_row,
+                                           const int32_t root, const int32_t * const children,
+                                           const depth_idx_t maximum_depth, int32_t * const refs_out) const {
+            const __m256i lane_offsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+            const __m256i strides = _mm256_set1_epi32(stride);
+            const __m256i ones = _mm256_set1_epi32(1);
+            const __m256i minus_ones = _mm256_set1_epi32(-1);
+            // The unmasked double gathers leave their destination undefined, which upsets -Wall
+            const __m256d zeros_pd = _mm256_setzero_pd();
+            const __m256d all_lanes_pd = _mm256_castsi256_pd(minus_ones);
+
+            datapoint_idx_t row = begin_row;
+            for (; row + 8 <= end_row; row += 8) {
+                const __m256i rows = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int32_t>(row)), lane_offsets);
+                __m256i current = _mm256_set1_epi32(root);
+                for (depth_idx_t depth = 0; depth < maximum_depth; depth++) {
+                    const __m256i active = _mm256_cmpgt_epi32(current, minus_ones);
+                    if (_mm256_testz_si256(active, active)) {
+                        break;
+                    }
+                    const __m256i node = _mm256_and_si256(current, active);
+                    const __m256i offsets_1 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_i32gather_epi32(&feat_1[0], node, 4), strides), rows);
+                    const __m256i offsets_2 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_i32gather_epi32(&feat_2[0], node, 4), strides), rows);
+                    const __m256 value_1 = _mm256_i32gather_ps(features, offsets_1, 4);
+                    const __m256 value_2 = _mm256_i32gather_ps(features, offsets_2, 4);
+                    const __m256 node_thresh = _mm256_i32gather_ps(&thresh[0], node, 4);
+
+                    int left_bits = 0;
+                    for (int half = 0; half < 2; half++) {
+                        const __m128i half_node = (half == 0) ? _mm256_castsi256_si128(node) : _mm256_extracti128_si256(node, 1);
+                        const __m256d half_value_1 = _mm256_cvtps_pd((half == 0) ? _mm256_castps256_ps128(value_1) : _mm256_extractf128_ps(value_1, 1));
+                        const __m256d half_value_2 = _mm256_cvtps_pd((half == 0) ? _mm256_castps256_ps128(value_2) : _mm256_extractf128_ps(value_2, 1));
+                        const __m256d half_thresh = _mm256_cvtps_pd((half == 0) ? _mm256_castps256_ps128(node_thresh) : _mm256_extractf128_ps(node_thresh, 1));
+                        const __m256d weights_1 = _mm256_mask_i32gather_pd(zeros_pd, &weight_feat_1[0], half_node, all_lanes_pd, 8);
+                        const __m256d weights_2 = _mm256_mask_i32gather_pd(zeros_pd, &weight_feat_2[0], half_node, all_lanes_pd, 8);
+                        const __m256d test_val = _mm256_add_pd(_mm256_mul_pd(half_value_1, weights_1),
+                                                               _mm256_mul_pd(half_value_2, weights_2));
+                        left_bits |= _mm256_movemask_pd(_mm256_cmp_pd(test_val, half_thresh, _CMP_LE_OQ)) << (4 * half);
+                    }
+                    const __m256i go_left = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(left_bits), lane_bits), lane_bits);
+
+                    const __m256i child_idx = _mm256_add_epi32(_mm256_add_epi32(node, node), _mm256_andnot_si256(go_left, ones));
+                    const __m256i child = _mm256_i32gather_epi32(children, child_idx, 4);
+                    current = _mm256_blendv_epi8(current, child, active);
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(refs_out + (row - begin_row)), current);
+            }
+            return row;
+        }
+
+        __attribute__((target("avx512f")))
+        datapoint_idx_t evaluate_rows_avx512(const float * const features, const int32_t stride,
+                                             const datapoint_idx_t begin_row, const datapoint_idx_t end_row,
+                                             const int32_t root, const int32_t * const children,
+                                             const depth_idx_t maximum_depth, int32_t * const refs_out) const {
+            const __m512i lane_offsets = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+            const __m512i strides = _mm512_set1_epi32(stride);
+            const __m512i ones = _mm512_set1_epi32(1);
+            const __m512i zeros = _mm512_setzero_si512();
+            const __m512 zeros_ps = _mm512_setzero_ps();
+            const __m512d zeros_pd = _mm512_setzero_pd();
+
+            datapoint_idx_t row = begin_row;
+            for (; row + 16 <= end_row; row += 16) {
+                const __m512i rows = _mm512_add_epi32(_mm512_set1_epi32(static_cast<int32_t>(row)), lane_offsets);
+                __m512i current = _mm512_set1_epi32(root);
+                for (depth_idx_t depth = 0; depth < maximum_depth; depth++) {
+                    const __mmask16 active = _mm512_cmpge_epi32_mask(current, zeros);
+                    if (active == 0) {
+                        break;
+                    }
+                    const __m512i feat_1s = _mm512_mask_i32gather_epi32(zeros, active, current, &feat_1[0], 4);
+                    const __m512i feat_2s = _mm512_mask_i32gather_epi32(zeros, active, current, &feat_2[0], 4);
+                    const __m512 value_1 = _mm512_mask_i32gather_ps(zeros_ps, active, _mm512_add_epi32(_mm512_mullo_epi32(feat_1s, strides), rows), features, 4);
+                    const __m512 value_2 = _mm512_mask_i32gather_ps(zeros_ps, active, _mm512_add_epi32(_mm512_mullo_epi32(feat_2s, strides), rows), features, 4);
+                    const __m512 node_thresh = _mm512_mask_i32gather_ps(zeros_ps, active, current, &thresh[0], 4);
+
+                    __mmask16 go_left = 0;
+                    for (int half = 0; half < 2; half++) {
+                        const __mmask8 half_active = static_cast<__mmask8>(active >> (8 * half));
+                        // Zero masked forms of the conversions and extracts, as the plain ones leave -Wall
+                        // thinking something is uninitialised
+                        const __m256i half_node = (half == 0) ? _mm512_maskz_extracti64x4_epi64(0xF, current, 0)
+                                                              : _mm512_maskz_extracti64x4_epi64(0xF, current, 1);
+                        const __m512d half_value_1 = _mm512_maskz_cvtps_pd(0xFF, upper_or_lower_half(value_1, half));
+                        const __m512d half_value_2 = _mm512_maskz_cvtps_pd(0xFF, upper_or_lower_half(value_2, half));
+                        const __m512d half_thresh = _mm512_maskz_cvtps_pd(0xFF, upper_or_lower_half(node_thresh, half));
+                        const __m512d weights_1 = _mm512_mask_i32gather_pd(zeros_pd, half_active, half_node, &weight_feat_1[0], 8);
+                        const __m512d weights_2 = _mm512_mask_i32gather_pd(zeros_pd, half_active, half_node, &weight_feat_2[0], 8);
+                        const __m512d test_val = _mm512_add_pd(_mm512_mul_pd(half_value_1, weights_1),
+                                                               _mm512_mul_pd(half_value_2, weights_2));
+                        go_left |= static_cast<__mmask16>(_mm512_cmp_pd_mask(test_val, half_thresh, _CMP_LE_OQ)) << (8 * half);
+                    }
+
+                    const __m512i twice = _mm512_add_epi32(current, current);
+                    const __m512i child_idx = _mm512_mask_add_epi32(twice, static_cast<__mmask16>(~go_left), twice, ones);
+                    current = _mm512_mask_i32gather_epi32(current, active, child_idx, children, 4);
+                }
+                _mm512_storeu_si512(refs_out + (row - begin_row), current);
+            }
+            return row;
+        }
+
+        // Lanes 0-7 or 8-15 of a vector of floats
+        __attribute__((target("avx512f")))
+        static inline __m256 upper_or_lower_half(const __m512 values, const int half) {
+            return _mm256_castpd_ps((half == 0) ? _mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(values), 0)
+                                                : _mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(values), 1));
+        }
+#endif
+    };
+}
+
+#endif
@@ -27,6 +27,7 @@ namespace garf {
 
         RngSource rng;
         bool_vec samples_are_out_of_bag(forest_stats.num_training_datapoints);
+        bool_vec samples_in_bag(forest_stats.num_training_datapoints);
         tree_idx_t num_trees = forest_stats.num_trees;
         datapoint_idx_t num_out_of_bag;
 
@@ -55,20 +56,12 @@ namespace garf {
             samples_are_out_of_bag.setOnes();
 
             // Make out of bag mask
-            const datapoint_idx_t samples_in_tree = trees[t].get_root().num_samples();
-            const data_indices_vec & root_node_samples = trees[t].get_root().training_data_indices;
-            num_out_of_bag = samples_in_tree;
-                
-            // std::cout << "[t" << t << "]: in bag: " << root_node_samples.transpose() << std::endl;
-
+            num_out_of_bag = 0;
+            trees[t].in_bag_mask(&samples_in_bag);
             for (datapoint_idx_t d = 0; d < forest_stats.num_training_datapoints; d++) {
-                if (samples_are_out_of_bag(root_node_samples(d))) {
-                    // If we are here then the current datapoint was previously thought
-                    // to be out of bag. It is actually not. Therefore we decrement the number
-                    // of out of bag datapoints we have (which started off at the full number),
-                    // and mark it as being not out of bag so we don't count it again.
-                    num_out_of_bag--;
-                    samples_are_out_of_bag(root_node_samples(d)) = false;
+                samples_are_out_of_bag(d) = !samples_in_bag(d);
+                if (samples_are_out_of_bag(d)) {
+                    num_out_of_bag++;
                 }
             }
 
@@ -0,0 +1,231 @@
+#ifndef GARF_LAZY_FOREST_HPP
+#define GARF_LAZY_FOREST_HPP
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+// Needs the binary format, so GARF_SERIALIZE_ENABLE must be defined
+#include "regression_forest.hpp"
+
+namespace garf {
+
+    // Predict only forest over a file from RegressionForest::save_forest, for forests too big to
+    // keep in memory or where only some trees are needed. Opening one reads just the header,
+    // options and tree offset table - each tree is read from disk and decoded the first time
+    // it's asked for (by get_tree or predict), then kept in a least recently used cache. Once
+    // the cached trees add up to more than max_resident_bytes the coldest are dropped, and read
+    // again if they are needed later. Trees are charged what they take once decoded (see
+    // RegressionTree::memory_bytes), which is several times the size of their blocks in the
+    // file - every node is its own allocation, with a full covariance matrix.
+    //
+    // get_tree hands out shared pointers, so a tree being used is never freed under the user
+    // even if the cache drops it. The cache is behind a mutex, so one LazyForest can be shared
+    // between threads - trees are decoded outside it, so threads only wait on each other for
+    // cache bookkeeping and the file reads themselves. Two threads which miss on the same tree
+    // at once may both decode it, the second copy is then thrown away. Only version 2 binary
+    // files (which have the offset table) can be used
+    // like this - loading an older file and saving it again converts it.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    class LazyForest {
+    public:
+        typedef RegressionTree<FeatT, LabT, SplitT, SplFitterT> tree_t;
+
+        explicit LazyForest(const std::string & filename,
+                            const size_t _max_resident_bytes = std::numeric_limits<size_t>::max());
+
+        // Options as saved with the forest. Only predict_options matters here.
+        ForestOptions forest_options;
+        TreeOptions tree_options;
+        SplitOptions split_options;
+        PredictOptions predict_options;
+
+        // The cache is only trimmed when a tree is read, so lowering this takes effect gradually
+        size_t max_resident_bytes;
+
+        inline const ForestStats & stats() const { return forest_stats; }
+
+        // Tree t, reading it from disk if it isn't cached
+        boost::shared_ptr<const tree_t> get_tree(const tree_idx_t t) const;
+
+        // Same outputs as RegressionForest::predict (on a forest which isn't compiled for
+        // inference). Goes through the trees one at a time, evaluating every row on each, so
+        // only one tree has to be in memory at once.
+        void predict(const feature_mtx<FeatT> & features,
+                     label_mtx<LabT> * const labels_out,
+                     label_mtx<LabT> * const variances_out = NULL,
+                     tree_idx_mtx * const leaf_indices_out = NULL) const;
+
+        size_t num_resident_trees() const;
+        size_t resident_bytes() const;
+
+    private:
+        ForestStats forest_stats;
+
+        // Where each tree's block is in the file
+        std::vector<uint64_t> tree_offsets;
+        std::vector<uint64_t> tree_sizes;
+
+        // Reading a block means seeking, so one thread at a time
+        mutable std::mutex file_mutex;
+        mutable std::ifstream file;
+
+        // Everything below is guarded by cache_mutex
+        mutable std::mutex cache_mutex;
+        mutable std::vector<boost::shared_ptr<const tree_t> > cached_trees;
+        mutable std::vector<size_t> cached_tree_bytes;
+        mutable std::list<tree_idx_t> lru;  // most recently used at the front
+        mutable std::vector<std::list<tree_idx_t>::iterator> lru_positions;
+        mutable size_t cached_bytes;
+
+        // Not copyable, the cache and file belong to one object
+        LazyForest(const LazyForest &);
+        LazyForest & operator= (const LazyForest &);
+    };
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    LazyForest<FeatT, LabT, SplitT, SplFitterT>::LazyForest(const std::string & filename, const size_t _max_resident_bytes)
+        : max_resident_bytes(_max_resident_bytes), cached_bytes(0) {
+        file.open(filename.c_str(), std::ios::binary);
+        if (!file) {
+            throw std::invalid_argument("couldn't open " + filename + " for reading");
+        }
+        BinaryForestHeader header;
+        uint64_t table_begin;
+        const uint64_t file_size = read_binary_forest_prefix(file, &header, &forest_options, &tree_options,
+                                                             &split_options, &predict_options, &table_begin);
+        check_binary_forest_header<FeatT, LabT, SplitT>(header);
+        if (header.format_version < 2) {
+            throw std::invalid_argument(filename + " has no tree offset table, load and save it again to add one");
+        }
+        if (!header.trained) {
+            throw std::invalid_argument("cannot open lazy forest, forest in " + filename + " is not trained");
+        }
+        forest_stats = header.stats;
+
+        const tree_idx_t num_trees = forest_stats.num_trees;
+        std::vector<char> table;
+        if (static_cast<uint64_t>(num_trees) > ((file_size - table_begin) / (2 * sizeof(uint64_t)))) {
+            throw std::invalid_argument("forest file is truncated or corrupt");
+        }
+        table.resize(num_trees * 2 * sizeof(uint64_t));
+        file.seekg(table_begin, std::ios::beg);
+        file.read(table.data(), table.size());
+        BinaryReader table_in(table.data(), table.data() + table.size());
+        table_in.read_vector(&tree_offsets, num_trees);
+        table_in.read_vector(&tree_sizes, num_trees);
+
+        // Make the offsets absolute, checking every block is inside the file
+        const uint64_t blocks_begin = table_begin + table.size();
+        for (tree_idx_t t = 0; t < num_trees; t++) {
+            if ((tree_offsets[t] > (file_size - blocks_begin)) || (tree_sizes[t] > (file_size - blocks_begin - tree_offsets[t]))) {
+                throw std::invalid_argument("forest file is truncated or corrupt");
+            }
+            tree_offsets[t] += blocks_begin;
+        }
+
+        cached_trees.resize(num_trees);
+        cached_tree_bytes.resize(num_trees, 0);
+        lru_positions.resize(num_trees);
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    boost::shared_ptr<const RegressionTree<FeatT, LabT, SplitT, SplFitterT> >
+    LazyForest<FeatT, LabT, SplitT, SplFitterT>::get_tree(const tree_idx_t t) const {
+        if ((t < 0) || (t >= forest_stats.num_trees)) {
+            throw std::invalid_argument("invalid tree_id provided");
+        }
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            if (cached_trees[t].get() != NULL) {
+                lru.splice(lru.begin(), lru, lru_positions[t]);
+                return cached_trees[t];
+            }
+        }
+
+        std::vector<char> block(tree_sizes[t]);
+        {
+            std::lock_guard<std::mutex> lock(file_mutex);
+            file.clear();
+            file.seekg(tree_offsets[t], std::ios::beg);
+            file.read(block.data(), block.size());
+            if (static_cast<uint64_t>(file.gcount()) != tree_sizes[t]) {
+                throw std::invalid_argument("couldn't read tree from forest file");
+            }
+        }
+        BinaryReader in(block.data(), block.data() + block.size());
+        boost::shared_ptr<tree_t> tree(new tree_t());
+        tree->load_binary(in, forest_stats.label_dimensions);
+        if (in.remaining() != 0) {
+            throw std::invalid_argument("forest file is truncated or corrupt");
+        }
+        const size_t tree_bytes = tree->memory_bytes();
+
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cached_trees[t].get() != NULL) {
+            // Another thread got there first, keep theirs so everyone shares one copy
+            lru.splice(lru.begin(), lru, lru_positions[t]);
+            return cached_trees[t];
+        }
+
+        // Make room, though the tree just read is always kept
+        while (!lru.empty() && ((cached_bytes + tree_bytes) > max_resident_bytes)) {
+            const tree_idx_t coldest = lru.back();
+            lru.pop_back();
+            cached_trees[coldest].reset();
+            cached_bytes -= cached_tree_bytes[coldest];
+        }
+        cached_trees[t] = tree;
+        cached_tree_bytes[t] = tree_bytes;
+        lru.push_front(t);
+        lru_positions[t] = lru.begin();
+        cached_bytes += tree_bytes;
+        return cached_trees[t];
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void LazyForest<FeatT, LabT, SplitT, SplFitterT>::predict(const feature_mtx<FeatT> & features,
+                                                              label_mtx<LabT> * const labels_out,
+                                                              label_mtx<LabT> * const variances_out,
+                                                              tree_idx_mtx * const leaf_indices_out) const {
+        check_predict_arguments("LazyForest::predict()", features, forest_stats.data_dimensions,
+                                forest_stats.label_dimensions, forest_stats.num_trees,
+                                labels_out, variances_out, leaf_indices_out);
+
+        TreeLeafCombiner<LabT> combiner(forest_stats.num_trees, labels_out, variances_out, leaf_indices_out);
+        feature_vec<FeatT> fvec(forest_stats.data_dimensions);
+        for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+            const boost::shared_ptr<const tree_t> tree = get_tree(t);
+            for (datapoint_idx_t i = 0; i < features.rows(); i++) {
+                fvec = features.row(i);
+                const RegressionNode<FeatT, LabT, SplitT, SplFitterT> & node = tree->evaluate(fvec, predict_options);
+                PredictedLeaf<LabT> leaf;
+                leaf.mean = node.dist.mean.data();
+                leaf.node_id = node.node_id;
+                combiner.add(i, t, leaf);
+            }
+        }
+        combiner.finish();
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    size_t LazyForest<FeatT, LabT, SplitT, SplFitterT>::num_resident_trees() const {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        return lru.size();
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    size_t LazyForest<FeatT, LabT, SplitT, SplFitterT>::resident_bytes() const {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        return cached_bytes;
+    }
+}
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef GARF_MAPPED_FOREST_HPP
+#define GARF_MAPPED_FOREST_HPP
+
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "regression_forest.hpp"
+#include "binary_format.hpp"
+
+namespace garf {
+
+    // Forest files which are mmapped and predicted from in place, for services which want to
+    // start instantly, or to have several processes share one copy of a model through the page
+    // cache. save_mapped_forest writes the arrays of a FlatTree for every tree (see
+    // RegressionForest::compile_for_inference) exactly as they sit in memory, each aligned to
+    // mapped_forest_alignment, and MappedForest maps the file read only and points straight into
+    // it - nothing is parsed or copied. The flip side is that these files only make sense on a
+    // machine with the same byte order and struct layout as the one which wrote them. The
+    // header records enough to check that, and MappedForest refuses anything else. They hold
+    // nothing needed for training, so keep the file from save_forest as well.
+    //
+    //     MappedForestHeader
+    //     MappedTreeEntry for each tree, giving the offsets of its arrays
+    //     the arrays
+
+    const char mapped_forest_magic[8] = {'G', 'A', 'R', 'F', 'M', 'A', 'P', '\0'};
+    const uint32_t mapped_forest_format_version = 1;
+    const uint32_t mapped_forest_byte_order_mark = 0x01020304;
+    const uint64_t mapped_forest_alignment = 64;
+
+    struct MappedForestHeader {
+        char magic[8];
+        uint32_t format_version;
+        uint32_t byte_order_mark;
+        uint32_t header_size;
+        uint32_t tree_entry_size;
+        uint32_t feature_size;
+        uint32_t label_size;
+        uint32_t split_size;
+        uint8_t feature_type;  // binary_scalar_code
+        uint8_t label_type;
+        uint8_t padding[2];
+        char split_type[32];
+        int64_t data_dimensions;
+        int64_t label_dimensions;
+        int64_t num_training_datapoints;
+        int64_t num_trees;
+        int64_t maximum_depth;  // the forest's predict_options.maximum_depth when saved
+        uint64_t tree_entries_offset;
+    };
+
+    struct MappedTreeEntry {
+        int32_t root;
+        int32_t padding;
+        uint64_t num_internal_nodes;
+        uint64_t num_leaves;
+        uint64_t splits_offset;
+        uint64_t children_offset;
+        uint64_t leaf_means_offset;
+        uint64_t leaf_node_ids_offset;
+        uint64_t internal_means_offset;
+        uint64_t internal_node_ids_offset;
+    };
+
+    // Append bytes to buffer at the next aligned offset, returning that offset
+    inline uint64_t append_aligned(std::vector<char> * const buffer, const void * const data, const size_t num_bytes) {
+        const uint64_t offset = ((buffer->size() + mapped_forest_alignment - 1) / mapped_forest_alignment) * mapped_forest_alignment;
+        buffer->resize(offset + num_bytes, 0);
+        if (num_bytes > 0) {
+            std::memcpy(&(*buffer)[offset], data, num_bytes);
+        }
+        return offset;
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void save_mapped_forest(const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & forest, std::string filename) {
+        static_assert(std::is_trivially_copyable<SplitT<FeatT> >::value, "splits are written to mapped forests as raw bytes");
+        if (!forest.is_trained()) {
+            throw std::invalid_argument("cannot save mapped forest, forest not trained yet");
+        }
+        const ForestStats & stats = forest.stats();
+
+        MappedForestHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, mapped_forest_magic, sizeof(header.magic));
+        header.format_version = mapped_forest_format_version;
+        header.byte_order_mark = mapped_forest_byte_order_mark;
+        header.header_size = sizeof(MappedForestHeader);
+        header.tree_entry_size = sizeof(MappedTreeEntry);
+        header.feature_size = sizeof(FeatT);
+        header.label_size = sizeof(LabT);
+        header.split_size = sizeof(SplitT<FeatT>);
+        header.feature_type = binary_scalar_code<FeatT>();
+        header.label_type = binary_scalar_code<LabT>();
+        std::strncpy(header.split_type, SplitT<FeatT>().name(), sizeof(header.split_type) - 1);
+        header.data_dimensions = stats.data_dimensions;
+        header.label_dimensions = stats.label_dimensions;
+        header.num_training_datapoints = stats.num_training_datapoints;
+        header.num_trees = stats.num_trees;
+        header.maximum_depth = forest.predict_options.maximum_depth;
+
+        // Header and tree table are filled in once all the offsets are known
+        std::vector<char> contents;
+        append_aligned(&contents, &header, sizeof(header));
+        header.tree_entries_offset = append_aligned(&contents, NULL, 0);
+        contents.resize(header.tree_entries_offset + (stats.num_trees * sizeof(MappedTreeEntry)), 0);
+        std::vector<MappedTreeEntry> entries(stats.num_trees);
+
+        for (tree_idx_t t = 0; t < stats.num_trees; t++) {
+            FlatTree<FeatT, LabT, SplitT> flat_tree;
+            flat_tree.compile(forest.get_tree(t).get_root(), stats.label_dimensions);
+            MappedTreeEntry & entry = entries[t];
+            std::memset(&entry, 0, sizeof(entry));
+            entry.root = flat_tree.root;
+            entry.num_internal_nodes = flat_tree.num_internal_nodes();
+            entry.num_leaves = flat_tree.num_leaves();
+            entry.splits_offset = append_aligned(&contents, flat_tree.splits.data(),
+                                                 flat_tree.splits.size() * sizeof(SplitT<FeatT>));
+            entry.children_offset = append_aligned(&contents, flat_tree.children.data(),
+                                                   flat_tree.children.size() * sizeof(int32_t));
+            entry.leaf_means_offset = append_aligned(&contents, flat_tree.leaf_means.data(),
+                                                     flat_tree.leaf_means.size() * sizeof(LabT));
+            entry.leaf_node_ids_offset = append_aligned(&contents, flat_tree.leaf_node_ids.data(),
+                                                        flat_tree.leaf_node_ids.size() * sizeof(node_idx_t));
+            entry.internal_means_offset = append_aligned(&contents, flat_tree.internal_means.data(),
+                                                         flat_tree.internal_means.size() * sizeof(LabT));
+            entry.internal_node_ids_offset = append_aligned(&contents, flat_tree.internal_node_ids.data(),
+                                                            flat_tree.internal_node_ids.size() * sizeof(node_idx_t));
+        }
+
+        std::memcpy(&contents[0], &header, sizeof(header));
+        if (stats.num_trees > 0) {
+            std::memcpy(&contents[header.tree_entries_offset], entries.data(), stats.num_trees * sizeof(MappedTreeEntry));
+        }
+
+        std::ofstream ofs(filename.c_str(), std::ios::binary);
+        if (!ofs) {
+            throw std::invalid_argument("couldn't open " + filename + " for writing");
+        }
+        ofs.write(contents.data(), contents.size());
+        if (!ofs) {
+            throw std::invalid_argument("couldn't write mapped forest to " + filename);
+        }
+    }
+
+    // Predict only forest over a file from save_mapped_forest. Opening one maps the file and
+    // checks the header, that every array lies inside the file and that the children of every
+    // node lead down to a leaf - that is one pass over the children, the rest of each tree is
+    // only paged in as predictions touch it. Predictions are exactly those of the forest
+    // which was saved. The mapping is read only and nothing is modified after construction, so
+    // any number of threads can predict at once.
+    template<typename FeatT, typename LabT, template<typename> class SplitT>
+    class MappedForest {
+    public:
+        explicit MappedForest(const std::string & filename);
+
+        // Only maximum_depth is used, which starts as it was in the saved forest
+        PredictOptions predict_options;
+
+        inline const ForestStats & stats() const { return forest_stats; }
+
+        void predict(const feature_mtx<FeatT> & features,
+                     label_mtx<LabT> * const labels_out,
+                     label_mtx<LabT> * const variances_out = NULL,
+                     tree_idx_mtx * const leaf_indices_out = NULL) const;
+
+        // As RegressionForest::predict_one
+        void predict_one(const FeatT * const features, LabT * const mean_out, LabT * const var_out = NULL) const;
+
+    private:
+        boost::interprocess::file_mapping file;
+        boost::interprocess::mapped_region region;
+        ForestStats forest_stats;
+        std::vector<FlatTreeView<FeatT, LabT, SplitT> > trees;
+
+        // Pointer to count Ts at offset in the file, checking they are inside it and aligned
+        template<typename T>
+        const T * array_at(const uint64_t offset, const uint64_t count) const;
+
+        // Not copyable, the mapping belongs to one object
+        MappedForest(const MappedForest &);
+        MappedForest & operator= (const MappedForest &);
+    };
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT>
+    template<typename T>
+    const T * MappedForest<FeatT, LabT, SplitT>::array_at(const uint64_t offset, const uint64_t count) const {
+        const uint64_t size = region.get_size();
+        if ((offset > size) || (count > ((size - offset) / sizeof(T))) || ((offset % alignof(T)) != 0)) {
+            throw std::invalid_argument("mapped forest file is truncated or corrupt");
+        }
+        return reinterpret_cast<const T *>(static_cast<const char *>(region.get_address()) + offset);
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT>
+    MappedForest<FeatT, LabT, SplitT>::MappedForest(const std::string & filename) {
+        try {
+            boost::interprocess::file_mapping mapping(filename.c_str(), boost::interprocess::read_only);
+            boost::interprocess::mapped_region mapped(mapping, boost::interprocess::read_only);
+            file.swap(mapping);
+            region.swap(mapped);
+        } catch (const boost::interprocess::interprocess_exception & e) {
+            throw std::invalid_argument("couldn't map " + filename + ": " + e.what());
+        }
+
+        const MappedForestHeader & header = *array_at<MappedForestHeader>(0, 1);
+        if (std::memcmp(header.magic, mapped_forest_magic, sizeof(header.magic)) != 0) {
+            throw std::invalid_argument(filename + " is not a mapped forest file");
+        } else if (header.format_version != mapped_forest_format_version) {
+            throw std::invalid_argument("mapped forest file " + filename + " is from a different version of garf");
+        } else if ((header.byte_order_mark != mapped_forest_byte_order_mark) ||
+                   (header.header_size != sizeof(MappedForestHeader)) ||
+                   (header.tree_entry_size != sizeof(MappedTreeEntry)) ||
+                   (header.split_size != sizeof(SplitT<FeatT>))) {
+            throw std::invalid_argument("mapped forest file " + filename + " was written on an incompatible machine");
+        } else if ((header.feature_type != binary_scalar_code<FeatT>()) || (header.feature_size != sizeof(FeatT)) ||
+                   (header.label_type != binary_scalar_code<LabT>()) || (header.label_size != sizeof(LabT)) ||
+                   (std::strncmp(header.split_type, SplitT<FeatT>().name(), sizeof(header.split_type)) != 0)) {
+            throw std::invalid_argument("mapped forest file " + filename + " is for a different kind of forest");
+        } else if ((header.num_trees < 1) || (header.label_dimensions < 1) || (header.data_dimensions < 1)) {
+            throw std::invalid_argument("mapped forest file is truncated or corrupt");
+        }
+
+        forest_stats.data_dimensions = header.data_dimensions;
+        forest_stats.label_dimensions = header.label_dimensions;
+        forest_stats.num_training_datapoints = header.num_training_datapoints;
+        forest_stats.num_trees = header.num_trees;
+        predict_options.maximum_depth = header.maximum_depth;
+
+        const MappedTreeEntry * const entries = array_at<MappedTreeEntry>(header.tree_entries_offset, header.num_trees);
+        trees.resize(header.num_trees);
+        for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+            const MappedTreeEntry & entry = entries[t];
+            const uint64_t label_dims = forest_stats.label_dimensions;
+            if ((entry.num_internal_nodes > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) ||
+                (entry.num_leaves > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) ||
+                (entry.num_leaves != entry.num_internal_nodes + 1) ||
+                ((entry.root >= 0) ? (static_cast<uint64_t>(entry.root) >= entry.num_internal_nodes)
+                                   : (static_cast<uint64_t>(~entry.root) >= entry.num_leaves))) {
+                throw std::invalid_argument("mapped forest file is truncated or corrupt");
+            }
+            FlatTreeView<FeatT, LabT, SplitT> & tree = trees[t];
+            tree.label_dims = forest_stats.label_dimensions;
+            tree.root = entry.root;
+            tree.splits = array_at<SplitT<FeatT> >(entry.splits_offset, entry.num_internal_nodes);
+            tree.children = array_at<int32_t>(entry.children_offset, 2 * entry.num_internal_nodes);
+            tree.leaf_means = array_at<LabT>(entry.leaf_means_offset, entry.num_leaves * label_dims);
+            tree.leaf_node_ids = array_at<node_idx_t>(entry.leaf_node_ids_offset, entry.num_leaves);
+            tree.internal_means = array_at<LabT>(entry.internal_means_offset, entry.num_internal_nodes * label_dims);
+            tree.internal_node_ids = array_at<node_idx_t>(entry.internal_node_ids_offset, entry.num_internal_nodes);
+
+            // Children must be leaves of this tree or internal nodes after their parent (as
+            // FlatTree::compile lays them out), so following them always ends at a leaf
+            const int64_t num_internal_nodes = static_cast<int64_t>(entry.num_internal_nodes);
+            const int64_t num_leaves = static_cast<int64_t>(entry.num_leaves);
+            for (int64_t n = 0; n < num_internal_nodes; n++) {
+                for (int64_t side = 0; side < 2; side++) {
+                    const int64_t child = tree.children[2 * n + side];
+                    if ((child < -num_leaves) || (child >= num_internal_nodes) || ((child >= 0) && (child <= n))) {
+                        throw std::invalid_argument("mapped forest file is truncated or corrupt");
+                    }
+                }
+            }
+        }
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT>
+    void MappedForest<FeatT, LabT, SplitT>::predict(const feature_mtx<FeatT> & features,
+                                                    label_mtx<LabT> * const labels_out,
+                                                    label_mtx<LabT> * const variances_out,
+                                                    tree_idx_mtx * const leaf_indices_out) const {
+        check_predict_arguments("MappedForest::predict()", features, forest_stats.data_dimensions,
+                                forest_stats.label_dimensions, forest_stats.num_trees,
+                                labels_out, variances_out, leaf_indices_out);
+
+        TreeLeafCombiner<LabT> combiner(forest_stats.num_trees, labels_out, variances_out, leaf_indices_out);
+        feature_vec<FeatT> fvec(forest_stats.data_dimensions);
+        for (datapoint_idx_t i = 0; i < features.rows(); i++) {
+            fvec = features.row(i);
+            for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+                combiner.add_to_row(i, t, trees[t].evaluate(fvec, predict_options.maximum_depth));
+            }
+            combiner.end_row(i);
+        }
+        combiner.finish();
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT>
+    void MappedForest<FeatT, LabT, SplitT>::predict_one(const FeatT * const features,
+                                                        LabT * const mean_out,
+                                                        LabT * const var_out) const {
+        if ((features == NULL) || (mean_out == NULL)) {
+            throw std::invalid_argument("MappedForest::predict_one(): features and mean_out must be supplied");
+        }
+        const Eigen::Map<const feature_vec<FeatT> > fvec(features, forest_stats.data_dimensions);
+        combine_leaf_means_one(forest_stats.num_trees, forest_stats.label_dimensions,
+                               [&](const tree_idx_t t) { return trees[t].evaluate(fvec, predict_options.maximum_depth).mean; },
+                               mean_out, var_out);
+    }
+}
+
+#endif
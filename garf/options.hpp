@@ -15,7 +15,24 @@ namespace garf {
     struct ForestOptions {
         tree_idx_t max_num_trees;
         bool bagging;
-        ForestOptions() : max_num_trees(2), bagging(true) {}
+
+        // Turn this off to throw away each tree's training indices once it is trained (and
+        // not save them). Nodes keep their sample counts, and trees keep an in bag bitmap
+        // so feature importance still works, but node training indices become unavailable.
+        bool keep_training_indices;
+
+        // When bagging, give each tree every drawn datapoint once along with how many times it
+        // was drawn, rather than repeating indices. Statistically the same, but training only
+        // visits the ~63% of rows that were drawn, once each.
+        bool counted_bagging;
+
+        // When bagging, each tree is given round(bag_fraction * num_datapoints) samples, drawn
+        // with or without replacement. Small fractions make each tree much cheaper to train.
+        double bag_fraction;
+        bool bag_with_replacement;
+
+        ForestOptions() : max_num_trees(2), bagging(true), keep_training_indices(true), counted_bagging(false),
+                          bag_fraction(1.0), bag_with_replacement(true) {}
 #ifdef GARF_SERIALIZE_ENABLE
     private:
         friend class boost::serialization::access;
@@ -30,7 +47,19 @@ namespace garf {
         depth_idx_t max_depth;
         datapoint_idx_t min_sample_count; // don't bother with a split if below this
         double min_variance;
-        TreeOptions() : max_depth(2), min_sample_count(10), min_variance(0.00001) {}
+
+        // GROW_LEVEL_WISE builds each tree one depth level at a time, making a fixed number
+        // of sequential passes over the tree's data per level rather than recursing
+        // node by node. Only supports SEARCH_RANDOM_THRESHOLDS split search.
+        tree_growth_t growth;
+
+        // With TBB, depth first growth trains the two subtrees of any node holding at least
+        // this many datapoints as parallel tasks, so forests with fewer trees than cores still
+        // use every core. Zero means subtrees are always trained serially.
+        datapoint_idx_t min_samples_for_subtree_task;
+
+        TreeOptions() : max_depth(2), min_sample_count(10), min_variance(0.00001), growth(GROW_DEPTH_FIRST),
+                        min_samples_for_subtree_task(0) {}
 #ifdef GARF_SERIALIZE_ENABLE
     private:
         friend class boost::serialization::access;
@@ -46,9 +75,32 @@ namespace garf {
         bool properly_random;  // Turn this off to make the system deterministic, for testing etc
         datapoint_idx_t num_per_side_for_viable_split;
 
+        // SEARCH_HISTOGRAM quantizes every feature once per forest into num_histogram_bins
+        // bins, then scores every bin boundary of each candidate feature from per-bin label
+        // statistics. Only supported by the axis aligned fitter. SEARCH_EXACT sorts the
+        // node's values for each candidate feature and sweeps every distinct threshold,
+        // updating the child label statistics incrementally. threshes_per_split is ignored
+        // by both of these.
+        split_search_t split_search;
+        split_idx_t num_histogram_bins;
+
+        // With TBB, random threshold search at any node holding at least this many datapoints
+        // scores the candidate (feature, threshold) pairs in parallel. The chosen split is the
+        // same as the serial search would pick. Zero means always search serially.
+        datapoint_idx_t min_samples_for_parallel_split_search;
+
+        // Random threshold and exact split search gather the node's values for this many
+        // candidate features at a time, keeping only the best split found so far, so fitter
+        // scratch is num_datapoints x feature_block_size rather than num_datapoints x
+        // num_splits_to_try. Zero means gather every candidate at once. The split chosen
+        // doesn't depend on the block size.
+        split_idx_t feature_block_size;
+
         SplitOptions() :
             num_splits_to_try(5), threshes_per_split(3), 
-            properly_random(true), num_per_side_for_viable_split(5) {}
+            properly_random(true), num_per_side_for_viable_split(5),
+            split_search(SEARCH_RANDOM_THRESHOLDS), num_histogram_bins(256),
+            min_samples_for_parallel_split_search(0), feature_block_size(0) {}
 #ifdef GARF_SERIALIZE_ENABLE
     private:
         friend class boost::serialization::access;
@@ -60,7 +112,34 @@ namespace garf {
     // Options for how we do the prediction (early stopping at maximum depth for example)
     struct PredictOptions {
         depth_idx_t maximum_depth;
-        PredictOptions() : maximum_depth(100) {}
+
+        // With TBB, batches of more than this many rows are predicted in parallel, with each
+        // task taking at most this many rows. Zero means always predict serially.
+        datapoint_idx_t rows_per_parallel_task;
+
+        // If non zero, predict blocks of this many rows at a time, sending the whole block
+        // through one tree before moving on to the next, rather than sending each row
+        // through every tree. Helps when the trees are too big to all stay in cache.
+        datapoint_idx_t tree_major_block_size;
+
+        // For forests with float features which have been compiled for inference, tree major
+        // prediction sends 8 (AVX2) or 16 (AVX-512) rows through a tree together using the best
+        // of these the CPU supports, up to this. SIMD_NONE keeps to one row at a time. The
+        // results are the same either way.
+        simd_level_t max_simd_level;
+
+        // RegressionForest::predict_anytime visits the trees for each datapoint in turn, and stops
+        // once the standard error of the mean over the trees so far is at most
+        // anytime_std_error_tolerance in every label dimension (zero means never), as long as at
+        // least anytime_min_trees have been used. It never uses more than anytime_max_trees
+        // (zero means all of them).
+        double anytime_std_error_tolerance;
+        tree_idx_t anytime_min_trees;
+        tree_idx_t anytime_max_trees;
+
+        PredictOptions() : maximum_depth(100), rows_per_parallel_task(1024), tree_major_block_size(0),
+                           max_simd_level(SIMD_AVX512), anytime_std_error_tolerance(0.0),
+                           anytime_min_trees(2), anytime_max_trees(0) {}
 #ifdef GARF_SERIALIZE_ENABLE
     private:
         friend class boost::serialization::access;
@@ -0,0 +1,192 @@
+#ifndef GARF_QUICK_SCORER_HPP
+#define GARF_QUICK_SCORER_HPP
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "regression_forest.hpp"
+
+namespace garf {
+
+    // Alternative predictor for forests of shallow axis aligned trees, following QuickScorer
+    // (Lucchese et al, SIGIR 2015). The leaves of each tree are numbered left to right and a
+    // datapoint's position in a tree is a bitvector of the leaves it could still reach, starting
+    // all ones. Every split the datapoint would send right clears the bits of the leaves in that
+    // split's left subtree, and the leaf it reaches is then the lowest bit still set. Splits are
+    // grouped by feature and sorted by threshold, so for each feature we just scan up the
+    // thresholds until the datapoint's value no longer exceeds them - no branching on the tree
+    // structure, and all the data is in a few contiguous arrays.
+    //
+    // Only trees with at most max_leaves_per_tree leaves can be handled. The forest's
+    // predict_options.maximum_depth at construction time is baked in. Predictions (means,
+    // variances and leaf indices) are exactly the same as RegressionForest::predict.
+    template<typename FeatT, typename LabT>
+    class QuickScorer {
+    public:
+        typedef uint64_t leaf_bitvector_t;
+        static const int32_t max_leaves_per_tree = 64;
+
+        template<template<typename, typename> class SplFitterT>
+        explicit QuickScorer(const RegressionForest<FeatT, LabT, AxisAlignedSplt, SplFitterT> & forest);
+
+        void predict(const feature_mtx<FeatT> & features,
+                     label_mtx<LabT> * const labels_out,
+                     label_mtx<LabT> * const variances_out = NULL,
+                     tree_idx_mtx * const leaf_indices_out = NULL) const;
+
+        inline tree_idx_t num_trees() const { return num_trees_; }
+
+    private:
+        tree_idx_t num_trees_;
+        feat_idx_t data_dimensions;
+        label_idx_t label_dimensions;
+
+        // Every split in the forest, grouped by feature and in increasing order of threshold
+        // within each feature. Those for feature f are [feature_begin[f], feature_begin[f+1]).
+        std::vector<size_t> feature_begin;
+        std::vector<FeatT> thresholds;
+        std::vector<int32_t> split_tree;
+        std::vector<leaf_bitvector_t> split_mask;  // zeros over the split's left subtree
+
+        // Leaves of tree t are [tree_leaf_begin[t], tree_leaf_begin[t+1]) in these, with the
+        // means packed label_dimensions at a time
+        std::vector<size_t> tree_leaf_begin;
+        std::vector<LabT> leaf_means;
+        std::vector<node_idx_t> leaf_node_ids;
+
+        // Which bits a fresh bitvector for each tree starts with (one per leaf)
+        std::vector<leaf_bitvector_t> initial_bitvectors;
+
+        struct split_entry {
+            FeatT thresh;
+            int32_t tree;
+            leaf_bitvector_t mask;
+            inline bool operator< (const split_entry & other) const { return thresh < other.thresh; }
+        };
+
+        // Number the leaves below node, adding their means and the node's splits. Returns
+        // how many leaves there are below node.
+        template<class NodeT>
+        int32_t add_node(const NodeT & node, const int32_t tree, const int32_t first_leaf,
+                         const depth_idx_t maximum_depth, std::vector<std::vector<split_entry> > * const splits_by_feature);
+    };
+
+    template<typename FeatT, typename LabT>
+    template<template<typename, typename> class SplFitterT>
+    QuickScorer<FeatT, LabT>::QuickScorer(const RegressionForest<FeatT, LabT, AxisAlignedSplt, SplFitterT> & forest) {
+        if (!forest.is_trained()) {
+            throw std::invalid_argument("cannot build QuickScorer, forest not trained yet");
+        }
+        num_trees_ = forest.stats().num_trees;
+        data_dimensions = forest.stats().data_dimensions;
+        label_dimensions = forest.stats().label_dimensions;
+
+        std::vector<std::vector<split_entry> > splits_by_feature(data_dimensions);
+        tree_leaf_begin.push_back(0);
+        for (tree_idx_t t = 0; t < num_trees_; t++) {
+            const int32_t num_leaves = add_node(forest.get_tree(t).get_root(), t, 0,
+                                                forest.predict_options.maximum_depth, &splits_by_feature);
+            tree_leaf_begin.push_back(leaf_node_ids.size());
+            initial_bitvectors.push_back((num_leaves == max_leaves_per_tree) ? ~leaf_bitvector_t(0)
+                                                                           : ((leaf_bitvector_t(1) << num_leaves) - 1));
+        }
+
+        feature_begin.push_back(0);
+        for (feat_idx_t f = 0; f < data_dimensions; f++) {
+            std::vector<split_entry> & splits = splits_by_feature[f];
+            std::stable_sort(splits.begin(), splits.end());
+            for (size_t i = 0; i < splits.size(); i++) {
+                thresholds.push_back(splits[i].thresh);
+                split_tree.push_back(splits[i].tree);
+                split_mask.push_back(splits[i].mask);
+            }
+            feature_begin.push_back(thresholds.size());
+        }
+    }
+
+    template<typename FeatT, typename LabT>
+    template<class NodeT>
+    int32_t QuickScorer<FeatT, LabT>::add_node(const NodeT & node, const int32_t tree, const int32_t first_leaf,
+                                               const depth_idx_t maximum_depth,
+                                               std::vector<std::vector<split_entry> > * const splits_by_feature) {
+        // Prediction stops at maximum_depth, so anything there is effectively a leaf
+        if (node.is_leaf || (node.depth >= maximum_depth)) {
+            if (first_leaf >= max_leaves_per_tree) {
+                throw std::invalid_argument("QuickScorer only supports trees with at most 64 leaves");
+            }
+            leaf_means.insert(leaf_means.end(), node.dist.mean.data(), node.dist.mean.data() + label_dimensions);
+            leaf_node_ids.push_back(node.node_id);
+            return 1;
+        }
+
+        const int32_t num_left = add_node(node.get_left(), tree, first_leaf, maximum_depth, splits_by_feature);
+        const int32_t num_right = add_node(node.get_right(), tree, first_leaf + num_left, maximum_depth, splits_by_feature);
+
+        // Going right rules out every leaf in [first_leaf, first_leaf + num_left)
+        const leaf_bitvector_t left_leaves = ((num_left == max_leaves_per_tree) ? ~leaf_bitvector_t(0)
+                                                                               : ((leaf_bitvector_t(1) << num_left) - 1));
+        split_entry entry;
+        entry.thresh = node.split.thresh;
+        entry.tree = tree;
+        entry.mask = ~(left_leaves << first_leaf);
+        (*splits_by_feature)[node.split.feat_idx].push_back(entry);
+
+        return num_left + num_right;
+    }
+
+    template<typename FeatT, typename LabT>
+    void QuickScorer<FeatT, LabT>::predict(const feature_mtx<FeatT> & features,
+                                           label_mtx<LabT> * const labels_out,
+                                           label_mtx<LabT> * const variances_out,
+                                           tree_idx_mtx * const leaf_indices_out) const {
+        check_predict_arguments("QuickScorer::predict()", features, data_dimensions, label_dimensions, num_trees_,
+                                labels_out, variances_out, leaf_indices_out);
+        const datapoint_idx_t num_datapoints = features.rows();
+
+        labels_out->setZero();
+        if (variances_out != NULL) {
+            variances_out->setZero();
+        }
+
+        std::vector<leaf_bitvector_t> bitvectors(num_trees_);
+        label_vec<LabT> mu_n(label_dimensions);
+        label_vec<LabT> mu_n_minus_1(label_dimensions);
+
+        for (datapoint_idx_t i = 0; i < num_datapoints; i++) {
+            std::copy(initial_bitvectors.begin(), initial_bitvectors.end(), bitvectors.begin());
+
+            // The split test is value <= thresh, so written this way a NaN goes right like it does in the tree
+            for (feat_idx_t f = 0; f < data_dimensions; f++) {
+                const FeatT value = features(i, f);
+                for (size_t s = feature_begin[f]; (s < feature_begin[f + 1]) && !(value <= thresholds[s]); s++) {
+                    bitvectors[split_tree[s]] &= split_mask[s];
+                }
+            }
+
+            mu_n_minus_1.setZero();
+            for (tree_idx_t t = 0; t < num_trees_; t++) {
+                const size_t leaf = tree_leaf_begin[t] + __builtin_ctzll(bitvectors[t]);
+                const Eigen::Map<const label_vec<LabT> > leaf_node_mean(&leaf_means[leaf * label_dimensions], label_dimensions);
+                if (variances_out == NULL) {
+                    labels_out->row(i) += leaf_node_mean;
+                } else {
+                    running_mean_var_step(t, leaf_node_mean, &mu_n, &mu_n_minus_1, variances_out->row(i));
+                }
+                if (leaf_indices_out != NULL) {
+                    leaf_indices_out->coeffRef(i, t) = leaf_node_ids[leaf];
+                }
+            }
+
+            // Same normalisation as RegressionForest::predict_rows
+            if (variances_out == NULL) {
+                labels_out->row(i) /= num_trees_;
+            } else {
+                labels_out->row(i).operator=(mu_n);
+                variances_out->row(i) /= static_cast<double>(num_trees_);
+            }
+        }
+    }
+}
+
+#endif
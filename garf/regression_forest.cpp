@@ -2,6 +2,7 @@
 // #include <glog/logging.h>
 
 #include "util/random_seed.hpp"
+#include "util/bagging.hpp"
 #include <random>
 
 namespace garf {
@@ -21,6 +22,7 @@ namespace garf {
         const feature_mtx<FeatT> & all_features;
         const label_mtx<LabT> & all_labels;
         const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & forest;
+        const util::FeatureBinning<FeatT> * const feature_binning;
     public:
 
         // Need to make this get called with a larger rane
@@ -30,9 +32,8 @@ namespace garf {
             const feat_idx_t data_dimensions = all_features.cols();
             const label_idx_t label_dimensions = all_labels.cols();
 
-            // distribution to pick the bagging indices
-            std::uniform_int_distribution<datapoint_idx_t> bagging_index_picker(0, num_training_datapoints - 1);
-
+            // Each tree only ever sees bag_size datapoints, so that is all the fitter needs room for
+            const datapoint_idx_t bag_size = util::bag_size(forest.forest_options, num_training_datapoints);
 
             // If split_options.properly_random is selected then we will build a proper random sequence in here.
             // If the user has not selected proper randomness this will be a null pointer, which we can safely 
@@ -54,37 +55,64 @@ namespace garf {
             //     std::cout << n << std::endl;
             // }
 
-            SplFitterT<FeatT, LabT> fitter(forest.split_options, num_training_datapoints,
+            SplFitterT<FeatT, LabT> fitter(forest.split_options, bag_size,
                                            data_dimensions, label_dimensions, cout_mutex, seed.get());
+            fitter.feature_binning = feature_binning;
 
             cout_mutex.lock();
             std::cout << this << " got range [" << r.begin() << "," << r.end() << ") grain =  " << r.grainsize() << std::endl;
             cout_mutex.unlock();
 
             for (tree_idx_t t = r.begin(); t != r.end(); t++) {
-                data_indices_vec data_indices(num_training_datapoints);
-                if (forest.forest_options.bagging) {
-                    // bagging: Sample indices from full dataset WITH REPLACEMENT!!!
-                    for (datapoint_idx_t d = 0; d < num_training_datapoints; d++) {
-                        data_indices(d) = bagging_index_picker(fitter.rng);
-                    }
-                } else {
-                    // vector [0, 1, 2, 3, ... num_data_points-1] => no bagging
-                    data_indices.setLinSpaced(num_training_datapoints, 0, num_training_datapoints - 1);
-                }
+                data_indices_vec data_indices;
+                sample_count_vec sample_counts;
+                const bool counted_bagging = util::draw_bag(forest.forest_options, num_training_datapoints,
+                                                            &fitter.rng, &data_indices, &sample_counts);
 
                 trees[t].tree_id = t;
-                trees[t].train(all_features, all_labels, data_indices, forest.tree_options, &fitter);
+                trees[t].train(all_features, all_labels, data_indices, forest.tree_options, &fitter,
+                               counted_bagging ? &sample_counts : NULL);
+                if (!forest.forest_options.keep_training_indices) {
+                    trees[t].discard_training_indices(num_training_datapoints);
+                }
             }
         }
 
         concurrent_tree_trainer(boost::shared_array<RegressionTree<FeatT, LabT, SplitT, SplFitterT> > & _trees,
                                 const feature_mtx<FeatT> & _all_features,
                                 const label_mtx<LabT> & _all_labels,
-                                const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & _forest)
-            : trees(_trees), all_features(_all_features), all_labels(_all_labels), forest(_forest) {
+                                const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & _forest,
+                                const util::FeatureBinning<FeatT> * const _feature_binning)
+            : trees(_trees), all_features(_all_features), all_labels(_all_labels), forest(_forest),
+              feature_binning(_feature_binning) {
+        }
+
+    };
+
+    // Predicts a range of rows using its own scratch for the leaves reached. Rows are written
+    // to independently, so the outputs are the same as predicting serially.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    class concurrent_row_predictor {
+        const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & forest;
+        const feature_mtx<FeatT> & features;
+        label_mtx<LabT> * const labels_out;
+        label_mtx<LabT> * const variances_out;
+        tree_idx_mtx * const leaf_indices_out;
+    public:
+        void operator() (const blocked_range<datapoint_idx_t> & r) const {
+            boost::scoped_array<PredictedLeaf<LabT> > leaf_nodes_reached(new PredictedLeaf<LabT>[forest.stats().num_trees]);
+            forest.predict_rows(features, r.begin(), r.end(), leaf_nodes_reached.get(),
+                                labels_out, variances_out, leaf_indices_out);
         }
 
+        concurrent_row_predictor(const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & _forest,
+                                 const feature_mtx<FeatT> & _features,
+                                 label_mtx<LabT> * const _labels_out,
+                                 label_mtx<LabT> * const _variances_out,
+                                 tree_idx_mtx * const _leaf_indices_out)
+            : forest(_forest), features(_features), labels_out(_labels_out), variances_out(_variances_out),
+              leaf_indices_out(_leaf_indices_out) {
+        }
     };
 
 #endif
@@ -103,6 +131,8 @@ namespace garf {
         if (labels.rows() != num_datapoints) {
             throw std::invalid_argument("number of labels doesn't match number of features");
         }
+        // Throws if bag_fraction is nonsense, before we start making any trees
+        util::bag_size(forest_options, num_datapoints);
 
         std::cout << "Forest[" << this << "] got " << num_datapoints << "x "
             << data_dimensions << " dimensional datapoints with "
@@ -120,39 +150,47 @@ namespace garf {
         forest_stats.num_training_datapoints = num_datapoints;
 
         trees.reset(new RegressionTree<FeatT, LabT, SplitT, SplFitterT>[forest_options.max_num_trees]);
+        flat_trees.reset();
         forest_stats.num_trees = forest_options.max_num_trees;
         std::cout << "created " << forest_stats.num_trees << " trees" << std::endl;
 
+        // For histogram split search, quantize all the features up front. This is shared
+        // (read only) between all the fitters, and thrown away once training is done.
+        boost::scoped_ptr<util::FeatureBinning<FeatT> > feature_binning;
+        if (split_options.split_search == SEARCH_HISTOGRAM) {
+            feature_binning.reset(new util::FeatureBinning<FeatT>(features, split_options.num_histogram_bins));
+        }
+
 #ifdef GARF_PARALLELIZE_TBB
         std::cout << "training using TBB" << std::endl;
         // FIXME! Work out how to actually work out the number of
         // threads TBB will use, rather than guess
         parallel_for(blocked_range<tree_idx_t>(0, forest_options.max_num_trees, 2),
-                     concurrent_tree_trainer<FeatT, LabT, SplitT, SplFitterT>(trees, features, labels, *this));
+                     concurrent_tree_trainer<FeatT, LabT, SplitT, SplFitterT>(trees, features, labels, *this,
+                                                                              feature_binning.get()));
 #else
-        // Create a RNG which we will need for picking the bagging indices, plus the uniform distribution
+        // Create a RNG which we will need for picking the bagging indices
         std::mt19937_64 rng; // Mersenne twister
-        std::uniform_int_distribution<datapoint_idx_t> bagging_index_picker(0, num_datapoints - 1);
+        const datapoint_idx_t bag_size = util::bag_size(forest_options, num_datapoints);
 
         for (tree_idx_t t = 0; t < forest_options.max_num_trees; t++) {
             trees[t].tree_id = t;
 
-            data_indices_vec data_indices(num_datapoints);
-            if (forest_options.bagging) {
-                // Sample indices from the full dataset WITH REPLACEMENT!!!
-                for (datapoint_idx_t d = 0; d < num_datapoints; d++) {
-                    data_indices(d) = bagging_index_picker(rng);
-                }
-            } else {
-                // gives us a vector [0, 1, 2, 3, ... num_data_points-1]
-                data_indices.setLinSpaced(num_datapoints, 0, num_datapoints - 1);
-            }
+            data_indices_vec data_indices;
+            sample_count_vec sample_counts;
+            const bool counted_bagging = util::draw_bag(forest_options, num_datapoints, &rng,
+                                                        &data_indices, &sample_counts);
 
             // If we build the splfitter here we open the possibility of each thread building their own only
             // once, avoiding repeated memory allocation. yay!
-            SplFitterT<FeatT, LabT> fitter(split_options, forest_stats.num_training_datapoints,
+            SplFitterT<FeatT, LabT> fitter(split_options, bag_size,
                                            forest_stats.data_dimensions, forest_stats.label_dimensions, cout_mutex, t);
-            trees[t].train(features, labels, data_indices, tree_options, &fitter);
+            fitter.feature_binning = feature_binning.get();
+            trees[t].train(features, labels, data_indices, tree_options, &fitter,
+                           counted_bagging ? &sample_counts : NULL);
+            if (!forest_options.keep_training_indices) {
+                trees[t].discard_training_indices(num_datapoints);
+            }
         }
 #endif
         // We are done, so set the forest as trained
@@ -167,20 +205,54 @@ namespace garf {
         // }
         std::cout << "clearing forest of " << forest_stats.num_trees << " trees." << std::endl;
         trees.reset();
+        flat_trees.reset();
         forest_stats.num_trees = 0;
         trained = false;
     }
 
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::compile_for_inference() {
+        if (!trained) {
+            throw std::invalid_argument("cannot compile for inference, forest not trained yet");
+        }
+        boost::shared_array<FlatTree<FeatT, LabT, SplitT> > compiled(new FlatTree<FeatT, LabT, SplitT>[forest_stats.num_trees]);
+        for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+            compiled[t].compile(trees[t].get_root(), forest_stats.label_dimensions);
+        }
+        flat_trees = compiled;
+    }
+
     // Given a single feature vector, send it down each tree in turn and fill the given scoped 
-    // array with pointers to which node it lands at in each
+    // array with the mean and id of the node it lands at in each
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
     void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::predict_single_vector(const feature_vec<FeatT> & feature_vec,
-                                                                                  boost::scoped_array<RegressionNode<FeatT, LabT, SplitT, SplFitterT> const *> * leaf_nodes_reached) const {
+                                                                                  PredictedLeaf<LabT> * const leaf_nodes_reached) const {
+        if (flat_trees.get() != NULL) {
+            for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+                leaf_nodes_reached[t] = flat_trees[t].evaluate(feature_vec, predict_options.maximum_depth);
+            }
+            return;
+        }
         for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
-            (*leaf_nodes_reached)[t] = &trees[t].evaluate(feature_vec, predict_options);
+            leaf_nodes_reached[t] = evaluate_tree(t, feature_vec);
         }
     }
 
+    // The leaf a feature vector reaches in a single tree, using the compiled trees if there are any
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    template<class FeatVecT>
+    inline PredictedLeaf<LabT> RegressionForest<FeatT, LabT, SplitT, SplFitterT>::evaluate_tree(const tree_idx_t t,
+                                                                                                const FeatVecT & feature_vec) const {
+        if (flat_trees.get() != NULL) {
+            return flat_trees[t].evaluate(feature_vec, predict_options.maximum_depth);
+        }
+        const RegressionNode<FeatT, LabT, SplitT, SplFitterT> & node = trees[t].evaluate(feature_vec, predict_options);
+        PredictedLeaf<LabT> leaf;
+        leaf.mean = node.dist.mean.data();
+        leaf.node_id = node.node_id;
+        return leaf;
+    }
+
     // Checks dimensions of labels_out matrix. Throws an error if it is not present or wrong shape.
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
     void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::check_label_output_matrix(label_mtx<LabT> * const labels_out,
@@ -278,51 +350,436 @@ namespace garf {
             leaf_indices_out->setZero();
         }
 
-        // scoped array so we are exception safe. This array contains pointers to const RegressionNodes, so
-        // we can't change the node in any way
-        boost::scoped_array<RegressionNode<FeatT, LabT, SplitT, SplFitterT> const *> leaf_nodes_reached;
-        leaf_nodes_reached.reset(new RegressionNode<FeatT, LabT, SplitT, SplFitterT> const *[forest_stats.num_trees]);
+        // Only pass on the optional outputs if we are filling them in
+        label_mtx<LabT> * const variances = outputting_variances ? variances_out : NULL;
+        tree_idx_mtx * const leaf_indices = outputting_leaf_indices ? leaf_indices_out : NULL;
+
+#ifdef GARF_PARALLELIZE_TBB
+        // Every row is predicted independently, so share blocks of rows out between TBB workers
+        if ((predict_options.rows_per_parallel_task > 0) &&
+            (num_datapoints_to_predict > predict_options.rows_per_parallel_task)) {
+            parallel_for(blocked_range<datapoint_idx_t>(0, num_datapoints_to_predict, predict_options.rows_per_parallel_task),
+                         concurrent_row_predictor<FeatT, LabT, SplitT, SplFitterT>(*this, features, labels_out,
+                                                                                   variances, leaf_indices));
+            return;
+        }
+#endif
+
+        // scoped array so we are exception safe. This array contains const pointers to the leaf means, so
+        // we can't change the nodes in any way
+        boost::scoped_array<PredictedLeaf<LabT> > leaf_nodes_reached;
+        leaf_nodes_reached.reset(new PredictedLeaf<LabT>[forest_stats.num_trees]);
+        predict_rows(features, 0, num_datapoints_to_predict, leaf_nodes_reached.get(), labels_out, variances, leaf_indices);
+    }
+
+    // One step of the online mean / variance calculation over trees used by prediction, adding tree t's
+    // leaf mean. Afterwards mu_n and mu_n_minus_1 both hold the mean over trees [0, t], and variance_row
+    // has been incremented towards S = num_trees * variance. Every prediction path goes through here so
+    // they all give exactly the same answers. The means are label_vecs, or Maps over caller owned memory,
+    // and mu_n and mu_n_minus_1 may be the same vector (the update is coefficient wise).
+    template<typename LeafMeanT, typename MeanT, typename VarRowT>
+    inline void running_mean_var_step(const tree_idx_t t, const LeafMeanT & leaf_node_mean,
+                                      MeanT * const mu_n, MeanT * const mu_n_minus_1,
+                                      VarRowT variance_row) {
+        // Update the mean
+        *mu_n = *mu_n_minus_1 + (1.0 / static_cast<double>(t+1)) * (leaf_node_mean - *mu_n_minus_1);
+        // sum_x_sq += leaf_node_mean.cWiseProduct(leaf_node_mean);
+        if (mu_n_minus_1 != mu_n) {
+            *mu_n_minus_1 = *mu_n;
+        }
+        variance_row += (leaf_node_mean - *mu_n_minus_1).cwiseProduct(leaf_node_mean - *mu_n);
+    }
+
+    // The argument checks of predict(), for the predict only forests (MappedForest, QuickScorer,
+    // LazyForest). caller goes at the start of the exception message.
+    template<typename FeatT, typename LabT>
+    void check_predict_arguments(const char * const caller, const feature_mtx<FeatT> & features,
+                                 const feat_idx_t data_dimensions, const label_idx_t label_dimensions,
+                                 const tree_idx_t num_trees, const label_mtx<LabT> * const labels_out,
+                                 const label_mtx<LabT> * const variances_out,
+                                 const tree_idx_mtx * const leaf_indices_out) {
+        const datapoint_idx_t num_datapoints = features.rows();
+        if (features.cols() != data_dimensions) {
+            throw std::invalid_argument(std::string(caller) + ": feature_mtx has wrong shape");
+        } else if ((labels_out == NULL) || (labels_out->rows() != num_datapoints) || (labels_out->cols() != label_dimensions)) {
+            throw std::invalid_argument(std::string(caller) + ": labels_out is missing or wrong shape");
+        } else if ((variances_out != NULL) &&
+                   ((variances_out->rows() != num_datapoints) || (variances_out->cols() != label_dimensions))) {
+            throw std::invalid_argument(std::string(caller) + ": variances_out is wrong shape");
+        } else if ((leaf_indices_out != NULL) &&
+                   ((leaf_indices_out->rows() != num_datapoints) || (leaf_indices_out->cols() != num_trees))) {
+            throw std::invalid_argument(std::string(caller) + ": leaf_indices_out is wrong shape");
+        }
+    }
+
+    // Builds predict()'s outputs from the leaf each tree reaches for each row, for the predict only
+    // forests, giving exactly the answers of RegressionForest::predict. Each row must see trees
+    // 0, 1, ... in turn. Going tree major, add() keeps the running mean of a row in labels_out
+    // between trees, as predict_rows_tree_major does. Going row major, add_to_row() keeps it in
+    // here until end_row(), so nothing is copied in and out of labels_out for every tree.
+    template<typename LabT>
+    class TreeLeafCombiner {
+        const tree_idx_t num_trees;
+        label_mtx<LabT> * const labels_out;
+        label_mtx<LabT> * const variances_out;
+        tree_idx_mtx * const leaf_indices_out;
+        label_vec<LabT> mu_n;
+        label_vec<LabT> mu_n_minus_1;
+    public:
+        TreeLeafCombiner(const tree_idx_t _num_trees, label_mtx<LabT> * const _labels_out,
+                         label_mtx<LabT> * const _variances_out, tree_idx_mtx * const _leaf_indices_out)
+            : num_trees(_num_trees), labels_out(_labels_out), variances_out(_variances_out),
+              leaf_indices_out(_leaf_indices_out), mu_n(_labels_out->cols()), mu_n_minus_1(_labels_out->cols()) {
+            labels_out->setZero();
+            if (variances_out != NULL) {
+                variances_out->setZero();
+            }
+            mu_n_minus_1.setZero();
+        }
+
+        inline void add(const datapoint_idx_t i, const tree_idx_t t, const PredictedLeaf<LabT> & leaf) {
+            const Eigen::Map<const label_vec<LabT> > leaf_node_mean(leaf.mean, labels_out->cols());
+            if (variances_out == NULL) {
+                labels_out->row(i) += leaf_node_mean;
+            } else {
+                mu_n_minus_1 = labels_out->row(i).transpose();
+                running_mean_var_step(t, leaf_node_mean, &mu_n, &mu_n_minus_1, variances_out->row(i));
+                labels_out->row(i).operator=(mu_n);
+            }
+            if (leaf_indices_out != NULL) {
+                leaf_indices_out->coeffRef(i, t) = leaf.node_id;
+            }
+        }
+
+        inline void add_to_row(const datapoint_idx_t i, const tree_idx_t t, const PredictedLeaf<LabT> & leaf) {
+            const Eigen::Map<const label_vec<LabT> > leaf_node_mean(leaf.mean, labels_out->cols());
+            if (variances_out == NULL) {
+                labels_out->row(i) += leaf_node_mean;
+            } else {
+                running_mean_var_step(t, leaf_node_mean, &mu_n, &mu_n_minus_1, variances_out->row(i));
+            }
+            if (leaf_indices_out != NULL) {
+                leaf_indices_out->coeffRef(i, t) = leaf.node_id;
+            }
+        }
+
+        inline void end_row(const datapoint_idx_t i) {
+            if (variances_out != NULL) {
+                labels_out->row(i).operator=(mu_n);
+                mu_n_minus_1.setZero();
+            }
+        }
+
+        // Once every row has seen every tree - sums over trees into means, or S into variances
+        void finish() {
+            if (variances_out == NULL) {
+                *labels_out /= num_trees;
+            } else {
+                *variances_out /= static_cast<double>(num_trees);
+            }
+        }
+    };
+
+    // predict_one's combination of leaf means for one datapoint, straight into the caller's arrays so
+    // nothing is allocated. leaf_mean(t) gives the label mean tree t reaches. var_out may be NULL.
+    template<typename LabT, class LeafMeanFn>
+    void combine_leaf_means_one(const tree_idx_t num_trees, const label_idx_t label_dimensions,
+                                const LeafMeanFn & leaf_mean, LabT * const mean_out, LabT * const var_out) {
+        Eigen::Map<label_vec<LabT> > mean(mean_out, label_dimensions);
+        mean.setZero();
+
+        if (var_out == NULL) {
+            // Same naive sum as predict() uses for the mean only
+            for (tree_idx_t t = 0; t < num_trees; t++) {
+                mean += Eigen::Map<const label_vec<LabT> >(leaf_mean(t), label_dimensions);
+            }
+            mean /= num_trees;
+            return;
+        }
+
+        // The running mean is updated in place in mean_out, rather than needing somewhere for the previous one
+        Eigen::Map<label_vec<LabT> > variance(var_out, label_dimensions);
+        variance.setZero();
+        for (tree_idx_t t = 0; t < num_trees; t++) {
+            const Eigen::Map<const label_vec<LabT> > leaf_node_mean(leaf_mean(t), label_dimensions);
+            running_mean_var_step(t, leaf_node_mean, &mean, &mean, variance);
+        }
+        variance /= static_cast<double>(num_trees);
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::predict_anytime(const feature_mtx<FeatT> & features,
+                                                                            label_mtx<LabT> * const labels_out,
+                                                                            tree_count_vec * const trees_used_out,
+                                                                            label_mtx<LabT> * const variances_out) const {
+        if (!trained) {
+            throw std::invalid_argument("cannot predict, forest not trained yet");
+        }
+        const datapoint_idx_t num_datapoints_to_predict = features.rows();
+        if (!feature_mtx_correct_shape(features, num_datapoints_to_predict)) {
+            throw std::invalid_argument("predict_anytime(): feature_mtx has wrong shape");
+        }
+        check_label_output_matrix(labels_out, num_datapoints_to_predict);
+        const bool outputting_variances = check_variance_output_matrix(variances_out, num_datapoints_to_predict);
+        if (trees_used_out == NULL) {
+            throw std::invalid_argument("predict_anytime(): trees_used_out must be supplied");
+        } else if (trees_used_out->rows() != num_datapoints_to_predict) {
+            throw std::invalid_argument("predict_anytime(): trees_used_out is wrong shape");
+        }
+
+        const tree_idx_t max_trees = (predict_options.anytime_max_trees > 0) ?
+            std::min(predict_options.anytime_max_trees, forest_stats.num_trees) : forest_stats.num_trees;
+        // A single tree always has zero variance, so it can't tell us the mean has converged
+        const tree_idx_t min_trees = std::max<tree_idx_t>(predict_options.anytime_min_trees, 2);
+        const bool can_converge = (predict_options.anytime_std_error_tolerance > 0);
+        const double tolerance_sq = predict_options.anytime_std_error_tolerance * predict_options.anytime_std_error_tolerance;
+
+        const label_idx_t label_dimensions = forest_stats.label_dimensions;
+        feature_vec<FeatT> fvec(forest_stats.data_dimensions);
+        label_vec<LabT> mu_n(label_dimensions);
+        label_vec<LabT> mu_n_minus_1(label_dimensions);
+        label_mtx<LabT> row_variance(1, label_dimensions);
+
+        // The outputs are accumulated exactly as predict() does, but that recurrence isn't quite
+        // Welford's, so the stopping rule keeps its own: sum of squared differences from the mean
+        // S_n = S_n-1 + (x - mean_n-1)(x - mean_n), giving a standard error of sqrt(S_n / (n - 1) / n)
+        Eigen::ArrayXd welford_mean(label_dimensions);
+        Eigen::ArrayXd welford_s(label_dimensions);
+        Eigen::ArrayXd welford_delta(label_dimensions);
+
+        for (datapoint_idx_t i = 0; i < num_datapoints_to_predict; i++) {
+            fvec = features.row(i);
+            labels_out->row(i).setZero();
+            mu_n.setZero();
+            mu_n_minus_1.setZero();
+            row_variance.setZero();
+            welford_mean.setZero();
+            welford_s.setZero();
+
+            tree_idx_t trees_used = 0;
+            while (trees_used < max_trees) {
+                const PredictedLeaf<LabT> leaf = evaluate_tree(trees_used, fvec);
+                const Eigen::Map<const label_vec<LabT> > leaf_node_mean(leaf.mean, label_dimensions);
+                if (outputting_variances) {
+                    running_mean_var_step(trees_used, leaf_node_mean, &mu_n, &mu_n_minus_1, row_variance.row(0));
+                } else {
+                    labels_out->row(i) += leaf_node_mean;
+                }
+                trees_used++;
+
+                if (can_converge) {
+                    welford_delta = leaf_node_mean.array().template cast<double>() - welford_mean;
+                    welford_mean += welford_delta / static_cast<double>(trees_used);
+                    welford_s += welford_delta * (leaf_node_mean.array().template cast<double>() - welford_mean);
+                    if ((trees_used >= min_trees) &&
+                        (welford_s.maxCoeff() <= tolerance_sq * trees_used * (trees_used - 1))) {
+                        break;
+                    }
+                }
+            }
+
+            // Same as predict() does once it has been through every tree
+            if (outputting_variances) {
+                labels_out->row(i).operator=(mu_n);
+                variances_out->row(i) = row_variance.row(0) / static_cast<double>(trees_used);
+            } else {
+                labels_out->row(i) /= trees_used;
+            }
+            trees_used_out->coeffRef(i) = trees_used;
+        }
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::predict_one(const FeatT * const features,
+                                                                        LabT * const mean_out,
+                                                                        LabT * const var_out) const {
+        if (!trained) {
+            throw std::invalid_argument("cannot predict, forest not trained yet");
+        } else if ((features == NULL) || (mean_out == NULL)) {
+            throw std::invalid_argument("predict_one(): features and mean_out must be supplied");
+        }
+
+        const Eigen::Map<const feature_vec<FeatT> > fvec(features, forest_stats.data_dimensions);
+        combine_leaf_means_one(forest_stats.num_trees, forest_stats.label_dimensions,
+                               [&](const tree_idx_t t) { return evaluate_tree(t, fvec).mean; },
+                               mean_out, var_out);
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::predict_at_depths(const feature_mtx<FeatT> & features,
+                                                                              const std::vector<depth_idx_t> & depths,
+                                                                              std::vector<label_mtx<LabT> > * const labels_out,
+                                                                              std::vector<label_mtx<LabT> > * const variances_out) const {
+        if (!trained) {
+            throw std::invalid_argument("cannot predict, forest not trained yet");
+        }
+        const datapoint_idx_t num_datapoints_to_predict = features.rows();
+        if (!feature_mtx_correct_shape(features, num_datapoints_to_predict)) {
+            throw std::invalid_argument("predict_at_depths(): feature_mtx has wrong shape");
+        } else if (labels_out == NULL) {
+            throw std::invalid_argument("predict_at_depths(): label output vector must be supplied!");
+        }
+        const size_t num_depths = depths.size();
+        for (size_t k = 0; k < num_depths; k++) {
+            if (depths[k] < 0) {
+                throw std::invalid_argument("predict_at_depths(): depths can't be negative");
+            }
+        }
+        const bool outputting_variances = (variances_out != NULL);
+        const label_idx_t label_dimensions = forest_stats.label_dimensions;
+
+        labels_out->resize(num_depths);
+        if (outputting_variances) {
+            variances_out->resize(num_depths);
+        }
+        for (size_t k = 0; k < num_depths; k++) {
+            (*labels_out)[k].setZero(num_datapoints_to_predict, label_dimensions);
+            if (outputting_variances) {
+                (*variances_out)[k].setZero(num_datapoints_to_predict, label_dimensions);
+            }
+        }
+
+        // The walk down each tree needs the depths in increasing order. output_idx[j] is which of
+        // the requested depths sorted_depths[j] is.
+        std::vector<std::pair<depth_idx_t, size_t> > depth_and_idx(num_depths);
+        for (size_t k = 0; k < num_depths; k++) {
+            depth_and_idx[k] = std::make_pair(depths[k], k);
+        }
+        std::sort(depth_and_idx.begin(), depth_and_idx.end());
+        std::vector<depth_idx_t> sorted_depths(num_depths);
+        std::vector<size_t> output_idx(num_depths);
+        for (size_t j = 0; j < num_depths; j++) {
+            sorted_depths[j] = depth_and_idx[j].first;
+            output_idx[j] = depth_and_idx[j].second;
+        }
+
+        feature_vec<FeatT> fvec(forest_stats.data_dimensions);
+        std::vector<PredictedLeaf<LabT> > leaves_reached(num_depths);
+        std::vector<const RegressionNode<FeatT, LabT, SplitT, SplFitterT> *> nodes_reached(num_depths);
+        label_vec<LabT> mu_n(label_dimensions);
+        label_vec<LabT> mu_n_minus_1(label_dimensions);
+
+        for (datapoint_idx_t i = 0; (i < num_datapoints_to_predict) && (num_depths > 0); i++) {
+            fvec = features.row(i);
+            for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+                if (flat_trees.get() != NULL) {
+                    flat_trees[t].evaluate_at_depths(fvec, &sorted_depths[0], num_depths, &leaves_reached[0]);
+                } else {
+                    trees[t].evaluate_at_depths(fvec, &sorted_depths[0], num_depths, &nodes_reached[0]);
+                    for (size_t j = 0; j < num_depths; j++) {
+                        leaves_reached[j].mean = nodes_reached[j]->dist.mean.data();
+                        leaves_reached[j].node_id = nodes_reached[j]->node_id;
+                    }
+                }
+
+                // Each output row keeps its running mean between trees, as tree major prediction does
+                for (size_t j = 0; j < num_depths; j++) {
+                    const Eigen::Map<const label_vec<LabT> > leaf_node_mean(leaves_reached[j].mean, label_dimensions);
+                    label_mtx<LabT> & labels = (*labels_out)[output_idx[j]];
+                    if (!outputting_variances) {
+                        labels.row(i) += leaf_node_mean;
+                    } else {
+                        mu_n_minus_1 = labels.row(i).transpose();
+                        running_mean_var_step(t, leaf_node_mean, &mu_n, &mu_n_minus_1, (*variances_out)[output_idx[j]].row(i));
+                        labels.row(i).operator=(mu_n);
+                    }
+                }
+            }
+        }
 
-        // NB it kind of sucks to test whether we are doing variance & leaf index outputting on every iteration
-        // of the for loop. However to do the tests outside the for loop we'd need 4 different for loops doing every combination
-        // of variance yes/no, leaf index yes/no - seems like a lot of code repetition which is going to be hellish for 
-        // maintenance. For now I will leave it as is, but this is a FIXME in case prediction performance becomes a bottleneck.
-        // I have chosen to do it this way as it means we only need to do the actual predictions - working out which leaf
-        // node a particular datapoint lands at - the minimum number of times.
-        for (feat_idx_t feat_vec_idx = 0; feat_vec_idx < num_datapoints_to_predict; feat_vec_idx++) {
+        // Sums over trees into means, or S into variances, as in predict_rows
+        for (size_t k = 0; k < num_depths; k++) {
+            if (!outputting_variances) {
+                (*labels_out)[k] /= forest_stats.num_trees;
+            } else {
+                (*variances_out)[k] /= static_cast<double>(forest_stats.num_trees);
+            }
+        }
+    }
+
+    // Predict rows [begin_row, end_row) into outputs which have already been checked and zeroed. variances_out
+    // and leaf_indices_out may be NULL when they aren't wanted. leaf_nodes_reached is scratch with room for
+    // one entry per tree.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::predict_rows(const feature_mtx<FeatT> & features,
+                                                                         const datapoint_idx_t begin_row,
+                                                                         const datapoint_idx_t end_row,
+                                                                         PredictedLeaf<LabT> * const leaf_nodes_reached,
+                                                                         label_mtx<LabT> * const labels_out,
+                                                                         label_mtx<LabT> * const variances_out,
+                                                                         tree_idx_mtx * const leaf_indices_out) const {
+        // Work out which outputs we are filling in once, here, and hand over to a kernel compiled for
+        // exactly that combination - so nothing inside the per row loops tests for them
+        if (variances_out == NULL) {
+            if (leaf_indices_out == NULL) {
+                predict_rows_kernel<false, false>(features, begin_row, end_row, leaf_nodes_reached,
+                                                  labels_out, variances_out, leaf_indices_out);
+            } else {
+                predict_rows_kernel<false, true>(features, begin_row, end_row, leaf_nodes_reached,
+                                                 labels_out, variances_out, leaf_indices_out);
+            }
+        } else {
+            if (leaf_indices_out == NULL) {
+                predict_rows_kernel<true, false>(features, begin_row, end_row, leaf_nodes_reached,
+                                                 labels_out, variances_out, leaf_indices_out);
+            } else {
+                predict_rows_kernel<true, true>(features, begin_row, end_row, leaf_nodes_reached,
+                                                labels_out, variances_out, leaf_indices_out);
+            }
+        }
+    }
+
+    // The body of predict_rows for one combination of outputs. All the scratch space is allocated
+    // up front, so there are no heap allocations per row.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    template<bool OutputVariances, bool OutputLeafIndices>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::predict_rows_kernel(const feature_mtx<FeatT> & features,
+                                                                                const datapoint_idx_t begin_row,
+                                                                                const datapoint_idx_t end_row,
+                                                                                PredictedLeaf<LabT> * const leaf_nodes_reached,
+                                                                                label_mtx<LabT> * const labels_out,
+                                                                                label_mtx<LabT> * const variances_out,
+                                                                                tree_idx_mtx * const leaf_indices_out) const {
+        if (predict_options.tree_major_block_size > 0) {
+            predict_rows_tree_major<OutputVariances, OutputLeafIndices>(features, begin_row, end_row,
+                                                                        labels_out, variances_out, leaf_indices_out);
+            return;
+        }
+
+        const label_idx_t label_dimensions = forest_stats.label_dimensions;
+
+        // Rows of the feature matrix aren't contiguous, so each is copied in here - passing features.row()
+        // straight to predict_single_vector would allocate a temporary vector every time
+        feature_vec<FeatT> fvec(forest_stats.data_dimensions);
+        label_vec<LabT> mu_n(label_dimensions);
+        label_vec<LabT> mu_n_minus_1(label_dimensions);  // mean at previous timestep
+
+        for (datapoint_idx_t feat_vec_idx = begin_row; feat_vec_idx < end_row; feat_vec_idx++) {
 #ifdef VERBOSE
             std::cout << "predicting on datapoint #" << feat_vec_idx << ": " << features.row(feat_vec_idx) << std::endl;
 #endif
             // for each datapoint, we want to work out the set of leaf nodes it reaches, 
             // then worry about whether we are calculating variances or whatever else. We fill our scoped_array
             // with pointers to the leaf node reached by each datapoint
-            predict_single_vector(features.row(feat_vec_idx), &leaf_nodes_reached);
-
+            fvec = features.row(feat_vec_idx);
+            predict_single_vector(fvec, leaf_nodes_reached);
 
-            // This if test and the one below are suboptimal, see explanation at top of for loop
-            if (!outputting_variances) {
+            if (!OutputVariances) {
                 // Calculate mean only - simplest case, using naive method
                 for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
-                    labels_out->row(feat_vec_idx) += leaf_nodes_reached[t]->dist.mean;
+                    labels_out->row(feat_vec_idx) += Eigen::Map<const label_vec<LabT> >(leaf_nodes_reached[t].mean, label_dimensions);
                 }
                 labels_out->row(feat_vec_idx) /= forest_stats.num_trees;
             } else {
                 // Compute mean and variance at the same time. We are using iterative method for calculating each
                 // online (this is most numerically stable) - see http://www-uxsup.csx.cam.ac.uk/~fanf2/hermes/doc/antiforgery/stats.pdf
-                label_vec<LabT> mu_n(forest_stats.label_dimensions);
-                label_vec<LabT> mu_n_minus_1(forest_stats.label_dimensions);  // mean at previous timestep
                 mu_n.setZero();
                 mu_n_minus_1.setZero();
 
                 for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
                     // Get const reference to the mean at the leaf node, just so we don't have to do the pointer indirections again
-                    const feature_vec<FeatT> & leaf_node_mean = leaf_nodes_reached[t]->dist.mean;
-
-                    // Update the mean
-                    mu_n = mu_n_minus_1 + (1.0 / static_cast<double>(t+1)) * (leaf_node_mean - mu_n_minus_1);
-                    // sum_x_sq += leaf_node_mean.cWiseProduct(leaf_node_mean);
-                    mu_n_minus_1 = mu_n;
-                    variances_out->row(feat_vec_idx) += (leaf_node_mean - mu_n_minus_1).cwiseProduct(leaf_node_mean - mu_n);
+                    const Eigen::Map<const label_vec<LabT> > leaf_node_mean(leaf_nodes_reached[t].mean, label_dimensions);
+                    running_mean_var_step(t, leaf_node_mean, &mu_n, &mu_n_minus_1, variances_out->row(feat_vec_idx));
                 }
 
                 // FIXME: swap the two lines below when I have a version of clang++ with the bug fixed
@@ -334,14 +791,78 @@ namespace garf {
                 variances_out->row(feat_vec_idx) /= static_cast<double>(forest_stats.num_trees);
             }
 
-            if (outputting_leaf_indices) {
+            if (OutputLeafIndices) {
                 for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
-                    leaf_indices_out->coeffRef(feat_vec_idx, t) = leaf_nodes_reached[t]->node_id;
+                    leaf_indices_out->coeffRef(feat_vec_idx, t) = leaf_nodes_reached[t].node_id;
                 }
             }
         }
     }
 
+    // As predict_rows, but take the rows a block at a time and send the whole block through each tree in
+    // turn, so that only one tree's nodes need to be in cache at once. The running mean for each row is kept
+    // in labels_out between trees, so the arithmetic (and therefore the answer) is the same as row at a time.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    template<bool OutputVariances, bool OutputLeafIndices>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::predict_rows_tree_major(const feature_mtx<FeatT> & features,
+                                                                                    const datapoint_idx_t begin_row,
+                                                                                    const datapoint_idx_t end_row,
+                                                                                    label_mtx<LabT> * const labels_out,
+                                                                                    label_mtx<LabT> * const variances_out,
+                                                                                    tree_idx_mtx * const leaf_indices_out) const {
+        const label_idx_t label_dimensions = forest_stats.label_dimensions;
+        const datapoint_idx_t block_size = predict_options.tree_major_block_size;
+        const datapoint_idx_t max_rows_in_block = std::min(block_size, end_row - begin_row);
+
+        // Compiled trees take the whole block at once, straight from the feature matrix, which lets them
+        // use vector instructions (see FlatTree::evaluate_rows). Otherwise copy each block of rows out
+        // once, rather than once per tree.
+        const bool compiled = (flat_trees.get() != NULL);
+        const simd_level_t simd_level = std::min(predict_options.max_simd_level, detect_simd_level());
+        std::vector<feature_vec<FeatT> > block_rows(compiled ? 0 : max_rows_in_block);
+        std::vector<PredictedLeaf<LabT> > block_leaves(compiled ? max_rows_in_block : 0);
+        std::vector<int32_t> block_refs(compiled ? max_rows_in_block : 0);
+        feature_vec<FeatT> row_scratch(forest_stats.data_dimensions);
+        label_vec<LabT> mu_n(label_dimensions);
+        label_vec<LabT> mu_n_minus_1(label_dimensions);
+
+        for (datapoint_idx_t block_begin = begin_row; block_begin < end_row; block_begin += block_size) {
+            const datapoint_idx_t block_end = std::min(block_begin + block_size, end_row);
+            for (datapoint_idx_t i = block_begin; !compiled && (i < block_end); i++) {
+                block_rows[i - block_begin] = features.row(i);
+            }
+
+            for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+                if (compiled) {
+                    flat_trees[t].evaluate_rows(features, block_begin, block_end, predict_options.maximum_depth, simd_level,
+                                                &row_scratch, block_refs.data(), block_leaves.data());
+                }
+                for (datapoint_idx_t i = block_begin; i < block_end; i++) {
+                    const PredictedLeaf<LabT> leaf = compiled ? block_leaves[i - block_begin]
+                                                              : evaluate_tree(t, block_rows[i - block_begin]);
+                    const Eigen::Map<const label_vec<LabT> > leaf_node_mean(leaf.mean, label_dimensions);
+                    if (!OutputVariances) {
+                        labels_out->row(i) += leaf_node_mean;
+                    } else {
+                        mu_n_minus_1 = labels_out->row(i).transpose();
+                        running_mean_var_step(t, leaf_node_mean, &mu_n, &mu_n_minus_1, variances_out->row(i));
+                        labels_out->row(i).operator=(mu_n);
+                    }
+                    if (OutputLeafIndices) {
+                        leaf_indices_out->coeffRef(i, t) = leaf.node_id;
+                    }
+                }
+            }
+
+            // Sums over trees into means, or S into variances, as in predict_rows
+            if (!OutputVariances) {
+                labels_out->middleRows(block_begin, block_end - block_begin) /= forest_stats.num_trees;
+            } else {
+                variances_out->middleRows(block_begin, block_end - block_begin) /= static_cast<double>(forest_stats.num_trees);
+            }
+        }
+    }
+
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
     inline std::ostream& operator<< (std::ostream& stream, const RegressionForest<FeatT, LabT, SplitT, SplFitterT> & frst) {
         stream << "[RegFrst:";
@@ -433,6 +954,26 @@ namespace garf {
         util::copy_eigen_data_to_numpy<tree_idx_t>(leaf_indices_out_eig, leaf_indices_out_np);
     }
 
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::py_predict_anytime(PyObject * const features_np,
+                                                                               PyObject * const predict_mean_out_np,
+                                                                               PyObject * const predict_var_out_np,
+                                                                               PyObject * const trees_used_out_np) const {
+        boost::shared_ptr<const feature_mtx<FeatT> > features(util::numpy_obj_to_eigen_copy<FeatT>(features_np));
+        eigen_idx_t num_datapoints = features->rows();
+
+        label_mtx<LabT> predict_mean_out_eig(num_datapoints, forest_stats.label_dimensions);
+        label_mtx<LabT> predict_var_out_eig(num_datapoints, forest_stats.label_dimensions);
+        tree_count_vec trees_used_out_eig(num_datapoints);
+
+        predict_anytime(*features, &predict_mean_out_eig, &trees_used_out_eig, &predict_var_out_eig);
+        util::copy_eigen_data_to_numpy<LabT>(predict_mean_out_eig, predict_mean_out_np);
+        util::copy_eigen_data_to_numpy<LabT>(predict_var_out_eig, predict_var_out_np);
+        // numpy side is a column, the copy only deals with matrices
+        const tree_idx_mtx trees_used_mtx = trees_used_out_eig;
+        util::copy_eigen_data_to_numpy<tree_idx_t>(trees_used_mtx, trees_used_out_np);
+    }
+
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
     void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::py_feature_importance(PyObject * const features_np,
                                                                                   PyObject * const labels_np,
@@ -11,6 +11,8 @@
 
 #ifdef GARF_PARALLELIZE_TBB
 #include "tbb/parallel_for.h"
+#include "tbb/parallel_invoke.h"
+#include "tbb/parallel_reduce.h"
 #include "tbb/blocked_range.h"
 #include "tbb/atomic.h"
 #include "tbb/mutex.h"
@@ -19,6 +21,11 @@ using namespace tbb;
 
 
 #include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
 
 #include <Eigen/Dense>
 #include <Eigen/Core>
@@ -27,9 +34,14 @@ using namespace tbb;
 #include "options.hpp"
 #include "splitter.hpp"
 #include "split_fitter.hpp"
+#include "flat_tree.hpp"
 #include "util/multi_dim_gaussian.hpp"
 #include "util/array_utils.hpp"
 
+#ifdef GARF_SERIALIZE_ENABLE
+#include "binary_format.hpp"
+#endif
+
 #ifdef GARF_PYTHON_BINDINGS_ENABLE
 #include "util/python_eigen.hpp"
 #endif
@@ -74,8 +86,16 @@ namespace garf {
         // distribution over label values
         util::MultiDimGaussianX<LabT> dist;
 
-        // Which training data points passed through here
-        data_indices_vec training_data_indices;
+        // Which training data points passed through here. Every node in a tree shares one
+        // index buffer, and each node's datapoints are the range
+        // [indices_begin, indices_begin + indices_count) of it. Loaded nodes have their own.
+        boost::shared_ptr<data_indices_vec> index_buffer;
+        datapoint_idx_t indices_begin;
+        datapoint_idx_t indices_count;
+
+        // Number of bagged draws which reached this node. The same as indices_count, unless
+        // counted bagging is used, where each index stands for however many times it was drawn.
+        datapoint_idx_t bag_count;
 
         // The split object. This just holds the raw data necessary for
         // splitting - all intermediate data used while training should
@@ -92,17 +112,20 @@ namespace garf {
         RegressionNode(node_idx_t _node_id,
                        const RegressionNode<FeatT, LabT, SplitT, SplFitterT> * const _parent,
                        label_idx_t _num_label_dims, depth_idx_t _depth)
-            : parent(_parent), node_id(_node_id), depth(_depth), dist(_num_label_dims), is_leaf(true) {};
+            : parent(_parent), node_id(_node_id), depth(_depth), dist(_num_label_dims),
+              indices_begin(0), indices_count(0), bag_count(0), is_leaf(true) {};
         inline ~RegressionNode() {};
 
         inline void train() { std::cout << "decoy train()" << std::endl; }
 
-        // First 5 arguments all compulsory. Last one allows us to optionally
+        // All arguments but the last compulsory. Last one allows us to optionally
         // provide an initial distribution, which otherwise we will need to calculate
         void train(const RegressionTree<FeatT, LabT, SplitT, SplFitterT> & tree,
                    const feature_mtx<FeatT> & features,
                    const label_mtx<LabT> & labels,
-                   const data_indices_vec & data_indices,
+                   const boost::shared_ptr<data_indices_vec> & index_buffer,
+                   const datapoint_idx_t indices_begin,
+                   const datapoint_idx_t indices_count,
                    const TreeOptions & tree_opts,
                    SplFitterT<FeatT, LabT> * fitter,
                    const util::MultiDimGaussianX<LabT> * const _dist = NULL);
@@ -111,10 +134,19 @@ namespace garf {
         bool stopping_conditions_reached(const TreeOptions & tree_opts) const;
 
         // Small utility functions
-        inline uint32_t num_training_datapoints() const { return training_data_indices.size(); }
+        inline uint32_t num_training_datapoints() const { return indices_count; }
         inline node_idx_t left_child_index() const { return (2 * node_id) + 1; }
         inline node_idx_t right_child_index() const { return (2 * node_id) + 2; }
-        inline datapoint_idx_t num_samples() const { return training_data_indices.size(); }
+        inline datapoint_idx_t num_samples() const { return indices_count; }
+        inline const_data_indices_range training_data_indices() const {
+            if (index_buffer.get() == NULL) {
+                throw std::logic_error("training indices were not kept, see ForestOptions::keep_training_indices");
+            }
+            return static_cast<const data_indices_vec &>(*index_buffer).segment(indices_begin, indices_count);
+        }
+
+        // Drop our reference to the index buffer here and in all children. Sample counts are kept.
+        void discard_training_indices();
 
         template<typename F, typename L, template<typename> class S, template<typename,typename> class ST>
         friend std::ostream& operator<< (std::ostream& stream, const RegressionNode<F, L, S, ST> & node);
@@ -139,13 +171,14 @@ namespace garf {
         const SplitT<FeatT> & get_split() const { return split; }
         const util::MultiDimGaussianX<LabT> & get_dist() const { return dist; }
         inline PyObject* get_training_indices() const {
-            return util::eigen_to_numpy_copy<datapoint_idx_t>(training_data_indices);
+            data_indices_vec indices = training_data_indices();
+            return util::eigen_to_numpy_copy<datapoint_idx_t>(indices);
         }
 #endif
 
 #ifdef GARF_SERIALIZE_ENABLE
         // Zero arg constructor just for serialization of things inside a shared_ptr
-        inline RegressionNode() : parent(NULL), node_id(-1), depth(-1), dist(0) {}
+        inline RegressionNode() : parent(NULL), node_id(-1), depth(-1), dist(0), indices_begin(0), indices_count(0), bag_count(0) {}
     private:
         friend class boost::serialization::access;
 
@@ -162,18 +195,71 @@ namespace garf {
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
     class RegressionTree {
         boost::shared_ptr<RegressionNode<FeatT, LabT, SplitT, SplFitterT> > root;
+
+        // Which of the forest's training datapoints this tree was trained on (at least once), one
+        // bit each. Only made when the training indices are discarded - until then the root's
+        // indices say the same thing.
+        std::vector<uint64_t> in_bag;
+        datapoint_idx_t in_bag_size;
+
+        inline void clear_in_bag(const datapoint_idx_t num_training_datapoints) {
+            in_bag_size = num_training_datapoints;
+            in_bag.assign((num_training_datapoints + 63) / 64, 0);
+        }
+        inline void set_in_bag(const datapoint_idx_t data_idx) {
+            in_bag[data_idx / 64] |= (static_cast<uint64_t>(1) << (data_idx % 64));
+        }
+        inline bool in_bag_bit(const datapoint_idx_t data_idx) const {
+            return ((in_bag[data_idx / 64] >> (data_idx % 64)) & 1) != 0;
+        }
     public:
         tree_idx_t tree_id;
 
+        inline RegressionTree() : in_bag_size(0) {}
+
+        // Whether a training datapoint was in this tree's bag. While the training indices are kept
+        // this searches the root's, so use in_bag_mask to ask about every datapoint.
+        bool is_in_bag(datapoint_idx_t data_idx) const;
+        // Set in_bag_out(d) for every training datapoint d, which it must already be sized for
+        void in_bag_mask(bool_vec * const in_bag_out) const;
+        void mark_in_bag(const const_data_indices_range & data_indices, datapoint_idx_t num_training_datapoints);
+        inline bool has_in_bag() const { return !in_bag.empty(); }
+
+        // Roughly how much memory this tree takes - nodes (with their shared_ptr control blocks),
+        // label distributions, index buffers and in_bag. Allocator overhead isn't counted.
+        size_t memory_bytes() const;
+
+        // See ForestOptions::keep_training_indices. The in bag bitmap is made from the root's
+        // indices first, so is_in_bag and feature importance still work afterwards.
+        void discard_training_indices(const datapoint_idx_t num_training_datapoints);
+
+        // sample_counts is how many times each datapoint was drawn, when bagging with
+        // counts - data_indices should then list each drawn datapoint once
         void train(const feature_mtx<FeatT> & features,
                    const label_mtx<LabT> & labels,
                    const data_indices_vec & data_indices,
                    const TreeOptions & tree_opts,
-                   SplFitterT<FeatT, LabT> * fitter);
-
-        // Given some data vector, return a const reference to the node it would stop at
-        const RegressionNode<FeatT, LabT, SplitT, SplFitterT> & evaluate(const feature_vec<FeatT> & fvec,
+                   SplFitterT<FeatT, LabT> * fitter,
+                   const sample_count_vec * const sample_counts = NULL);
+
+        // Grows the tree one depth level at a time rather than recursing, see TreeOptions::growth.
+        // Called from train(), which has already checked the options.
+        void train_level_wise(const feature_mtx<FeatT> & features,
+                              const label_mtx<LabT> & labels,
+                              const data_indices_vec & data_indices,
+                              const TreeOptions & tree_opts,
+                              SplFitterT<FeatT, LabT> * fitter);
+
+        // Given some data vector, return a const reference to the node it would stop at. Any Eigen
+        // vector expression will do, so rows can be given without copying them
+        template<class FeatVecT>
+        const RegressionNode<FeatT, LabT, SplitT, SplFitterT> & evaluate(const FeatVecT & fvec,
                                                                          const PredictOptions & predict_options) const;
+        // Follow the same path as evaluate(), filling nodes_out[k] with the node reached when stopping
+        // at depths[k]. depths must be in increasing order.
+        template<class FeatVecT>
+        void evaluate_at_depths(const FeatVecT & fvec, const depth_idx_t * const depths, const size_t num_depths,
+                                const RegressionNode<FeatT, LabT, SplitT, SplFitterT> ** const nodes_out) const;
         error_t test_error(const feature_mtx<FeatT> & features,
                            const label_mtx<LabT> & ground_truth_labels,
                            label_mtx<LabT> * predicted_labels_tmp,
@@ -191,6 +277,9 @@ namespace garf {
         }
 
 #ifdef GARF_SERIALIZE_ENABLE
+        // This tree's part of a binary forest file, see binary_format.hpp
+        void save_binary(BinaryWriter & out) const;
+        void load_binary(BinaryReader & in, const label_idx_t label_dims);
     private:
         friend class boost::serialization::access;
 
@@ -207,14 +296,48 @@ namespace garf {
 
         boost::shared_array<RegressionTree<FeatT, LabT, SplitT, SplFitterT> > trees;
 
+        // Contiguous copies of the trees for prediction, only present after compile_for_inference()
+        boost::shared_array<FlatTree<FeatT, LabT, SplitT> > flat_trees;
+
         // Checking the size of inputs given during prediction
         void check_label_output_matrix(label_mtx<LabT> * const labels_out, datapoint_idx_t num_datapoints_to_predict) const;
         bool check_variance_output_matrix(label_mtx<LabT> * const variances_out, datapoint_idx_t num_datapoints_to_predict) const;
         bool check_leaf_index_output_matrix(tree_idx_mtx * const leaf_indices_out, datapoint_idx_t num_datapoints_to_predict) const;
 
-        // Actually do a single prediction - fill the provided output vector with pointers to the leaf nodes reached
+        // Actually do a single prediction - fill the provided array with the leaf reached in each tree
         void predict_single_vector(const feature_vec<FeatT> & feature_vec,
-                                   boost::scoped_array<RegressionNode<FeatT, LabT, SplitT, SplFitterT> const *> * leaf_nodes_reached) const;
+                                   PredictedLeaf<LabT> * const leaf_nodes_reached) const;
+
+        template<class FeatVecT>
+        inline PredictedLeaf<LabT> evaluate_tree(const tree_idx_t t, const FeatVecT & feature_vec) const;
+
+        // Predict a contiguous range of rows, see predict()
+        void predict_rows(const feature_mtx<FeatT> & features,
+                          const datapoint_idx_t begin_row,
+                          const datapoint_idx_t end_row,
+                          PredictedLeaf<LabT> * const leaf_nodes_reached,
+                          label_mtx<LabT> * const labels_out,
+                          label_mtx<LabT> * const variances_out,
+                          tree_idx_mtx * const leaf_indices_out) const;
+        template<bool OutputVariances, bool OutputLeafIndices>
+        void predict_rows_kernel(const feature_mtx<FeatT> & features,
+                                 const datapoint_idx_t begin_row,
+                                 const datapoint_idx_t end_row,
+                                 PredictedLeaf<LabT> * const leaf_nodes_reached,
+                                 label_mtx<LabT> * const labels_out,
+                                 label_mtx<LabT> * const variances_out,
+                                 tree_idx_mtx * const leaf_indices_out) const;
+        template<bool OutputVariances, bool OutputLeafIndices>
+        void predict_rows_tree_major(const feature_mtx<FeatT> & features,
+                                     const datapoint_idx_t begin_row,
+                                     const datapoint_idx_t end_row,
+                                     label_mtx<LabT> * const labels_out,
+                                     label_mtx<LabT> * const variances_out,
+                                     tree_idx_mtx * const leaf_indices_out) const;
+#ifdef GARF_PARALLELIZE_TBB
+        template<typename F, typename L, template<typename> class S, template<typename,typename> class ST>
+        friend class concurrent_row_predictor;
+#endif
 
         // Return true or false whether a matrix is the right shape
         bool feature_mtx_correct_shape(const feature_mtx<FeatT> & features, datapoint_idx_t num_datapoints_to_predict) const;
@@ -238,6 +361,31 @@ namespace garf {
                      label_mtx<LabT> * const variances_out = NULL,
                      tree_idx_mtx * const leaf_indices_output = NULL) const;
 
+        // Low latency prediction for a single datapoint held in a plain array of data_dimensions
+        // features. mean_out (and var_out, if not NULL) have room for label_dimensions values and
+        // get exactly what predict() would give for this row. Nothing is allocated, and the forest
+        // isn't modified, so any number of threads can call this at once on the same const forest
+        // (as long as nothing is retraining, loading or compiling it at the same time).
+        void predict_one(const FeatT * const features, LabT * const mean_out, LabT * const var_out = NULL) const;
+
+        // Predictions for several maximum depths at once, from a single pass down each tree. Afterwards
+        // (*labels_out)[k] (and (*variances_out)[k], if variances_out isn't NULL) holds exactly what
+        // predict() gives with predict_options.maximum_depth set to depths[k] - the option itself is
+        // ignored here. The output vectors are resized to match depths. Serial.
+        void predict_at_depths(const feature_mtx<FeatT> & features,
+                               const std::vector<depth_idx_t> & depths,
+                               std::vector<label_mtx<LabT> > * const labels_out,
+                               std::vector<label_mtx<LabT> > * const variances_out = NULL) const;
+
+        // Like predict(), but for each datapoint stop visiting trees once the mean has converged,
+        // or the budget runs out - see the anytime options in PredictOptions. trees_used_out gets
+        // how many trees each datapoint's mean (and variance) is over. With no tolerance and no
+        // budget the outputs are exactly what predict() gives for the same outputs. Serial.
+        void predict_anytime(const feature_mtx<FeatT> & features,
+                             label_mtx<LabT> * const labels_out,
+                             tree_count_vec * const trees_used_out,
+                             label_mtx<LabT> * const variances_out = NULL) const;
+
         // given some features, predict for all of them then compare to the ground truth labels
         error_t test_error(const feature_mtx<FeatT> & features,
                            const label_mtx<LabT> & ground_truth_labels) const;
@@ -246,6 +394,12 @@ namespace garf {
 
         inline bool is_trained() const { return trained; }
 
+        // Copy every tree into a contiguous, inference only layout (see FlatTree) which predict()
+        // then uses instead of following pointers between nodes. Retraining, loading or clearing
+        // the forest throws this away.
+        void compile_for_inference();
+        inline bool is_compiled_for_inference() const { return flat_trees.get() != NULL; }
+
         // Need different template parameters here to avoid shadowing the ones for the whole class
         template<typename F, typename L, template<typename> class S, template<typename,typename> class ST>
         friend std::ostream& operator<< (std::ostream& stream, const RegressionForest<F, L, S, ST> & frst);
@@ -280,6 +434,10 @@ namespace garf {
                                         PyObject * const predict_mean_out_np,
                                         PyObject * const predict_var_out_np,
                                         PyObject * const leaf_indices_out_np) const;
+        void py_predict_anytime(PyObject * const features_np,
+                                PyObject * const predict_mean_out_np,
+                                PyObject * const predict_var_out_np,
+                                PyObject * const trees_used_out_np) const;
         void py_feature_importance(PyObject * const features_np,
                                    PyObject * const labels_np,
                                    PyObject * const importance_out_np) const;
@@ -287,9 +445,14 @@ namespace garf {
 
 
 #ifdef GARF_SERIALIZE_ENABLE
+        // Files are written in the binary format (see binary_format.hpp). Loading also accepts
+        // the Boost text archives older versions wrote.
         void save_forest(std::string filename) const;
         void load_forest(std::string filename);
         RegressionForest(std::string filename);
+
+        void save_binary(BinaryWriter & out) const;
+        void load_binary(BinaryReader & in);
     private:
         friend class boost::serialization::access;
 
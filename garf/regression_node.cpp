@@ -6,12 +6,19 @@ namespace garf {
     void RegressionNode<FeatT, LabT, SplitT, SplFitterT>::train(const RegressionTree<FeatT, LabT, SplitT, SplFitterT> & tree,
                                                                 const feature_mtx<FeatT> & features,
                                                                 const label_mtx<LabT> & labels,
-                                                                const data_indices_vec & data_indices,
+                                                                const boost::shared_ptr<data_indices_vec> & _index_buffer,
+                                                                const datapoint_idx_t _indices_begin,
+                                                                const datapoint_idx_t _indices_count,
                                                                 const TreeOptions & tree_opts,
                                                                 SplFitterT<FeatT, LabT> * fitter,
                                                                 const util::MultiDimGaussianX<LabT> * const _dist) {
-        // Store the indices which pass through this node - this should do a copy. I hope!
-        training_data_indices = data_indices;
+        // The indices which pass through this node are a range of the tree's index buffer,
+        // which we partition in place when splitting, so nothing is copied.
+        index_buffer = _index_buffer;
+        indices_begin = _indices_begin;
+        indices_count = _indices_count;
+        data_indices_range data_indices = index_buffer->segment(indices_begin, indices_count);
+        bag_count = fitter->total_sample_count(data_indices, indices_count);
         //LOG(INFO)
 #ifdef VERBOSE
         std::cout << "[t" << tree.tree_id << ":" << node_id << "] got " << num_training_datapoints()
@@ -22,7 +29,7 @@ namespace garf {
 #ifdef VERBOSE
             std::cout << "[t" << tree.tree_id << ":" << node_id << "] no dist provided, calculating..." << std::endl;
 #endif
-            dist.fit_params(labels, data_indices);
+            fitter->fit_dist(labels, data_indices, indices_count, &fitter->node_stats, &dist);
         }
         else {
             //LOG(INFO)
@@ -45,16 +52,14 @@ namespace garf {
             return;
         }
 
-        // get the indices going left and right from splitter object. We declare
-        // them on the stack here, so that they are cleaned up at the end of this call to train()
-        // automatically
-        data_indices_vec right_child_indices;
-        data_indices_vec left_child_indices;
+        // If a split is found, the splitter partitions our range of the index buffer so that
+        // the first num_going_left indices go to the left child and the rest to the right.
+        datapoint_idx_t num_going_left = 0;
 
         // bool good_split_found = true;
         // std::cout << "[t" << tree.tree_id << ":" << node_id << "] choose_split_parameters" << std::endl;
         bool good_split_found = fitter->choose_split_parameters(features, labels, data_indices, dist,
-                                                                &split, &left_child_indices, &right_child_indices);
+                                                                &split, &num_going_left);
 
         if (!good_split_found) {
             //LOG(ERROR)
@@ -65,16 +70,54 @@ namespace garf {
         } 
 
         is_leaf = false;
+        const datapoint_idx_t num_going_right = indices_count - num_going_left;
 
-        // If we are here then assume we found decent splits, indices of which
-        // are stored in left_child_indices and right_child_indices. First create child nodes, then
+        // If we are here then assume we found decent splits, and our indices have been
+        // partitioned for the children. First create child nodes, then
         // do the training. FIXME: we could increase efficiency (slightly!) but
         left.reset(new RegressionNode<FeatT, LabT, SplitT, SplFitterT>(left_child_index(), this,
                                                           labels.cols(), depth + 1));
         right.reset(new RegressionNode<FeatT, LabT, SplitT, SplFitterT>(right_child_index(), this,
                                                            labels.cols(), depth + 1));
-        left->train(tree, features, labels, left_child_indices, tree_opts, fitter);
-        right->train(tree, features, labels, right_child_indices, tree_opts, fitter);
+
+#ifdef GARF_PARALLELIZE_TBB
+        if ((tree_opts.min_samples_for_subtree_task > 0) &&
+            (num_training_datapoints() >= tree_opts.min_samples_for_subtree_task)) {
+            // The fitter is scratch space for one node at a time, so the right subtree gets a
+            // fresh one (only as big as it needs to be) while the left keeps using ours. The
+            // new RNG is seeded from ours so training stays deterministic without properly_random.
+            std::vector<uint32_t> seed_values(4);
+            for (uint32_t i = 0; i < seed_values.size(); i++) {
+                seed_values[i] = static_cast<uint32_t>(fitter->rng());
+            }
+            std::seed_seq seed(seed_values.begin(), seed_values.end());
+            SplFitterT<FeatT, LabT> right_fitter(fitter->split_opts, num_going_right,
+                                                 fitter->feature_dimensionality, fitter->label_dims,
+                                                 fitter->print_mutex, &seed);
+            right_fitter.rng.seed(seed);
+            right_fitter.feature_binning = fitter->feature_binning;
+            right_fitter.sample_counts = fitter->sample_counts;
+
+            tbb::parallel_invoke(
+                [&] { left->train(tree, features, labels, index_buffer, indices_begin, num_going_left,
+                                  tree_opts, fitter); },
+                [&] { right->train(tree, features, labels, index_buffer, indices_begin + num_going_left,
+                                   num_going_right, tree_opts, &right_fitter); });
+            return;
+        }
+#endif
+        left->train(tree, features, labels, index_buffer, indices_begin, num_going_left, tree_opts, fitter);
+        right->train(tree, features, labels, index_buffer, indices_begin + num_going_left, num_going_right,
+                     tree_opts, fitter);
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionNode<FeatT, LabT, SplitT, SplFitterT>::discard_training_indices() {
+        index_buffer.reset();
+        if (!is_leaf) {
+            left->discard_training_indices();
+            right->discard_training_indices();
+        }
     }
 
     // Determine whether the stop growing the tree at this node.
@@ -86,7 +129,7 @@ namespace garf {
         if (depth > tree_opts.max_depth) {
             throw std::logic_error("We should never go over the max depth of a tree!");
         }
-        if (num_training_datapoints() < tree_opts.min_sample_count) {
+        if (bag_count < tree_opts.min_sample_count) {
             return true; // Stop growing as there are too few datapoints, ie we are overfitting.
         }
         // Sum just the diagonal elements of the covariance matrix. If the variances
@@ -7,7 +7,8 @@ namespace garf {
                                                                 const label_mtx<LabT> & labels,
                                                                 const data_indices_vec & data_indices,
                                                                 const TreeOptions & tree_opts,
-                                                                SplFitterT<FeatT, LabT> * fitter) {
+                                                                SplFitterT<FeatT, LabT> * fitter,
+                                                                const sample_count_vec * const sample_counts) {
         //LOG(INFO)
 #ifdef VERBOSE
         std::cout << "[t" << tree_id << "].train() data_indices = [" << data_indices.transpose() << "]" << std::endl;
@@ -17,6 +18,18 @@ namespace garf {
         // std::cout << "[t" << tree_id << "].train() #0, 0: " << features.coeff(0, 0) << " @ " << &features.coeff(0, 0) << std::endl;
         // std::cout << "#0, 0: " << features.coeff(0, 0) << " @ " << &features.coeff(0, 0) << std::endl;
 
+        // The counts only live as long as this tree's training
+        fitter->sample_counts = sample_counts;
+
+        if (tree_opts.growth == GROW_LEVEL_WISE) {
+            if (fitter->split_opts.split_search != SEARCH_RANDOM_THRESHOLDS) {
+                throw std::invalid_argument("level wise tree growth only supports random threshold split search");
+            }
+            train_level_wise(features, labels, data_indices, tree_opts, fitter);
+            fitter->sample_counts = NULL;
+            return;
+        }
+
     
         // constructor argument to RegressionNode is node id & link to parent,
         // plus label dimensionality (need this in the constructor so
@@ -30,12 +43,312 @@ namespace garf {
         // then gets automatically deleted because it's on the stack. Also means once training
         // is done only the necessary data is left in the forest (to reduce memory usage
         // & serialization size)
-        root->train(*this, features, labels, data_indices,
+        //
+        // Training works on a single copy of the indices for the whole tree, with each node
+        // partitioning its own range of it in place.
+        boost::shared_ptr<data_indices_vec> index_buffer(new data_indices_vec(data_indices));
+        root->train(*this, features, labels, index_buffer, 0, index_buffer->size(),
                     tree_opts, fitter);
+        fitter->sample_counts = NULL;
+    }
+
+    // Breadth first training. Every node at the current depth is given a slot, and then the whole
+    // level is fitted with three sequential passes over the tree's datapoints (in memory order):
+    // the range of each candidate feature at each node, then label statistics to the left of
+    // every candidate threshold, and finally routing each datapoint to its child. The per node
+    // distributions come from the accumulated statistics, so labels are never gathered per node.
+    // Nodes which have hit a stopping condition are skipped, and the fitter's scratch is only
+    // sized for the rest (their "open" slots).
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionTree<FeatT, LabT, SplitT, SplFitterT>::train_level_wise(const feature_mtx<FeatT> & features,
+                                                                           const label_mtx<LabT> & labels,
+                                                                           const data_indices_vec & data_indices,
+                                                                           const TreeOptions & tree_opts,
+                                                                           SplFitterT<FeatT, LabT> * fitter) {
+        typedef RegressionNode<FeatT, LabT, SplitT, SplFitterT> node_t;
+        typedef util::SufficientStats<LabT> stats_t;
+
+        const split_idx_t num_splits_to_try = fitter->split_opts.num_splits_to_try;
+        const split_idx_t threshes_per_split = fitter->split_opts.threshes_per_split;
+        const split_idx_t num_candidates = num_splits_to_try * threshes_per_split;
+        const datapoint_idx_t num_in_tree = data_indices.size();
+        const label_idx_t label_dims = labels.cols();
+
+        // Bagging gives us the indices in a random order - sort them so each pass walks
+        // through the feature and label matrices sequentially.
+        data_indices_vec rows = data_indices;
+        std::sort(rows.data(), rows.data() + num_in_tree);
+
+        // Slot (at the current level) of the node each datapoint is in, -1 once it reaches a leaf
+        std::vector<int32_t> row_slot(num_in_tree, 0);
+
+        // Nodes share the tree's index buffer as in depth first training. The routing pass reads
+        // from rows, so it can write each level's partition straight into the buffer.
+        boost::shared_ptr<data_indices_vec> index_buffer(new data_indices_vec(rows));
+        root.reset(new node_t(0, NULL, label_dims, 0));
+        root->index_buffer = index_buffer;
+        root->indices_begin = 0;
+        root->indices_count = num_in_tree;
+        stats_t root_stats(label_dims);
+        for (datapoint_idx_t i = 0; i < num_in_tree; i++) {
+            root_stats.add(labels.row(rows(i)), fitter->sample_count(rows(i)));
+        }
+        root_stats.to_gaussian(&root->dist);
+        root->bag_count = static_cast<datapoint_idx_t>(root_stats.count);
+
+        std::vector<node_t *> level_nodes(1, root.get());
+        std::vector<stats_t> level_stats(1, root_stats);
+        std::vector<node_t *> next_nodes;
+        std::vector<stats_t> next_stats;
+        std::vector<int32_t> open_slot;  // -1 for slots which aren't being split
+        std::vector<int32_t> best_candidate;
+        std::vector<int32_t> first_child_slot;
+        std::vector<datapoint_idx_t> next_fill;
+
+        while (!level_nodes.empty()) {
+            const split_idx_t num_slots = level_nodes.size();
+#ifdef VERBOSE
+            std::cout << "[t" << tree_id << "] level " << level_nodes[0]->depth << " has " << num_slots << " nodes" << std::endl;
+#endif
+            open_slot.assign(num_slots, -1);
+            split_idx_t num_open = 0;
+            for (split_idx_t s = 0; s < num_slots; s++) {
+                if (!level_nodes[s]->stopping_conditions_reached(tree_opts)) {
+                    open_slot[s] = num_open++;
+                }
+            }
+
+            fitter->prepare_level(num_open);
+            fitter->select_level_candidate_features(num_open);
+            for (split_idx_t s = 0; s < num_slots; s++) {
+                if (open_slot[s] >= 0) {
+                    fitter->set_level_shift(open_slot[s], level_stats[s].mean);
+                }
+            }
+
+            // Pass 1: range of each candidate feature at each node being split
+            for (datapoint_idx_t i = 0; i < num_in_tree; i++) {
+                const int32_t o = (row_slot[i] < 0) ? -1 : open_slot[row_slot[i]];
+                if (o < 0) {
+                    continue;
+                }
+                for (split_idx_t j = 0; j < num_splits_to_try; j++) {
+                    const FeatT value = fitter->level_candidate_value(features, rows(i), o, j);
+                    if (value < fitter->level_min_values(o, j)) {
+                        fitter->level_min_values(o, j) = value;
+                    }
+                    if (value > fitter->level_max_values(o, j)) {
+                        fitter->level_max_values(o, j) = value;
+                    }
+                }
+            }
+            fitter->generate_level_thresholds(num_open);
+
+            // Pass 2: label statistics on the left of every candidate split, binned by the first
+            // threshold each datapoint is left of. The right hand side is the node's statistics
+            // minus these.
+            for (datapoint_idx_t i = 0; i < num_in_tree; i++) {
+                const int32_t o = (row_slot[i] < 0) ? -1 : open_slot[row_slot[i]];
+                if (o < 0) {
+                    continue;
+                }
+                for (split_idx_t j = 0; j < num_splits_to_try; j++) {
+                    const FeatT value = fitter->level_candidate_value(features, rows(i), o, j);
+                    fitter->add_to_level_bin(o, j, value, labels.row(rows(i)), fitter->sample_count(rows(i)));
+                }
+            }
+            fitter->finish_level_bins(num_open);
+
+            // Pick the best candidate at each node, and make children for the next level
+            next_nodes.clear();
+            next_stats.clear();
+            best_candidate.assign(num_slots, -1);
+            first_child_slot.assign(num_slots, -1);
+            for (split_idx_t s = 0; s < num_slots; s++) {
+                const int32_t o = open_slot[s];
+                if (o < 0) {
+                    continue;
+                }
+                node_t * const node = level_nodes[s];
+                const stats_t & node_stats = level_stats[s];
+                // Counts here are bagged draws, see RegressionNode::bag_count
+                const datapoint_idx_t num_in_parent = node->bag_count;
+
+                double best_inf_gain = -std::numeric_limits<double>::infinity();
+                for (split_idx_t c = 0; c < num_candidates; c++) {
+                    stats_t & left_stats = fitter->left_stats;
+                    fitter->level_left_stats(o, c, &left_stats);
+                    const datapoint_idx_t num_going_left = static_cast<datapoint_idx_t>(left_stats.count);
+                    const datapoint_idx_t num_going_right = num_in_parent - num_going_left;
+                    if (!fitter->is_admissible_split(num_going_left, num_going_right)) {
+                        continue;
+                    }
+                    fitter->right_stats.set_difference(node_stats, left_stats);
+                    left_stats.to_gaussian(&fitter->left_child_dist);
+                    fitter->right_stats.to_gaussian(&fitter->right_child_dist);
+                    double inf_gain = information_gain(node->dist, fitter->left_child_dist, fitter->right_child_dist,
+                                                       num_in_parent, num_going_left, num_going_right);
+                    if (inf_gain > best_inf_gain) {
+                        best_inf_gain = inf_gain;
+                        best_candidate[s] = c;
+                    }
+                }
+                if (best_candidate[s] < 0) {
+                    continue;  // no viable split, so this node stays a leaf
+                }
+
+                const split_idx_t c = best_candidate[s];
+                fitter->set_level_parameters_in_splitter(o, c / threshes_per_split,
+                                                         fitter->level_threshold(o, c), &node->split);
+                node->is_leaf = false;
+                node->left.reset(new node_t(node->left_child_index(), node, label_dims, node->depth + 1));
+                node->right.reset(new node_t(node->right_child_index(), node, label_dims, node->depth + 1));
+
+                stats_t & left_stats = fitter->left_stats;
+                fitter->level_left_stats(o, c, &left_stats);
+                fitter->right_stats.set_difference(node_stats, left_stats);
+                left_stats.to_gaussian(&node->left->dist);
+                fitter->right_stats.to_gaussian(&node->right->dist);
+                node->left->bag_count = static_cast<datapoint_idx_t>(left_stats.count);
+                node->right->bag_count = num_in_parent - node->left->bag_count;
+                node->left->index_buffer = index_buffer;
+                node->right->index_buffer = index_buffer;
+
+                first_child_slot[s] = next_nodes.size();
+                next_nodes.push_back(node->left.get());
+                next_nodes.push_back(node->right.get());
+                next_stats.push_back(left_stats);
+                next_stats.push_back(fitter->right_stats);
+            }
+
+            // Pass 3: send each datapoint to its child, which is the next level's slot
+            next_fill.assign(next_nodes.size(), 0);
+            for (datapoint_idx_t i = 0; i < num_in_tree; i++) {
+                const int32_t s = row_slot[i];
+                if (s < 0) {
+                    continue;
+                }
+                if (first_child_slot[s] < 0) {
+                    row_slot[i] = -1;
+                    continue;
+                }
+                const int32_t o = open_slot[s];
+                const split_idx_t c = best_candidate[s];
+                const FeatT value = fitter->level_candidate_value(features, rows(i), o, c / threshes_per_split);
+                const int32_t child_slot = first_child_slot[s] + ((value <= fitter->level_threshold(o, c)) ? 0 : 1);
+                next_fill[child_slot]++;
+                row_slot[i] = child_slot;
+            }
+
+            // Now the number of indices going each way is known, lay out the children's ranges
+            // of the index buffer and write the indices into them
+            for (split_idx_t s = 0; s < num_slots; s++) {
+                if (first_child_slot[s] < 0) {
+                    continue;
+                }
+                node_t * const left_child = next_nodes[first_child_slot[s]];
+                node_t * const right_child = next_nodes[first_child_slot[s] + 1];
+                left_child->indices_begin = level_nodes[s]->indices_begin;
+                left_child->indices_count = next_fill[first_child_slot[s]];
+                right_child->indices_begin = left_child->indices_begin + left_child->indices_count;
+                right_child->indices_count = next_fill[first_child_slot[s] + 1];
+            }
+            next_fill.assign(next_nodes.size(), 0);
+            for (datapoint_idx_t i = 0; i < num_in_tree; i++) {
+                const int32_t child_slot = row_slot[i];
+                if (child_slot >= 0) {
+                    (*index_buffer)(next_nodes[child_slot]->indices_begin + next_fill[child_slot]++) = rows(i);
+                }
+            }
+
+            level_nodes.swap(next_nodes);
+            level_stats.swap(next_stats);
+        }
     }
 
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
-    const RegressionNode<FeatT, LabT, SplitT, SplFitterT> & RegressionTree<FeatT, LabT, SplitT, SplFitterT>::evaluate(const feature_vec<FeatT> & fvec,
+    void RegressionTree<FeatT, LabT, SplitT, SplFitterT>::mark_in_bag(const const_data_indices_range & data_indices,
+                                                                      datapoint_idx_t num_training_datapoints) {
+        clear_in_bag(num_training_datapoints);
+        for (datapoint_idx_t i = 0; i < data_indices.size(); i++) {
+            set_in_bag(data_indices(i));
+        }
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    bool RegressionTree<FeatT, LabT, SplitT, SplFitterT>::is_in_bag(datapoint_idx_t data_idx) const {
+        if (has_in_bag()) {
+            return in_bag_bit(data_idx);
+        }
+        const const_data_indices_range indices = get_root().training_data_indices();
+        for (datapoint_idx_t i = 0; i < indices.size(); i++) {
+            if (indices(i) == data_idx) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionTree<FeatT, LabT, SplitT, SplFitterT>::in_bag_mask(bool_vec * const in_bag_out) const {
+        in_bag_out->setConstant(false);
+        if (has_in_bag()) {
+            for (datapoint_idx_t d = 0; d < in_bag_size; d++) {
+                (*in_bag_out)(d) = in_bag_bit(d);
+            }
+            return;
+        }
+        const const_data_indices_range indices = get_root().training_data_indices();
+        for (datapoint_idx_t i = 0; i < indices.size(); i++) {
+            (*in_bag_out)(indices(i)) = true;
+        }
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionTree<FeatT, LabT, SplitT, SplFitterT>::discard_training_indices(const datapoint_idx_t num_training_datapoints) {
+        if (root->index_buffer.get() != NULL) {
+            mark_in_bag(root->training_data_indices(), num_training_datapoints);
+        }
+        root->discard_training_indices();
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    size_t RegressionTree<FeatT, LabT, SplitT, SplFitterT>::memory_bytes() const {
+        typedef RegressionNode<FeatT, LabT, SplitT, SplFitterT> node_t;
+        // A shared_ptr control block holds two counts, a vtable pointer and the owned pointer
+        const size_t control_block_bytes = 2 * sizeof(long) + 2 * sizeof(void *);
+
+        size_t total = sizeof(*this) + in_bag.size() * sizeof(uint64_t);
+        if (root.get() == NULL) {
+            return total;
+        }
+
+        // Nodes normally all share one index buffer, so this list stays tiny
+        std::vector<const data_indices_vec *> index_buffers_seen;
+        std::vector<const node_t *> to_visit(1, root.get());
+        while (!to_visit.empty()) {
+            const node_t * node = to_visit.back();
+            to_visit.pop_back();
+            const size_t label_dims = node->dist.mean.size();
+            total += sizeof(node_t) + control_block_bytes + (label_dims + (label_dims * label_dims)) * sizeof(LabT);
+
+            const data_indices_vec * index_buffer = node->index_buffer.get();
+            if ((index_buffer != NULL) &&
+                (std::find(index_buffers_seen.begin(), index_buffers_seen.end(), index_buffer) == index_buffers_seen.end())) {
+                index_buffers_seen.push_back(index_buffer);
+                total += sizeof(data_indices_vec) + control_block_bytes + index_buffer->size() * sizeof(datapoint_idx_t);
+            }
+            if (!node->is_leaf) {
+                to_visit.push_back(node->left.get());
+                to_visit.push_back(node->right.get());
+            }
+        }
+        return total;
+    }
+
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    template<class FeatVecT>
+    const RegressionNode<FeatT, LabT, SplitT, SplFitterT> & RegressionTree<FeatT, LabT, SplitT, SplFitterT>::evaluate(const FeatVecT & fvec,
                                                                                                                       const PredictOptions & predict_opts) const {
         depth_idx_t current_depth = 0;
 #ifdef VERBOSE
@@ -63,6 +376,27 @@ namespace garf {
         return *current_node;
     }
 
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    template<class FeatVecT>
+    void RegressionTree<FeatT, LabT, SplitT, SplFitterT>::evaluate_at_depths(const FeatVecT & fvec,
+                                                                             const depth_idx_t * const depths,
+                                                                             const size_t num_depths,
+                                                                             const RegressionNode<FeatT, LabT, SplitT, SplFitterT> ** const nodes_out) const {
+        const RegressionNode<FeatT, LabT, SplitT, SplFitterT> * current_node = root.get();
+        depth_idx_t current_depth = 0;
+        for (size_t k = 0; k < num_depths; k++) {
+            while ((current_depth < depths[k]) && !current_node->is_leaf) {
+                if (current_node->split.evaluate(fvec) == LEFT) {
+                    current_node = current_node->left.get();
+                } else {
+                    current_node = current_node->right.get();
+                }
+                current_depth++;
+            }
+            nodes_out[k] = current_node;
+        }
+    }
+
     // for a single tree, perform the prediction for a bunch of features and get MSE by
     // comparing to the provided ground truth. We must take in a pointer to predicted_labels_tmp
     // as allocating that internally every time is a big waste.
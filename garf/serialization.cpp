@@ -2,13 +2,19 @@
 #define GARF_EIGEN_SERIALIZATION_HPP
 
 #include <fstream>
+#include <locale>
 #include <Eigen/Core>
 
 #include <boost/serialization/shared_ptr.hpp>
+#include <boost/serialization/vector.hpp>
 #include <boost/archive/text_oarchive.hpp> 
 #include <boost/archive/text_iarchive.hpp> 
+#include <boost/archive/codecvt_null.hpp>
+#include <boost/math/special_functions/nonfinite_num_facets.hpp>
+#include <boost/serialization/version.hpp>
 
 #include "types.hpp"
+#include "binary_format.hpp"
 
 using namespace Eigen;
 
@@ -31,29 +37,102 @@ namespace boost {
 }
 
 
+// Bump these whenever a field is added to one of the classes, and only load the
+// new fields when the archive version says they are there.
+BOOST_CLASS_VERSION(garf::SplitOptions, 3)
+BOOST_CLASS_VERSION(garf::TreeOptions, 2)
+BOOST_CLASS_VERSION(garf::ForestOptions, 3)
+BOOST_CLASS_VERSION(garf::PredictOptions, 4)
+
+// BOOST_CLASS_VERSION doesn't work for templates, so this is what it expands to
+#define GARF_TEMPLATE_CLASS_VERSION(T, N)                                               \
+namespace boost { namespace serialization {                                             \
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT> \
+    struct version<garf::T<FeatT, LabT, SplitT, SplFitterT> > {                         \
+        typedef mpl::int_<N> type;                                                      \
+        typedef mpl::integral_c_tag tag;                                                \
+        BOOST_STATIC_CONSTANT(int, value = version::type::value);                       \
+    };                                                                                  \
+}}
+
+GARF_TEMPLATE_CLASS_VERSION(RegressionNode, 2)
+GARF_TEMPLATE_CLASS_VERSION(RegressionTree, 2)
+
 namespace garf {
 
-    // Utility function which means we don't need to open an fstream, etc
+    // Load anything with Boost serialization from a text archive. Leaves have NaN split
+    // thresholds, which plain streams write but can't read back, hence the facets.
+    template<class T>
+    void load_text_archive(const std::string & filename, T * const obj) {
+        std::ifstream ifs(filename.c_str());
+        if (!ifs) {
+            throw std::invalid_argument("couldn't open " + filename + " for reading");
+        }
+        std::locale default_locale(std::locale::classic(), new boost::archive::codecvt_null<char>);
+        std::locale nonfinite_locale(default_locale, new boost::math::nonfinite_num_get<char>);
+        ifs.imbue(nonfinite_locale);
+        boost::archive::text_iarchive ia(ifs, boost::archive::no_codecvt);
+        ia >> *obj;
+    }
+
+    // Utility function which means we don't need to open an fstream, etc. The whole file is
+    // built in memory and written in one go.
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
     void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::save_forest(std::string filename) const {
-        std::ofstream ofs(filename);
-        boost::archive::text_oarchive oa(ofs);
-        oa << *this;
+        std::vector<char> contents;
+        BinaryWriter out(contents);
+        save_binary(out);
+        std::ofstream ofs(filename.c_str(), std::ios::binary);
+        if (!ofs) {
+            throw std::invalid_argument("couldn't open " + filename + " for writing");
+        }
+        ofs.write(contents.data(), contents.size());
+        if (!ofs) {
+            throw std::invalid_argument("couldn't write forest to " + filename);
+        }
         // std::cout << "forest saved to " << filename << std::endl;
     }
 
     // Load a forest from disk into the forest this is called on. Note, this will
     // delete the current forest, so it makes sense to call this on a forest which
-    // isn't currently trained - but there is nothing to enforce this. 
+    // isn't currently trained - but there is nothing to enforce this. Binary files are
+    // read into memory with a single read and parsed from there, and if they turn out to
+    // be bad the current forest is kept. Anything else is assumed to be an old text archive.
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
     void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::load_forest(std::string filename) {
-        clear();
-        std::ifstream ifs(filename);
-        boost::archive::text_iarchive ia(ifs);
-        ia >> *this;
+        std::ifstream ifs(filename.c_str(), std::ios::binary);
+        if (!ifs) {
+            throw std::invalid_argument("couldn't open " + filename + " for reading");
+        }
+        char magic[sizeof(binary_forest_magic)];
+        ifs.read(magic, sizeof(magic));
+        if (is_binary_forest(magic, ifs.gcount())) {
+            ifs.seekg(0, std::ios::end);
+            const std::streamoff size = ifs.tellg();
+            ifs.seekg(0, std::ios::beg);
+            std::vector<char> contents(size);
+            ifs.read(contents.data(), size);
+            if (ifs.gcount() != size) {
+                throw std::invalid_argument("couldn't read forest from " + filename);
+            }
+            BinaryReader in(contents.data(), contents.data() + contents.size());
+            load_binary(in);
+        } else {
+            ifs.close();
+            clear();
+            load_text_archive(filename, this);
+        }
         // std::cout << "forest loaded from " << filename << std::endl;
     }
 
+    // Rewrite a forest saved as a text archive by older versions in the binary format
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void convert_forest_to_binary(const std::string & text_filename, const std::string & binary_filename) {
+        RegressionForest<FeatT, LabT, SplitT, SplFitterT> forest;
+        load_text_archive(text_filename, &forest);
+        forest.save_forest(binary_filename);
+    }
+
     // Alternate constructor which loads from a filename straight away
     template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
     RegressionForest<FeatT, LabT, SplitT, SplFitterT>::RegressionForest(std::string filename) {
@@ -78,10 +157,19 @@ namespace garf {
         ar << dist;
         ar << split;
         ar << is_leaf;
-        ar << training_data_indices;
+        // Indices are written out as a standalone vector, same as when every node had its
+        // own copy, unless they were thrown away after training
+        ar << indices_count;
+        ar << bag_count;
+        bool has_indices = (index_buffer.get() != NULL);
+        ar << has_indices;
+        if (has_indices) {
+            data_indices_vec training_indices = training_data_indices();
+            ar << training_indices;
 #ifdef VERBOSE
-        std::cout << "saved node " << node_id << " with datapoints " << training_data_indices.transpose() << std::endl;
+            std::cout << "saved node " << node_id << " with datapoints " << training_indices.transpose() << std::endl;
 #endif
+        }
         // Only serialize children if there are any
         if (!is_leaf) {
             ar << left;
@@ -101,10 +189,28 @@ namespace garf {
         ar >> dist;
         ar >> split;
         ar >> is_leaf;
-        ar >> training_data_indices;
+        bool has_indices = true;
+        if (version >= 1) {
+            ar >> indices_count;
+            if (version >= 2) {
+                ar >> bag_count;
+            }
+            ar >> has_indices;
+        }
+        indices_begin = 0;
+        if (has_indices) {
+            index_buffer.reset(new data_indices_vec());
+            ar >> *index_buffer;
+            indices_count = index_buffer->size();
 #ifdef VERBOSE
-        std::cout << "loaded node " << node_id << " with datapoints " << training_data_indices.transpose() << std::endl;
+            std::cout << "loaded node " << node_id << " with datapoints " << index_buffer->transpose() << std::endl;
 #endif
+        } else {
+            index_buffer.reset();
+        }
+        if (version < 2) {
+            bag_count = indices_count;
+        }
 
         if (!is_leaf) {
             ar >> left;
@@ -129,6 +235,20 @@ namespace garf {
     void RegressionTree<FeatT, LabT, SplitT, SplFitterT>::serialize(Archive & ar, const unsigned int version) {
         ar & tree_id;
         ar & root;
+        if (version >= 2) {
+            ar & in_bag_size;
+            ar & in_bag;
+        } else if (version == 1) {
+            // Only when loading - these archives have a byte per training datapoint
+            bool_vec in_bag_bytes;
+            ar & in_bag_bytes;
+            clear_in_bag(in_bag_bytes.size());
+            for (datapoint_idx_t d = 0; d < in_bag_size; d++) {
+                if (in_bag_bytes(d)) {
+                    set_in_bag(d);
+                }
+            }
+        }
     }
 
     // Save a RegressionForest
@@ -161,11 +281,522 @@ namespace garf {
 
         ar >> forest_stats;
         trees.reset(new RegressionTree<FeatT, LabT, SplitT, SplFitterT>[forest_stats.num_trees]);
+        flat_trees.reset();
         for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
             ar >> trees[t];
         }
     }
 
+    // Everything before the trees in a binary forest file
+    struct BinaryForestHeader {
+        uint32_t format_version;
+        uint8_t feature_type;
+        uint8_t label_type;
+        std::string split_type;
+        bool trained;
+        ForestStats stats;
+    };
+
+    inline void read_binary_forest_header(BinaryReader & in, BinaryForestHeader * const header) {
+        char magic[sizeof(binary_forest_magic)];
+        in.read_array(magic, sizeof(magic));
+        if (!is_binary_forest(magic, sizeof(magic))) {
+            throw std::invalid_argument("not a binary forest file");
+        }
+        in.read(header->format_version);
+        if (header->format_version > binary_forest_format_version) {
+            throw std::invalid_argument("forest file was written by a newer version of garf");
+        }
+        in.read(header->feature_type);
+        in.read(header->label_type);
+        header->split_type = in.read_string();
+        in.read(header->trained);
+        in.read_versioned(header->stats);
+    }
+
+    // Bytes from the start of a binary forest file up to and including the length of the split
+    // type name - these are the same in every file
+    inline size_t binary_forest_fixed_header_size() {
+        std::vector<char> buffer;
+        BinaryWriter out(buffer);
+        out.write_array(binary_forest_magic, sizeof(binary_forest_magic));
+        out.write(binary_forest_format_version);
+        out.write(binary_scalar_code<float>());
+        out.write(binary_scalar_code<float>());
+        out.write_string("");
+        return buffer.size();
+    }
+
+    // Most bytes the rest of the header and the options can take after the split type name. Newer
+    // versions of them only ever add fields, so this is their size at the current versions.
+    inline size_t binary_forest_max_options_size() {
+        std::vector<char> buffer;
+        BinaryWriter out(buffer);
+        out.write(false);
+        out.write_versioned(ForestStats());
+        out.write_versioned(ForestOptions());
+        out.write_versioned(TreeOptions());
+        out.write_versioned(SplitOptions());
+        out.write_versioned(PredictOptions());
+        return buffer.size();
+    }
+
+    // Read the header and options from the start of a binary forest file, without touching
+    // any trees. Only the fixed part of the header is read at first, then just what the split
+    // type name and options can take. Returns the size of the file, and sets prefix_size to the
+    // number of bytes the header and options took (which is where version 2 files have their
+    // tree offset table).
+    inline uint64_t read_binary_forest_prefix(std::istream & file, BinaryForestHeader * const header,
+                                              ForestOptions * const forest_options, TreeOptions * const tree_options,
+                                              SplitOptions * const split_options, PredictOptions * const predict_options,
+                                              uint64_t * const prefix_size) {
+        file.seekg(0, std::ios::end);
+        const uint64_t file_size = file.tellg();
+        std::vector<char> prefix(std::min<uint64_t>(binary_forest_fixed_header_size(), file_size));
+        file.seekg(0, std::ios::beg);
+        file.read(prefix.data(), prefix.size());
+        if (static_cast<uint64_t>(file.gcount()) != prefix.size()) {
+            throw std::invalid_argument("couldn't read forest file header");
+        } else if (!is_binary_forest(prefix.data(), prefix.size())) {
+            throw std::invalid_argument("not a binary forest file");
+        }
+
+        // The split type name's length is the last thing in the fixed part
+        if (prefix.size() == binary_forest_fixed_header_size()) {
+            BinaryReader fixed(prefix.data(), prefix.data() + prefix.size());
+            fixed.skip(prefix.size() - sizeof(uint32_t));
+            uint32_t split_type_length;
+            fixed.read(split_type_length);
+            const uint64_t rest_size = std::min<uint64_t>(static_cast<uint64_t>(split_type_length) + binary_forest_max_options_size(),
+                                                          file_size - prefix.size());
+            prefix.resize(prefix.size() + rest_size);
+            file.read(prefix.data() + prefix.size() - rest_size, rest_size);
+            if (static_cast<uint64_t>(file.gcount()) != rest_size) {
+                throw std::invalid_argument("couldn't read forest file header");
+            }
+        }
+
+        BinaryReader in(prefix.data(), prefix.data() + prefix.size());
+        read_binary_forest_header(in, header);
+        in.read_versioned(*forest_options);
+        in.read_versioned(*tree_options);
+        in.read_versioned(*split_options);
+        in.read_versioned(*predict_options);
+        *prefix_size = in.position() - prefix.data();
+        return file_size;
+    }
+
+    // Everything about a saved forest apart from its trees, see peek_forest_header
+    struct ForestFileInfo {
+        uint32_t format_version;
+        std::string feature_type;  // "float" or "double"
+        std::string label_type;
+        std::string split_type;    // name() of the split class, eg "axis_aligned"
+        bool trained;
+        ForestStats stats;
+        ForestOptions forest_options;
+        TreeOptions tree_options;
+        SplitOptions split_options;
+        PredictOptions predict_options;
+        uint64_t file_size;
+    };
+
+    // Find out what is in a binary forest file by reading only its header and options (a couple
+    // of hundred bytes), so it takes the same time however big the forest is. Works whatever the feature, label and
+    // split types are. Text archives hold no type information, so can't be peeked at.
+    inline ForestFileInfo peek_forest_header(const std::string & filename) {
+        std::ifstream ifs(filename.c_str(), std::ios::binary);
+        if (!ifs) {
+            throw std::invalid_argument("couldn't open " + filename + " for reading");
+        }
+        char magic[sizeof(binary_forest_magic)];
+        ifs.read(magic, sizeof(magic));
+        if (!is_binary_forest(magic, ifs.gcount())) {
+            throw std::invalid_argument(filename + " is not a binary forest file (text archives need converting first)");
+        }
+
+        ForestFileInfo info;
+        BinaryForestHeader header;
+        uint64_t prefix_size;
+        info.file_size = read_binary_forest_prefix(ifs, &header, &info.forest_options, &info.tree_options,
+                                                   &info.split_options, &info.predict_options, &prefix_size);
+        info.format_version = header.format_version;
+        info.feature_type = binary_scalar_name(header.feature_type);
+        info.label_type = binary_scalar_name(header.label_type);
+        info.split_type = header.split_type;
+        info.trained = header.trained;
+        info.stats = header.stats;
+        return info;
+    }
+
+    // Throw if a file's header isn't for a forest of this kind, or doesn't make sense
+    template<typename FeatT, typename LabT, template<typename> class SplitT>
+    void check_binary_forest_header(const BinaryForestHeader & header) {
+        if ((header.feature_type != binary_scalar_code<FeatT>()) || (header.label_type != binary_scalar_code<LabT>())) {
+            throw std::invalid_argument(std::string("forest file has ") + binary_scalar_name(header.feature_type) +
+                                        " features and " + binary_scalar_name(header.label_type) +
+                                        " labels, which this forest can't load");
+        } else if (header.split_type != SplitT<FeatT>().name()) {
+            throw std::invalid_argument("forest file has " + header.split_type + " splits, which this forest can't load");
+        } else if ((header.stats.num_trees < 0) || ((header.stats.num_trees > 0) && (header.stats.label_dimensions < 1))) {
+            throw std::invalid_argument("forest file is truncated or corrupt");
+        }
+    }
+
+    // Encodes trees into their own buffers, so they can be done in any order (or at once)
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    class concurrent_tree_encoder {
+        const RegressionTree<FeatT, LabT, SplitT, SplFitterT> * const trees;
+        std::vector<std::vector<char> > * const tree_blocks;
+    public:
+        void operator() (const tree_idx_t begin, const tree_idx_t end) const {
+            for (tree_idx_t t = begin; t < end; t++) {
+                BinaryWriter out((*tree_blocks)[t]);
+                trees[t].save_binary(out);
+            }
+        }
+#ifdef GARF_PARALLELIZE_TBB
+        void operator() (const blocked_range<tree_idx_t> & r) const {
+            (*this)(r.begin(), r.end());
+        }
+#endif
+        concurrent_tree_encoder(const RegressionTree<FeatT, LabT, SplitT, SplFitterT> * const _trees,
+                                std::vector<std::vector<char> > * const _tree_blocks)
+            : trees(_trees), tree_blocks(_tree_blocks) {}
+    };
+
+    // Decodes each tree from its own block of the file. The offsets have already been checked.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    class concurrent_tree_decoder {
+        RegressionTree<FeatT, LabT, SplitT, SplFitterT> * const trees;
+        const char * const blocks_begin;
+        const std::vector<uint64_t> & tree_offsets;
+        const std::vector<uint64_t> & tree_sizes;
+        const label_idx_t label_dims;
+    public:
+        void operator() (const tree_idx_t begin, const tree_idx_t end) const {
+            for (tree_idx_t t = begin; t < end; t++) {
+                const char * const block = blocks_begin + tree_offsets[t];
+                BinaryReader in(block, block + tree_sizes[t]);
+                trees[t].load_binary(in, label_dims);
+                if (in.remaining() != 0) {
+                    throw std::invalid_argument("forest file is truncated or corrupt");
+                }
+            }
+        }
+#ifdef GARF_PARALLELIZE_TBB
+        void operator() (const blocked_range<tree_idx_t> & r) const {
+            (*this)(r.begin(), r.end());
+        }
+#endif
+        concurrent_tree_decoder(RegressionTree<FeatT, LabT, SplitT, SplFitterT> * const _trees,
+                                const char * const _blocks_begin,
+                                const std::vector<uint64_t> & _tree_offsets,
+                                const std::vector<uint64_t> & _tree_sizes,
+                                const label_idx_t _label_dims)
+            : trees(_trees), blocks_begin(_blocks_begin), tree_offsets(_tree_offsets),
+              tree_sizes(_tree_sizes), label_dims(_label_dims) {}
+    };
+
+    // Save a RegressionForest in the binary format
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::save_binary(BinaryWriter & out) const {
+        out.write_array(binary_forest_magic, sizeof(binary_forest_magic));
+        out.write(binary_forest_format_version);
+        out.write(binary_scalar_code<FeatT>());
+        out.write(binary_scalar_code<LabT>());
+        out.write_string(SplitT<FeatT>().name());
+        out.write(trained);
+        out.write_versioned(forest_stats);
+
+        out.write_versioned(forest_options);
+        out.write_versioned(tree_options);
+        out.write_versioned(split_options);
+        out.write_versioned(predict_options);
+
+        std::vector<std::vector<char> > tree_blocks(forest_stats.num_trees);
+#ifdef GARF_PARALLELIZE_TBB
+        parallel_for(blocked_range<tree_idx_t>(0, forest_stats.num_trees, 1),
+                     concurrent_tree_encoder<FeatT, LabT, SplitT, SplFitterT>(trees.get(), &tree_blocks));
+#else
+        concurrent_tree_encoder<FeatT, LabT, SplitT, SplFitterT>(trees.get(), &tree_blocks)(0, forest_stats.num_trees);
+#endif
+
+        std::vector<uint64_t> tree_offsets(forest_stats.num_trees);
+        std::vector<uint64_t> tree_sizes(forest_stats.num_trees);
+        uint64_t offset = 0;
+        for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+            tree_offsets[t] = offset;
+            tree_sizes[t] = tree_blocks[t].size();
+            offset += tree_sizes[t];
+        }
+        out.write_array(tree_offsets.data(), tree_offsets.size());
+        out.write_array(tree_sizes.data(), tree_sizes.size());
+        for (tree_idx_t t = 0; t < forest_stats.num_trees; t++) {
+            out.write_bytes(tree_blocks[t]);
+            std::vector<char>().swap(tree_blocks[t]);
+        }
+    }
+
+    // Load a RegressionForest from the binary format, refusing files for a different kind of forest.
+    // Everything is read into locals first, so if the file turns out to be bad (which throws) the
+    // forest is left exactly as it was.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionForest<FeatT, LabT, SplitT, SplFitterT>::load_binary(BinaryReader & in) {
+        BinaryForestHeader header;
+        read_binary_forest_header(in, &header);
+        check_binary_forest_header<FeatT, LabT, SplitT>(header);
+        const tree_idx_t num_trees = header.stats.num_trees;
+        const label_idx_t label_dims = header.stats.label_dimensions;
+        // Every tree takes at least a byte, and every node a byte per label dimension
+        if (num_trees > 0) {
+            in.require(num_trees, 1);
+            in.require(label_dims, 1);
+        }
+
+        ForestOptions new_forest_options;
+        TreeOptions new_tree_options;
+        SplitOptions new_split_options;
+        PredictOptions new_predict_options;
+        in.read_versioned(new_forest_options);
+        in.read_versioned(new_tree_options);
+        in.read_versioned(new_split_options);
+        in.read_versioned(new_predict_options);
+
+        boost::shared_array<RegressionTree<FeatT, LabT, SplitT, SplFitterT> > new_trees(
+            new RegressionTree<FeatT, LabT, SplitT, SplFitterT>[num_trees]);
+        if (header.format_version < 2) {
+            for (tree_idx_t t = 0; t < num_trees; t++) {
+                new_trees[t].load_binary(in, label_dims);
+            }
+        } else {
+            std::vector<uint64_t> tree_offsets;
+            std::vector<uint64_t> tree_sizes;
+            in.read_vector(&tree_offsets, num_trees);
+            in.read_vector(&tree_sizes, num_trees);
+            uint64_t blocks_end = 0;
+            for (tree_idx_t t = 0; t < num_trees; t++) {
+                if ((tree_offsets[t] > in.remaining()) || (tree_sizes[t] > (in.remaining() - tree_offsets[t]))) {
+                    throw std::invalid_argument("forest file is truncated or corrupt");
+                }
+                blocks_end = std::max(blocks_end, tree_offsets[t] + tree_sizes[t]);
+            }
+
+            concurrent_tree_decoder<FeatT, LabT, SplitT, SplFitterT> decoder(new_trees.get(), in.position(), tree_offsets,
+                                                                             tree_sizes, label_dims);
+#ifdef GARF_PARALLELIZE_TBB
+            parallel_for(blocked_range<tree_idx_t>(0, num_trees, 1), decoder);
+#else
+            decoder(0, num_trees);
+#endif
+            in.skip(blocks_end);
+        }
+
+        // Every tree decoded, so now it's safe to replace what we had
+        forest_options = new_forest_options;
+        tree_options = new_tree_options;
+        split_options = new_split_options;
+        predict_options = new_predict_options;
+        trees.swap(new_trees);
+        flat_trees.reset();
+        forest_stats = header.stats;
+        trained = header.trained;
+    }
+
+    // Save a RegressionTree in the binary format. Nodes are numbered in depth first order, left
+    // before right, and written as one block per field:
+    //
+    //     int64 tree_id, int64 num_nodes
+    //     int64 node_id[num_nodes], int64 depth[num_nodes], uint8 is_leaf[num_nodes]
+    //     int64 indices_count[num_nodes], int64 bag_count[num_nodes], uint8 has_indices[num_nodes]
+    //     uint32 split class version, then each node's split through its serialize()
+    //     LabT mean[num_nodes][label_dims], LabT cov[num_nodes][label_dims * label_dims]
+    //     int64 num_indices, int64 indices[num_indices] (those of the nodes with has_indices, in order)
+    //     int64 in_bag size, then in_bag packed into bits, 8 per byte starting at the low bit. The
+    //     size is 0 when the training indices were kept, as then there is no bitmap.
+    //
+    // The tree's structure comes from is_leaf alone - depth first order means a node's left
+    // child is always the next node, and its right child follows the left subtree.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionTree<FeatT, LabT, SplitT, SplFitterT>::save_binary(BinaryWriter & out) const {
+        typedef RegressionNode<FeatT, LabT, SplitT, SplFitterT> node_t;
+        std::vector<const node_t *> nodes;
+        std::vector<const node_t *> to_visit(1, &get_root());
+        while (!to_visit.empty()) {
+            const node_t * const node = to_visit.back();
+            to_visit.pop_back();
+            nodes.push_back(node);
+            if (!node->is_leaf) {
+                to_visit.push_back(node->right.get());
+                to_visit.push_back(node->left.get());
+            }
+        }
+
+        const size_t num_nodes = nodes.size();
+        const label_idx_t label_dims = root->dist.dimensions;
+        std::vector<node_idx_t> node_ids(num_nodes);
+        std::vector<depth_idx_t> depths(num_nodes);
+        std::vector<uint8_t> is_leaf(num_nodes);
+        std::vector<datapoint_idx_t> indices_counts(num_nodes);
+        std::vector<datapoint_idx_t> bag_counts(num_nodes);
+        std::vector<uint8_t> has_indices(num_nodes);
+        std::vector<LabT> means(num_nodes * label_dims);
+        std::vector<LabT> covs(num_nodes * label_dims * label_dims);
+        datapoint_idx_t num_indices = 0;
+        for (size_t i = 0; i < num_nodes; i++) {
+            const node_t & node = *nodes[i];
+            node_ids[i] = node.node_id;
+            depths[i] = node.depth;
+            is_leaf[i] = node.is_leaf;
+            indices_counts[i] = node.indices_count;
+            bag_counts[i] = node.bag_count;
+            has_indices[i] = (node.index_buffer.get() != NULL);
+            if (has_indices[i]) {
+                num_indices += node.indices_count;
+            }
+            std::copy(node.dist.mean.data(), node.dist.mean.data() + label_dims, &means[i * label_dims]);
+            std::copy(node.dist.cov.data(), node.dist.cov.data() + (label_dims * label_dims),
+                      &covs[i * label_dims * label_dims]);
+        }
+
+        out.write(tree_id);
+        out.write(static_cast<int64_t>(num_nodes));
+        out.write_array(node_ids.data(), num_nodes);
+        out.write_array(depths.data(), num_nodes);
+        out.write_array(is_leaf.data(), num_nodes);
+        out.write_array(indices_counts.data(), num_nodes);
+        out.write_array(bag_counts.data(), num_nodes);
+        out.write_array(has_indices.data(), num_nodes);
+
+        const uint32_t split_version = boost::serialization::version<SplitT<FeatT> >::value;
+        out.write(split_version);
+        for (size_t i = 0; i < num_nodes; i++) {
+            out.write_fields(nodes[i]->split, split_version);
+        }
+
+        out.write_array(means.data(), means.size());
+        out.write_array(covs.data(), covs.size());
+
+        out.write(num_indices);
+        for (size_t i = 0; i < num_nodes; i++) {
+            if (has_indices[i]) {
+                out.write_array(nodes[i]->training_data_indices().data(), nodes[i]->indices_count);
+            }
+        }
+
+        std::vector<uint8_t> in_bag_bits((in_bag_size + 7) / 8);
+        for (size_t b = 0; b < in_bag_bits.size(); b++) {
+            in_bag_bits[b] = static_cast<uint8_t>(in_bag[b / 8] >> (8 * (b % 8)));
+        }
+        out.write(static_cast<int64_t>(in_bag_size));
+        out.write_array(in_bag_bits.data(), in_bag_bits.size());
+    }
+
+    // Load a RegressionTree from the binary format. All the nodes with training indices share
+    // one buffer, as they do after training.
+    template<typename FeatT, typename LabT, template<typename> class SplitT, template<typename, typename> class SplFitterT>
+    void RegressionTree<FeatT, LabT, SplitT, SplFitterT>::load_binary(BinaryReader & in, const label_idx_t label_dims) {
+        typedef RegressionNode<FeatT, LabT, SplitT, SplFitterT> node_t;
+        in.read(tree_id);
+        int64_t num_nodes;
+        in.read(num_nodes);
+        if (num_nodes < 1) {
+            throw std::invalid_argument("forest file is truncated or corrupt");
+        }
+
+        std::vector<node_idx_t> node_ids;
+        std::vector<depth_idx_t> depths;
+        std::vector<uint8_t> is_leaf;
+        std::vector<datapoint_idx_t> indices_counts;
+        std::vector<datapoint_idx_t> bag_counts;
+        std::vector<uint8_t> has_indices;
+        in.read_vector(&node_ids, num_nodes);
+        in.read_vector(&depths, num_nodes);
+        in.read_vector(&is_leaf, num_nodes);
+        in.read_vector(&indices_counts, num_nodes);
+        in.read_vector(&bag_counts, num_nodes);
+        in.read_vector(&has_indices, num_nodes);
+
+        uint32_t split_version;
+        in.read(split_version);
+        if (split_version > static_cast<uint32_t>(boost::serialization::version<SplitT<FeatT> >::value)) {
+            throw std::invalid_argument("forest file was written by a newer version of garf");
+        }
+        std::vector<SplitT<FeatT> > splits(num_nodes);
+        for (int64_t i = 0; i < num_nodes; i++) {
+            in.read_fields(splits[i], split_version);
+        }
+
+        // Checked in two steps so the sizes can't overflow
+        std::vector<LabT> means;
+        std::vector<LabT> covs;
+        in.require(num_nodes, label_dims * sizeof(LabT));
+        in.read_vector(&means, num_nodes * label_dims);
+        in.require(num_nodes * label_dims, label_dims * sizeof(LabT));
+        in.read_vector(&covs, num_nodes * label_dims * label_dims);
+
+        datapoint_idx_t num_indices;
+        in.read(num_indices);
+        in.require(num_indices, sizeof(datapoint_idx_t));
+        boost::shared_ptr<data_indices_vec> index_buffer(new data_indices_vec(num_indices));
+        in.read_array(index_buffer->data(), num_indices);
+
+        // Rebuild the links, keeping a stack of the nodes still waiting for a right child
+        std::vector<node_t *> awaiting_children;
+        datapoint_idx_t indices_begin = 0;
+        for (int64_t i = 0; i < num_nodes; i++) {
+            node_t * parent = NULL;
+            if (i > 0) {
+                if (awaiting_children.empty()) {
+                    throw std::invalid_argument("forest file is truncated or corrupt");
+                }
+                parent = awaiting_children.back();
+            }
+            boost::shared_ptr<node_t> node(new node_t(node_ids[i], parent, label_dims, depths[i]));
+            if (parent == NULL) {
+                root = node;
+            } else if (parent->left.get() == NULL) {
+                parent->left = node;
+            } else {
+                parent->right = node;
+                awaiting_children.pop_back();
+            }
+
+            node->is_leaf = (is_leaf[i] != 0);
+            node->split = splits[i];
+            node->dist.mean = Eigen::Map<const label_vec<LabT> >(&means[i * label_dims], label_dims);
+            node->dist.cov = Eigen::Map<const label_mtx<LabT> >(&covs[i * label_dims * label_dims], label_dims, label_dims);
+            node->indices_count = indices_counts[i];
+            node->bag_count = bag_counts[i];
+            if (has_indices[i]) {
+                if ((indices_counts[i] < 0) || (indices_counts[i] > (num_indices - indices_begin))) {
+                    throw std::invalid_argument("forest file is truncated or corrupt");
+                }
+                node->index_buffer = index_buffer;
+                node->indices_begin = indices_begin;
+                indices_begin += indices_counts[i];
+            }
+            if (!node->is_leaf) {
+                awaiting_children.push_back(node.get());
+            }
+        }
+        if (!awaiting_children.empty() || (indices_begin != num_indices)) {
+            throw std::invalid_argument("forest file is truncated or corrupt");
+        }
+
+        int64_t stored_in_bag_size;
+        in.read(stored_in_bag_size);
+        if (stored_in_bag_size < 0) {
+            throw std::invalid_argument("forest file is truncated or corrupt");
+        }
+        std::vector<uint8_t> in_bag_bits;
+        in.read_vector(&in_bag_bits, (stored_in_bag_size + 7) / 8);
+        clear_in_bag(stored_in_bag_size);
+        for (size_t b = 0; b < in_bag_bits.size(); b++) {
+            in_bag[b / 8] |= (static_cast<uint64_t>(in_bag_bits[b]) << (8 * (b % 8)));
+        }
+    }
+
     // Load & save a Multi dimensional Gaussian distribution
     template<typename T>
     template<class Archive>
@@ -181,6 +812,12 @@ namespace garf {
         ar & max_depth;
         ar & min_sample_count;
         ar & min_variance;
+        if (version >= 1) {
+            ar & growth;
+        }
+        if (version >= 2) {
+            ar & min_samples_for_subtree_task;
+        }
     }
 
     // Load & save forest options
@@ -188,6 +825,16 @@ namespace garf {
     void ForestOptions::serialize(Archive & ar, const unsigned int version) {
         ar & max_num_trees;
         ar & bagging;
+        if (version >= 1) {
+            ar & keep_training_indices;
+        }
+        if (version >= 2) {
+            ar & counted_bagging;
+        }
+        if (version >= 3) {
+            ar & bag_fraction;
+            ar & bag_with_replacement;
+        }
     }
 
     // Load & save SplitOptions
@@ -197,12 +844,36 @@ namespace garf {
         ar & threshes_per_split;
         ar & properly_random;
         ar & num_per_side_for_viable_split;
+        if (version >= 1) {
+            ar & split_search;
+            ar & num_histogram_bins;
+        }
+        if (version >= 2) {
+            ar & min_samples_for_parallel_split_search;
+        }
+        if (version >= 3) {
+            ar & feature_block_size;
+        }
     }
 
     // Load & save PredictOptions
     template<class Archive>
     void PredictOptions::serialize(Archive & ar, const unsigned int version) {
         ar & maximum_depth;
+        if (version >= 1) {
+            ar & rows_per_parallel_task;
+        }
+        if (version >= 2) {
+            ar & tree_major_block_size;
+        }
+        if (version >= 3) {
+            ar & max_simd_level;
+        }
+        if (version >= 4) {
+            ar & anytime_std_error_tolerance;
+            ar & anytime_min_trees;
+            ar & anytime_max_trees;
+        }
     }
 
 }
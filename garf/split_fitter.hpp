@@ -1,12 +1,16 @@
 #ifndef GARF_SPLIT_FITTER_HPP
 #define GARF_SPLIT_FITTER_HPP
 
+#include <algorithm>
 #include <random>
+#include <vector>
 
 #include "options.hpp"
 #include "splitter.hpp"
 #include "util/multi_dim_gaussian.hpp"
 #include "util/information_gain.hpp"
+#include "util/sufficient_stats.hpp"
+#include "util/feature_binning.hpp"
 
 namespace garf {
 
@@ -27,10 +31,15 @@ namespace garf {
         tbb::mutex & print_mutex;
 
         // Store all the different feature values for every single datapoint to land at the node.
-        // We made this total_datapoints x num_splits_to_try, which will only be fully used
+        // We made this total_datapoints x feature block size, which will only be fully used
         // at the root node, afterwards we only use however many topmost rows as we need.
+        // Column j holds candidate feature candidate_block_start + j.
         feature_mtx<FeatT> candidate_feature_values;
 
+        // Which candidate features are currently gathered into candidate_feature_values
+        split_idx_t candidate_block_start;
+        split_idx_t candidate_block_size;
+
         // Store the min and max values for each feature we are trying to generate data on
         feature_vec<FeatT> min_feature_values;
         feature_vec<FeatT> max_feature_values;
@@ -55,6 +64,40 @@ namespace garf {
         // it is initialised to size num_splits_to_try x threshes_per_split
         feature_mtx<FeatT> split_thresholds;
 
+        // Quantized training features, only needed for histogram split search. This is
+        // owned by the forest for the duration of training.
+        const util::FeatureBinning<FeatT> * feature_binning;
+
+        // With counted bagging, how many times each datapoint was drawn for the current tree,
+        // indexed by datapoint. NULL means every index counts once. Owned by the trainer.
+        const sample_count_vec * sample_counts;
+
+        // Label statistics of the whole node and of each side of the split, used by
+        // the split searches which sweep thresholds rather than refitting from scratch
+        util::SufficientStats<LabT> node_stats;
+        util::SufficientStats<LabT> left_stats;
+        util::SufficientStats<LabT> right_stats;
+
+        // Positions (within the node) of the datapoints, sorted by candidate feature value
+        std::vector<datapoint_idx_t> sorted_order;
+
+        // Scratch for growing a whole depth level of a tree at once. Only the nodes being split
+        // at the current level are given a slot, and the feature ranges have one row per slot.
+        feature_mtx<FeatT> level_min_values;
+        feature_mtx<FeatT> level_max_values;
+
+        // The rest are flat arrays, slot major, then candidate feature, then threshold, with each
+        // candidate feature's thresholds in increasing order. Label statistics are weighted sums
+        // of (label - node mean), so each datapoint only has to be added to the bin of the first
+        // threshold it is left of, and a running sum over the thresholds (finish_level_bins)
+        // gives everything left of each. With at least num_per_side_for_viable_split datapoints
+        // per node there are never more slots than datapoints, so this is O(n) like depth first.
+        std::vector<FeatT> level_thresholds;
+        std::vector<double> level_shifts;    // label_dims per slot
+        std::vector<double> level_counts;    // one per candidate
+        std::vector<double> level_sums;      // label_dims per candidate
+        std::vector<double> level_scatters;  // label_dims * label_dims per candidate
+        std::vector<double> level_delta;
 
 
         // Pick some thresholds for each candidate feature, with min and max values
@@ -69,7 +112,19 @@ namespace garf {
 
         bool is_admissible_split(eigen_idx_t num_going_left, eigen_idx_t num_going_right) const;
 
-        void evaluate_single_split(const data_indices_vec & data_indices,
+        // How many candidate features are gathered at once, see SplitOptions::feature_block_size
+        static inline split_idx_t candidate_block_capacity(const SplitOptions & opts) {
+            if ((opts.feature_block_size <= 0) || (opts.feature_block_size > opts.num_splits_to_try)) {
+                return opts.num_splits_to_try;
+            }
+            return opts.feature_block_size;
+        }
+
+        inline bool in_candidate_block(const split_idx_t split_idx) const {
+            return (split_idx >= candidate_block_start) && (split_idx < (candidate_block_start + candidate_block_size));
+        }
+
+        void evaluate_single_split(const data_indices_range & data_indices,
                                    const datapoint_idx_t num_in_parent,
                                    split_idx_t split_feature, FeatT thresh,
                                    split_dir_vec * candidate_split_directions,
@@ -78,6 +133,134 @@ namespace garf {
                                    datapoint_idx_t * const num_going_left,
                                    datapoint_idx_t * const num_going_right) const;
 
+        // Overwrite a node's range of the index buffer with the datapoints going left, followed
+        // by those going right, according to the last split evaluated into samples_going_left /
+        // samples_going_right. This is a stable partition done in the fitter's own scratch space.
+        inline void partition_indices(data_indices_range & data_indices) const {
+            data_indices.head(num_going_left) = samples_going_left.head(num_going_left);
+            data_indices.segment(num_going_left, num_going_right) = samples_going_right.head(num_going_right);
+        }
+
+        // Number of bagged draws a datapoint stands for
+        inline datapoint_idx_t sample_count(const datapoint_idx_t data_idx) const {
+            return (sample_counts == NULL) ? 1 : (*sample_counts)(data_idx);
+        }
+
+        // Total bagged draws for the first num_indices of some indices
+        template<typename IndicesT>
+        datapoint_idx_t total_sample_count(const IndicesT & indices, const datapoint_idx_t num_indices) const {
+            if (sample_counts == NULL) {
+                return num_indices;
+            }
+            datapoint_idx_t total = 0;
+            for (datapoint_idx_t i = 0; i < num_indices; i++) {
+                total += (*sample_counts)(indices(i));
+            }
+            return total;
+        }
+
+        // Fit a distribution to the labels of the first num_indices of some indices. Without
+        // counted bagging this is exactly MultiDimGaussianX::fit_params, otherwise each label
+        // is weighted by its count using the (caller provided) scratch statistics.
+        template<typename IndicesT>
+        void fit_dist(const label_mtx<LabT> & labels, const IndicesT & indices, const datapoint_idx_t num_indices,
+                      util::SufficientStats<LabT> * const scratch, util::MultiDimGaussianX<LabT> * const dist) const {
+            if (num_indices == 0) {
+                throw std::invalid_argument("num_input_datapoints cannot be zero");
+            }
+            if (sample_counts == NULL) {
+                dist->fit_params(labels, indices.head(num_indices));
+                return;
+            }
+            scratch->clear();
+            for (datapoint_idx_t i = 0; i < num_indices; i++) {
+                scratch->add(labels.row(indices(i)), (*sample_counts)(indices(i)));
+            }
+            scratch->to_gaussian(dist);
+        }
+
+        // Size and reset the level scratch for num_slots nodes being split
+        void prepare_level(const split_idx_t num_slots);
+
+        // Label statistics for a slot are kept relative to the node's mean, to keep them accurate
+        inline void set_level_shift(const split_idx_t slot, const Eigen::VectorXd & node_mean) {
+            std::copy(node_mean.data(), node_mean.data() + label_dims, &level_shifts[slot * label_dims]);
+        }
+
+        // Pick random thresholds in the range of values seen for each slot's candidate features,
+        // sorted within each candidate feature
+        void generate_level_thresholds(const split_idx_t num_slots);
+
+        inline FeatT level_threshold(const split_idx_t slot, const split_idx_t candidate_idx) const {
+            return level_thresholds[slot * split_opts.num_splits_to_try * split_opts.threshes_per_split + candidate_idx];
+        }
+
+        // Add a datapoint whose value of candidate feature split_idx is value to the bin of the
+        // first of that feature's thresholds which it is not above (if there is one)
+        template<typename VecT>
+        inline void add_to_level_bin(const split_idx_t slot, const split_idx_t split_idx, const FeatT value,
+                                     const VecT & label, const double weight) {
+            const split_idx_t threshes_per_split = split_opts.threshes_per_split;
+            const size_t first = (slot * split_opts.num_splits_to_try + split_idx) * threshes_per_split;
+            const FeatT * const threshes = &level_thresholds[first];
+            const split_idx_t t = std::lower_bound(threshes, threshes + threshes_per_split, value) - threshes;
+            if (t == threshes_per_split) {
+                return;
+            }
+
+            const size_t c = first + t;
+            const double * const shift = &level_shifts[slot * label_dims];
+            double * const sum = &level_sums[c * label_dims];
+            double * const scatter = &level_scatters[c * label_dims * label_dims];
+            level_counts[c] += weight;
+            for (label_idx_t d = 0; d < label_dims; d++) {
+                level_delta[d] = static_cast<double>(label(d)) - shift[d];
+                sum[d] += weight * level_delta[d];
+            }
+            for (label_idx_t d1 = 0; d1 < label_dims; d1++) {
+                for (label_idx_t d2 = 0; d2 < label_dims; d2++) {
+                    scatter[d1 * label_dims + d2] += weight * level_delta[d1] * level_delta[d2];
+                }
+            }
+        }
+
+        // Once every datapoint is in its bin, accumulate along each candidate feature's thresholds
+        // so each bin holds everything left of its threshold
+        void finish_level_bins(const split_idx_t num_slots);
+
+        // Statistics of the labels left of a candidate split at a slot, after finish_level_bins
+        void level_left_stats(const split_idx_t slot, const split_idx_t candidate_idx,
+                              util::SufficientStats<LabT> * const stats_out) const;
+
+        // Fill node_stats with the (weighted) labels of the node, before exact split search
+        void fit_node_stats(const label_mtx<LabT> & labels, const data_indices_range & data_indices,
+                            const datapoint_idx_t num_in_parent);
+
+        // Exact split search over the block of candidate feature values currently gathered.
+        // For each candidate feature sort the values, then sweep through every distinct
+        // threshold. Anything better than best_inf_gain is recorded (as which candidate
+        // feature and what threshold), and the return value is good_split_found.
+        bool find_best_exact_split(const label_mtx<LabT> & labels,
+                                   const data_indices_range & data_indices,
+                                   const datapoint_idx_t num_in_parent,
+                                   const util::MultiDimGaussianX<LabT> & parent_dist,
+                                   split_idx_t * const best_split_idx,
+                                   FeatT * const best_thresh);
+
+#ifdef GARF_PARALLELIZE_TBB
+        // Random threshold search over the block of candidate feature values currently gathered
+        // and their thresholds, with the candidates shared out between TBB workers. As with
+        // find_best_exact_split, only candidates beating best_inf_gain are recorded, and the
+        // same candidate as the serial loop in choose_split_parameters is picked (the first
+        // of any ties).
+        bool find_best_random_split_parallel(const label_mtx<LabT> & labels,
+                                             const data_indices_range & data_indices,
+                                             const datapoint_idx_t num_in_parent,
+                                             const util::MultiDimGaussianX<LabT> & parent_dist,
+                                             split_idx_t * const best_split_idx,
+                                             split_idx_t * const best_thresh_idx);
+#endif
+
 
         SplFitter(const SplitOptions & _split_opts,
                   datapoint_idx_t _total_num_datapoints,
@@ -92,7 +275,9 @@ namespace garf {
               left_child_dist(_label_dims),
               right_child_dist(_label_dims),
               print_mutex(_print_mutex),
-              candidate_feature_values(_total_num_datapoints, _split_opts.num_splits_to_try),
+              candidate_feature_values(_total_num_datapoints, candidate_block_capacity(_split_opts)),
+              candidate_block_start(0),
+              candidate_block_size(0),
               min_feature_values(_split_opts.num_splits_to_try),
               max_feature_values(_split_opts.num_splits_to_try),
               candidate_split_directions(_total_num_datapoints),
@@ -100,7 +285,16 @@ namespace garf {
               samples_going_right(_total_num_datapoints),
               num_going_left(-1),
               num_going_right(-1),
-              split_thresholds(_split_opts.num_splits_to_try, _split_opts.threshes_per_split) {
+              split_thresholds(_split_opts.num_splits_to_try, _split_opts.threshes_per_split),
+              feature_binning(NULL),
+              sample_counts(NULL),
+              node_stats(_label_dims),
+              left_stats(_label_dims),
+              right_stats(_label_dims) {
+            if (split_opts.split_search == SEARCH_EXACT) {
+                sorted_order.resize(_total_num_datapoints);
+            }
+
             // Seed the RNG
             if (split_opts.properly_random) {
                 if (seed_value == NULL) {
@@ -132,14 +326,37 @@ namespace garf {
         // Fill the feature_indices_to_evaluate vector with some new features
         void select_candidate_features();
 
-        // For each datapoint which lands in this node
+        // Candidate features for every open node in a level, num_slots x num_splits_to_try
+        feat_idx_mtx level_feature_indices;
+
+        // For each datapoint which lands in this node, gather candidate features
+        // [block_start, block_start + block_size) into candidate_feature_values
         void evaluate_datapoints_at_each_feature(const feature_mtx<FeatT> & features,
-                                                 const data_indices_vec & parent_data_indices,
-                                                 const datapoint_idx_t num_in_parent);
+                                                 const data_indices_range & parent_data_indices,
+                                                 const datapoint_idx_t num_in_parent,
+                                                 const split_idx_t block_start,
+                                                 const split_idx_t block_size);
 
         void set_parameters_in_splitter(const split_idx_t split_idx,
                                         const split_idx_t thresh_idx,
                                         AxisAlignedSplt<FeatT> * const split);
+        void set_parameters_in_splitter(const split_idx_t split_idx,
+                                        const FeatT thresh,
+                                        AxisAlignedSplt<FeatT> * const split);
+
+        // Label statistics for each bin of each candidate feature (num_splits_to_try x
+        // num_histogram_bins of them, feature major). Only allocated when doing histogram
+        // split search.
+        std::vector<util::SufficientStats<LabT> > bin_stats;
+
+        // Histogram split search - one pass over the data to fill bin_stats, then score
+        // every bin boundary of every candidate feature.
+        bool choose_split_parameters_histogram(const feature_mtx<FeatT> & features,
+                                               const label_mtx<LabT> & labels,
+                                               data_indices_range & parent_data_indices,
+                                               const util::MultiDimGaussianX<LabT> & parent_dist,
+                                               AxisAlignedSplt<FeatT> * split,
+                                               datapoint_idx_t * const num_going_left_out);
 
     public:
 
@@ -151,18 +368,31 @@ namespace garf {
                              std::seed_seq * seed_value)
             : SplFitter<FeatT, LabT>(_split_opts, _total_num_datapoints, _feature_dimensionality, _label_dims, _print_mutex, seed_value),
               feat_idx_dist(0, _feature_dimensionality-1),
-              feature_indices_to_evaluate(_split_opts.num_splits_to_try)
-              {};
+              feature_indices_to_evaluate(_split_opts.num_splits_to_try) {
+            if (_split_opts.split_search == SEARCH_HISTOGRAM) {
+                bin_stats.assign(_split_opts.num_splits_to_try * _split_opts.num_histogram_bins,
+                                 util::SufficientStats<LabT>(_label_dims));
+            }
+        };
 
         // This is the function we call that does everything. The return values indicates
         // whether a decent split has been found
         bool choose_split_parameters(const feature_mtx<FeatT> & features,
                                      const label_mtx<LabT> & labels,
-                                     const data_indices_vec & parent_data_indices,
+                                     data_indices_range & parent_data_indices,
                                      const util::MultiDimGaussianX<LabT> & parent_dist,
                                      AxisAlignedSplt<FeatT> * split,
-                                     data_indices_vec * left_child_indices_out,
-                                     data_indices_vec * right_child_indices_out);
+                                     datapoint_idx_t * const num_going_left_out);
+
+        // Used when growing a level at a time - pick candidate features for every open node,
+        // evaluate the candidates on a single datapoint, and store the winner into a splitter
+        void select_level_candidate_features(const split_idx_t num_slots);
+        inline FeatT level_candidate_value(const feature_mtx<FeatT> & features, const datapoint_idx_t data_idx,
+                                           const split_idx_t slot, const split_idx_t split_idx) const {
+            return features(data_idx, level_feature_indices(slot, split_idx));
+        }
+        void set_level_parameters_in_splitter(const split_idx_t slot, const split_idx_t split_idx,
+                                              const FeatT thresh, AxisAlignedSplt<FeatT> * const split) const;
     };
 
     template<typename FeatT, typename LabT>
@@ -182,16 +412,28 @@ namespace garf {
         weight_vec weights_1_to_evaluate;
         weight_vec weights_2_to_evaluate;
 
+        // As above, but for every open node in a level. num_slots x num_splits_to_try
+        feat_idx_mtx level_feat_indices_1;
+        feat_idx_mtx level_feat_indices_2;
+        weight_mtx level_weights_1;
+        weight_mtx level_weights_2;
+
         void select_candidate_features();
 
-        // For each datapoint which lands in this node
+        // For each datapoint which lands in this node, gather candidate features
+        // [block_start, block_start + block_size) into candidate_feature_values
         void evaluate_datapoints_at_each_feature(const feature_mtx<FeatT> & features,
-                                                 const data_indices_vec & parent_data_indices,
-                                                 const datapoint_idx_t num_in_parent);
+                                                 const data_indices_range & parent_data_indices,
+                                                 const datapoint_idx_t num_in_parent,
+                                                 const split_idx_t block_start,
+                                                 const split_idx_t block_size);
 
         void set_parameters_in_splitter(const split_idx_t split_idx,
                                         const split_idx_t thresh_idx,
                                         TwoDimSplt<FeatT> * const splitter);
+        void set_parameters_in_splitter(const split_idx_t split_idx,
+                                        const FeatT thresh,
+                                        TwoDimSplt<FeatT> * const splitter);
     public:
 
         TwoDimSplFitter(const SplitOptions & _split_opts,
@@ -206,16 +448,29 @@ namespace garf {
             feat_indices_1_to_evaluate(_split_opts.num_splits_to_try),
             feat_indices_2_to_evaluate(_split_opts.num_splits_to_try),
             weights_1_to_evaluate(_split_opts.num_splits_to_try),
-            weights_2_to_evaluate(_split_opts.num_splits_to_try)
-            {};
+            weights_2_to_evaluate(_split_opts.num_splits_to_try) {
+            // Projections onto random pairs of features can't be quantized in advance
+            if (_split_opts.split_search == SEARCH_HISTOGRAM) {
+                throw std::invalid_argument("histogram split search is only supported for axis aligned splits");
+            }
+        };
 
         bool choose_split_parameters(const feature_mtx<FeatT> & features,
                                      const label_mtx<LabT> & labels,
-                                     const data_indices_vec & parent_data_indices,
+                                     data_indices_range & parent_data_indices,
                                      const util::MultiDimGaussianX<LabT> & parent_dist,
                                      TwoDimSplt<FeatT> * split,
-                                     data_indices_vec * left_child_indices_out,
-                                     data_indices_vec * right_child_indices_out);
+                                     datapoint_idx_t * const num_going_left_out);
+
+        void select_level_candidate_features(const split_idx_t num_slots);
+        inline FeatT level_candidate_value(const feature_mtx<FeatT> & features, const datapoint_idx_t data_idx,
+                                           const split_idx_t slot, const split_idx_t split_idx) const {
+            double feat_val = level_weights_1(slot, split_idx) * features(data_idx, level_feat_indices_1(slot, split_idx));
+            feat_val += level_weights_2(slot, split_idx) * features(data_idx, level_feat_indices_2(slot, split_idx));
+            return feat_val;
+        }
+        void set_level_parameters_in_splitter(const split_idx_t slot, const split_idx_t split_idx,
+                                              const FeatT thresh, TwoDimSplt<FeatT> * const splitter) const;
     };
 }
 
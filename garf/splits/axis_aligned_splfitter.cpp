@@ -8,18 +8,43 @@ namespace garf {
         }        
     }
 
+    template<typename FeatT, typename LabT>
+    void AxisAlignedSplFitter<FeatT, LabT>::select_level_candidate_features(const split_idx_t num_slots) {
+        const feat_idx_t num_splits_to_try = this->split_opts.num_splits_to_try;
+        if (level_feature_indices.rows() < num_slots) {
+            level_feature_indices.resize(num_slots, num_splits_to_try);
+        }
+        for (split_idx_t slot = 0; slot < num_slots; slot++) {
+            for (feat_idx_t i = 0; i < num_splits_to_try; i++) {
+                level_feature_indices(slot, i) = feat_idx_dist(this->rng);
+            }
+        }
+    }
+
+    template<typename FeatT, typename LabT>
+    void AxisAlignedSplFitter<FeatT, LabT>::set_level_parameters_in_splitter(const split_idx_t slot,
+                                                                             const split_idx_t split_idx,
+                                                                             const FeatT thresh,
+                                                                             AxisAlignedSplt<FeatT> * const splitter) const {
+        splitter->feat_idx = level_feature_indices(slot, split_idx);
+        splitter->thresh = thresh;
+    }
+
     // Fill in the top most `num_in_parent` rows of the feature_values matrix with the selected
-    // features from our overall feature matrices
+    // features from our overall feature matrices, for one block of the candidate features
     template<typename FeatT, typename LabT>
     void AxisAlignedSplFitter<FeatT, LabT>::evaluate_datapoints_at_each_feature(const feature_mtx<FeatT> & features,
-                                                                                const data_indices_vec & parent_data_indices,
-                                                                                const datapoint_idx_t num_in_parent) {
-        const feat_idx_t num_splits_to_try = this->split_opts.num_splits_to_try;
+                                                                                const data_indices_range & parent_data_indices,
+                                                                                const datapoint_idx_t num_in_parent,
+                                                                                const split_idx_t block_start,
+                                                                                const split_idx_t block_size) {
+        this->candidate_block_start = block_start;
+        this->candidate_block_size = block_size;
 
         for (datapoint_idx_t data_idx = 0; data_idx < num_in_parent; data_idx++) {
-            for (feat_idx_t feat_idx = 0; feat_idx < num_splits_to_try; feat_idx++) {
+            for (feat_idx_t feat_idx = 0; feat_idx < block_size; feat_idx++) {
                 this->candidate_feature_values(data_idx, feat_idx) = features(parent_data_indices(data_idx),
-                                                                              feature_indices_to_evaluate(feat_idx));
+                                                                              feature_indices_to_evaluate(block_start + feat_idx));
             }
         }
     }
@@ -28,19 +53,30 @@ namespace garf {
     void AxisAlignedSplFitter<FeatT, LabT>::set_parameters_in_splitter(const split_idx_t split_idx,
                                                                        const split_idx_t thresh_idx,
                                                                        AxisAlignedSplt<FeatT> * const splitter) {
+        set_parameters_in_splitter(split_idx, this->split_thresholds(split_idx, thresh_idx), splitter);
+    }
+
+    template<typename FeatT, typename LabT>
+    void AxisAlignedSplFitter<FeatT, LabT>::set_parameters_in_splitter(const split_idx_t split_idx,
+                                                                       const FeatT thresh,
+                                                                       AxisAlignedSplt<FeatT> * const splitter) {
         splitter->feat_idx = this->feature_indices_to_evaluate(split_idx);
-        splitter->thresh = this->split_thresholds(split_idx, thresh_idx);
+        splitter->thresh = thresh;
     }
 
 
     template<typename FeatT, typename LabT>
     bool AxisAlignedSplFitter<FeatT, LabT>::choose_split_parameters(const feature_mtx<FeatT> & all_features,
                                                        const feature_mtx<LabT> & all_labels,
-                                                       const data_indices_vec & parent_data_indices,
+                                                       data_indices_range & parent_data_indices,
                                                        const util::MultiDimGaussianX<LabT> & parent_dist,
                                                        AxisAlignedSplt<FeatT> * const split,
-                                                       data_indices_vec * left_child_indices_out,
-                                                       data_indices_vec * right_child_indices_out) {
+                                                       datapoint_idx_t * const num_going_left_out) {
+        if (this->split_opts.split_search == SEARCH_HISTOGRAM) {
+            return choose_split_parameters_histogram(all_features, all_labels, parent_data_indices, parent_dist,
+                                                     split, num_going_left_out);
+        }
+
         const datapoint_idx_t num_in_parent = parent_data_indices.size();
         const SplitOptions & split_opts = this->split_opts;
 #ifdef VERBOSE
@@ -55,27 +91,11 @@ namespace garf {
             << " feat_indices = " << feature_indices_to_evaluate.transpose() << std::endl;
 #endif
 
-        evaluate_datapoints_at_each_feature(all_features, parent_data_indices, num_in_parent);
-#ifdef VERBOSE
-        std::cout << "feature values = " << candidate_feature_values.topRows(num_in_parent) << std::endl;
-        // std::cout << "full feature values = " << candidate_feature_values << std::endl;
-#endif
-
-        this->find_min_max_features(num_in_parent);
-#ifdef VERBOSE
-        std::cout << "min features: " << min_feature_values << std::endl;
-        std::cout << "max features: " << max_feature_values << std::endl;
-#endif
-
-        this->generate_split_thresholds();
-#ifdef VERBOSE
-        std::cout << "thresholds = " << std::endl << split_thresholds << std::endl;
-#endif
-
-        // this->check_split_thresholds();
-
-        // Store best information gain so far in here
+        // Store best information gain so far in here, and which candidate it came from
         this->best_inf_gain = -std::numeric_limits<LabT>::infinity();
+        split_idx_t best_split_idx = 0;
+        split_idx_t best_thresh_idx = 0;
+        FeatT best_thresh = 0;  // only for exact search, otherwise the threshold is picked by index
         this->good_split_found = false;
         // Create references to access parent class public variables. These normally require
         // the use of this-> because of some template bullshit - thanks C++
@@ -84,44 +104,66 @@ namespace garf {
 
         num_going_left = num_going_right = 0;
 
+        // Information gain is weighted by bagged draws, which are just the numbers of indices
+        // unless counted bagging is in use
+        const datapoint_idx_t parent_count = this->total_sample_count(parent_data_indices, num_in_parent);
+        datapoint_idx_t count_going_left = 0;
+        datapoint_idx_t count_going_right = 0;
+
         double inf_gain;
 
-        for (split_idx_t split_idx = 0; split_idx < split_opts.num_splits_to_try; split_idx++) {
-            for (split_idx_t thresh_idx = 0; thresh_idx < split_opts.threshes_per_split; thresh_idx++) {
-                this->evaluate_single_split(parent_data_indices, num_in_parent, split_idx, this->split_thresholds(split_idx, thresh_idx),
-                                            &this->candidate_split_directions, &this->samples_going_left, &this->samples_going_right,
-                                            &num_going_left, &num_going_right);
-#ifdef VERBOSE                
-                std::cout << "split #" << split_idx << " thresh #" << thresh_idx << " = " << split_thresholds(split_idx, thresh_idx);
-                std::cout << ", feature range is [" << min_feature_values(split_idx) << "," << max_feature_values(split_idx);
-                std::cout << "], candidate split directions = ";
-                for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
-                    if (this->candidate_split_directions(i) == LEFT) {
-                        std::cout << "L";
-                    } else {
-                        std::cout << "R";
-                    }
-                }
-                std::cout << " " << num_going_left << " going left: [" << samples_going_left.head(num_going_left).transpose() << "] : "
-                    << num_going_right << " going right: [" << samples_going_right.head(num_going_right).transpose() << "]" << std::endl;
+        const bool exact_search = (split_opts.split_search == SEARCH_EXACT);
+        if (exact_search) {
+            this->fit_node_stats(all_labels, parent_data_indices, num_in_parent);
+        }
+#ifdef GARF_PARALLELIZE_TBB
+        const bool parallel_search = (split_opts.min_samples_for_parallel_split_search > 0) &&
+            (num_in_parent >= split_opts.min_samples_for_parallel_split_search);
 #endif
-                if ((num_going_left == 0) || (num_going_right == 0)) {
-                    // this could just happen when we have only a few bits of data, combined with bagging this
-                    // happens reasonably often deep in the tree. If data is same / similar there could easily
-                    // be constant features where the min/max is the same, and therefore all the thresholds
-                    // will be the same. In this case the split values will all go left (just because
-                    // left is defined as <= the split) - this is not really something to worry about. I'm turning
-                    // off the printing because it interferes with concurrency.
-#ifdef VERBOSE                    
-                    std::cout << "feature values = " << this->candidate_feature_values.topRows(num_in_parent) << std::endl;
 
-                    for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
-                        std::cout << i << ":" << parent_data_indices(i) << ": "
-                            << all_features.row(parent_data_indices(i)) << std::endl;
-                    }
+        // Gather and score the candidate features a block at a time, only keeping the best split
+        // found so far, so scratch space is num_in_parent x block_capacity
+        const split_idx_t block_capacity = this->candidate_block_capacity(split_opts);
+        for (split_idx_t block_start = 0; block_start < split_opts.num_splits_to_try; block_start += block_capacity) {
+            evaluate_datapoints_at_each_feature(all_features, parent_data_indices, num_in_parent, block_start,
+                                                std::min(block_capacity, split_opts.num_splits_to_try - block_start));
+#ifdef VERBOSE
+            std::cout << "feature values = " << this->candidate_feature_values.topRows(num_in_parent) << std::endl;
+#endif
 
-                    std::cout << "split #" << split_idx << " thresh #" << thresh_idx << " = " << this->split_thresholds(split_idx, thresh_idx);
-                    std::cout << ", feature range is [" << this->min_feature_values(split_idx) << "," << this->max_feature_values(split_idx);
+            if (exact_search) {
+                this->find_best_exact_split(all_labels, parent_data_indices, num_in_parent, parent_dist,
+                                            &best_split_idx, &best_thresh);
+                continue;
+            }
+
+            this->find_min_max_features(num_in_parent);
+#ifdef VERBOSE
+            std::cout << "min features: " << this->min_feature_values.transpose() << std::endl;
+            std::cout << "max features: " << this->max_feature_values.transpose() << std::endl;
+#endif
+            this->generate_split_thresholds();
+#ifdef VERBOSE
+            std::cout << "thresholds = " << std::endl << this->split_thresholds << std::endl;
+#endif
+
+#ifdef GARF_PARALLELIZE_TBB
+            if (parallel_search) {
+                this->find_best_random_split_parallel(all_labels, parent_data_indices, num_in_parent, parent_dist,
+                                                      &best_split_idx, &best_thresh_idx);
+                continue;
+            }
+#endif
+
+            for (split_idx_t split_idx = this->candidate_block_start;
+                 split_idx < (this->candidate_block_start + this->candidate_block_size); split_idx++) {
+                for (split_idx_t thresh_idx = 0; thresh_idx < split_opts.threshes_per_split; thresh_idx++) {
+                    this->evaluate_single_split(parent_data_indices, num_in_parent, split_idx, this->split_thresholds(split_idx, thresh_idx),
+                                                &this->candidate_split_directions, &this->samples_going_left, &this->samples_going_right,
+                                                &num_going_left, &num_going_right);
+#ifdef VERBOSE                
+                    std::cout << "split #" << split_idx << " thresh #" << thresh_idx << " = " << split_thresholds(split_idx, thresh_idx);
+                    std::cout << ", feature range is [" << min_feature_values(split_idx) << "," << max_feature_values(split_idx);
                     std::cout << "], candidate split directions = ";
                     for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
                         if (this->candidate_split_directions(i) == LEFT) {
@@ -130,57 +172,209 @@ namespace garf {
                             std::cout << "R";
                         }
                     }
-                    std::cout << " " << num_going_left << " going left: [" << this->samples_going_left.head(num_going_left).transpose() << "] : "
-                        << num_going_right << " going right: [" << this->samples_going_right.head(num_going_right).transpose() << "]" << std::endl;
+                    std::cout << " " << num_going_left << " going left: [" << samples_going_left.head(num_going_left).transpose() << "] : "
+                        << num_going_right << " going right: [" << samples_going_right.head(num_going_right).transpose() << "]" << std::endl;
 #endif
+                    if ((num_going_left == 0) || (num_going_right == 0)) {
+                        // this could just happen when we have only a few bits of data, combined with bagging this
+                        // happens reasonably often deep in the tree. If data is same / similar there could easily
+                        // be constant features where the min/max is the same, and therefore all the thresholds
+                        // will be the same. In this case the split values will all go left (just because
+                        // left is defined as <= the split) - this is not really something to worry about. I'm turning
+                        // off the printing because it interferes with concurrency.
+#ifdef VERBOSE                    
+                        std::cout << "feature values = " << this->candidate_feature_values.topRows(num_in_parent) << std::endl;
 
-                    // we are here we can't do the gaussian fitting. Just indicate that this split sucks
-                    // with the minimum information gain.
-                    inf_gain = -std::numeric_limits<LabT>::infinity();
+                        for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
+                            std::cout << i << ":" << parent_data_indices(i) << ": "
+                                << all_features.row(parent_data_indices(i)) << std::endl;
+                        }
+
+                        std::cout << "split #" << split_idx << " thresh #" << thresh_idx << " = " << this->split_thresholds(split_idx, thresh_idx);
+                        std::cout << ", feature range is [" << this->min_feature_values(split_idx) << "," << this->max_feature_values(split_idx);
+                        std::cout << "], candidate split directions = ";
+                        for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
+                            if (this->candidate_split_directions(i) == LEFT) {
+                                std::cout << "L";
+                            } else {
+                                std::cout << "R";
+                            }
+                        }
+                        std::cout << " " << num_going_left << " going left: [" << this->samples_going_left.head(num_going_left).transpose() << "] : "
+                            << num_going_right << " going right: [" << this->samples_going_right.head(num_going_right).transpose() << "]" << std::endl;
+#endif
 
-                } else {
+                        // we are here we can't do the gaussian fitting. Just indicate that this split sucks
+                        // with the minimum information gain.
+                        inf_gain = -std::numeric_limits<LabT>::infinity();
 
-                    // We can only fit the gaussians if we have some amount of data on each side of the split
-                    // Now work out the information gain. First fit gaussians
-                    this->left_child_dist.fit_params(all_labels, this->samples_going_left, num_going_left);
-                    this->right_child_dist.fit_params(all_labels, this->samples_going_right, num_going_right);
+                    } else {
+
+                        // We can only fit the gaussians if we have some amount of data on each side of the split
+                        // Now work out the information gain. First fit gaussians
+                        this->fit_dist(all_labels, this->samples_going_left, num_going_left, &this->left_stats, &this->left_child_dist);
+                        this->fit_dist(all_labels, this->samples_going_right, num_going_right, &this->right_stats, &this->right_child_dist);
+                        count_going_left = this->total_sample_count(this->samples_going_left, num_going_left);
+                        count_going_right = parent_count - count_going_left;
 #ifdef VERBOSE
-                    std::cout << "P" << num_in_parent << parent_dist
-                        << " L" << num_going_left << this->left_child_dist
-                        << " R" << num_going_right << this->right_child_dist << " ";
+                        std::cout << "P" << num_in_parent << parent_dist
+                            << " L" << num_going_left << this->left_child_dist
+                            << " R" << num_going_right << this->right_child_dist << " ";
 #endif
 
-                    inf_gain = information_gain(parent_dist, this->left_child_dist, this->right_child_dist,
-                                                       num_in_parent, num_going_left, num_going_right);
+                        inf_gain = information_gain(parent_dist, this->left_child_dist, this->right_child_dist,
+                                                           parent_count, count_going_left, count_going_right);
 #ifdef VERBOSE
-                    std::cout << "igain: " << inf_gain << std::endl << std::endl;
+                        std::cout << "igain: " << inf_gain << std::endl << std::endl;
 #endif
-                }
+                    }
 
-                // If the split was rubbish (ie zero datapoints on one or the other side)
-                // then the inf_gain will be -inf and hopefully that should sort this out. I hope.
-                if ((inf_gain > this->best_inf_gain)
-                    && this->is_admissible_split(num_going_left, num_going_right)) {
+                    // If the split was rubbish (ie zero datapoints on one or the other side)
+                    // then the inf_gain will be -inf and hopefully that should sort this out. I hope.
+                    if ((inf_gain > this->best_inf_gain)
+                        && this->is_admissible_split(count_going_left, count_going_right)) {
                     
-                    // Record that we have found a decent split
+                        // Record that we have found a decent split
+                        this->good_split_found = true;
+                        this->best_inf_gain = inf_gain;
+
+                        // Store the parameters into the split node (which is actually part of the
+                        // prediction node).
+                        set_parameters_in_splitter(split_idx, thresh_idx, split);
+
+                        best_split_idx = split_idx;
+                        best_thresh_idx = thresh_idx;
+#ifdef VERBOSE
+                        std::cout << "found new best split: " << *split << " - "
+                            << num_going_left << "/" << num_going_right << std::endl;
+#endif
+                    }
+                }
+            }
+        }
+
+        if (!this->good_split_found) {
+            return false;
+        }
+        if (!exact_search) {
+            best_thresh = this->split_thresholds(best_split_idx, best_thresh_idx);
+        }
+        set_parameters_in_splitter(best_split_idx, best_thresh, split);
+
+        // The scratch buffers hold whichever candidate was evaluated last, maybe from a later block
+        // of candidate features, so redo the winner and partition the node's datapoints in place
+        // for the children
+        if (!this->in_candidate_block(best_split_idx)) {
+            evaluate_datapoints_at_each_feature(all_features, parent_data_indices, num_in_parent, best_split_idx, 1);
+        }
+        this->evaluate_single_split(parent_data_indices, num_in_parent, best_split_idx, best_thresh,
+                                    &this->candidate_split_directions, &this->samples_going_left, &this->samples_going_right,
+                                    &num_going_left, &num_going_right);
+        this->partition_indices(parent_data_indices);
+        *num_going_left_out = num_going_left;
+        return true;
+    }
+
+    template<typename FeatT, typename LabT>
+    bool AxisAlignedSplFitter<FeatT, LabT>::choose_split_parameters_histogram(const feature_mtx<FeatT> & all_features,
+                                                                              const label_mtx<LabT> & all_labels,
+                                                                              data_indices_range & parent_data_indices,
+                                                                              const util::MultiDimGaussianX<LabT> & parent_dist,
+                                                                              AxisAlignedSplt<FeatT> * const split,
+                                                                              datapoint_idx_t * const num_going_left_out) {
+        const util::FeatureBinning<FeatT> * const binning = this->feature_binning;
+        if (binning == NULL) {
+            throw std::logic_error("histogram split search requested but no feature binning provided");
+        }
+
+        const datapoint_idx_t num_in_parent = parent_data_indices.size();
+        const split_idx_t num_splits_to_try = this->split_opts.num_splits_to_try;
+        const split_idx_t max_bins = this->split_opts.num_histogram_bins;
+
+        select_candidate_features();
+
+        // Single pass over the data at this node, accumulating the labels into the
+        // bin that each datapoint falls into for every candidate feature.
+        for (typename std::vector<util::SufficientStats<LabT> >::iterator it = bin_stats.begin(); it != bin_stats.end(); it++) {
+            it->clear();
+        }
+        util::SufficientStats<LabT> & node_stats = this->node_stats;
+        util::SufficientStats<LabT> & left_stats = this->left_stats;
+        util::SufficientStats<LabT> & right_stats = this->right_stats;
+        node_stats.clear();
+        for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
+            const datapoint_idx_t data_idx = parent_data_indices(i);
+            for (split_idx_t split_idx = 0; split_idx < num_splits_to_try; split_idx++) {
+                bin_idx_t b = binning->bin(data_idx, feature_indices_to_evaluate(split_idx));
+                bin_stats[split_idx * max_bins + b].add(all_labels.row(data_idx), this->sample_count(data_idx));
+            }
+            node_stats.add(all_labels.row(data_idx), this->sample_count(data_idx));
+        }
+        const datapoint_idx_t parent_count = static_cast<datapoint_idx_t>(node_stats.count);
+
+        this->best_inf_gain = -std::numeric_limits<LabT>::infinity();
+        this->good_split_found = false;
+        split_idx_t best_split_idx = -1;
+        split_idx_t best_bin = -1;
+
+        // Sweep over the boundaries between bins, growing the left side one bin at a time. The
+        // right side is whatever is left over. Nothing here touches the data again.
+        for (split_idx_t split_idx = 0; split_idx < num_splits_to_try; split_idx++) {
+            const split_idx_t num_bins = binning->num_bins(feature_indices_to_evaluate(split_idx));
+            left_stats.clear();
+            for (split_idx_t b = 0; b < (num_bins - 1); b++) {
+                const util::SufficientStats<LabT> & this_bin = bin_stats[split_idx * max_bins + b];
+                if (this_bin.count == 0) {
+                    continue;  // same partition as the previous boundary
+                }
+                left_stats.add(this_bin);
+                right_stats.set_difference(node_stats, left_stats);
+
+                const datapoint_idx_t num_going_left = static_cast<datapoint_idx_t>(left_stats.count);
+                const datapoint_idx_t num_going_right = static_cast<datapoint_idx_t>(right_stats.count);
+                if ((num_going_right == 0) || !this->is_admissible_split(num_going_left, num_going_right)) {
+                    continue;
+                }
+
+                left_stats.to_gaussian(&this->left_child_dist);
+                right_stats.to_gaussian(&this->right_child_dist);
+                double inf_gain = information_gain(parent_dist, this->left_child_dist, this->right_child_dist,
+                                                   parent_count, num_going_left, num_going_right);
+                if (inf_gain > this->best_inf_gain) {
                     this->good_split_found = true;
                     this->best_inf_gain = inf_gain;
+                    best_split_idx = split_idx;
+                    best_bin = b;
+                }
+            }
+        }
 
-                    // Store the parameters into the split node (which is actually part of the
-                    // prediction node).
-                    set_parameters_in_splitter(split_idx, thresh_idx, split);
+        if (!this->good_split_found) {
+            return false;
+        }
 
-                    // Send the output data (ie which data goes left / right) to node::train()
-                    *left_child_indices_out = this->samples_going_left.head(num_going_left);
-                    *right_child_indices_out = this->samples_going_right.head(num_going_right);
+        const feat_idx_t best_feat_idx = feature_indices_to_evaluate(best_split_idx);
+        split->feat_idx = best_feat_idx;
+        split->thresh = binning->upper_edge(best_feat_idx, best_bin);
 #ifdef VERBOSE
-                    std::cout << "found new best split: " << *split << " - "
-                        << num_going_left << "/" << num_going_right << std::endl;
+        std::cout << "histogram search found best split: " << *split << " igain " << this->best_inf_gain << std::endl;
 #endif
-                }
+
+        // Work out which data goes where for the winning boundary
+        datapoint_idx_t & num_going_left = this->num_going_left;
+        datapoint_idx_t & num_going_right = this->num_going_right;
+        num_going_left = num_going_right = 0;
+        for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
+            const datapoint_idx_t data_idx = parent_data_indices(i);
+            if (binning->bin(data_idx, best_feat_idx) <= best_bin) {
+                this->samples_going_left(num_going_left++) = data_idx;
+            } else {
+                this->samples_going_right(num_going_right++) = data_idx;
             }
         }
+        this->partition_indices(parent_data_indices);
+        *num_going_left_out = num_going_left;
 
-        return this->good_split_found;
+        return true;
     }
 }
\ No newline at end of file
@@ -11,10 +11,11 @@ namespace garf {
 
     template<typename FeatT, typename LabT>
     void SplFitter<FeatT, LabT>::generate_split_thresholds() {
-        const feat_idx_t num_splits_to_try = split_opts.num_splits_to_try;
         const split_idx_t threshes_per_split = split_opts.threshes_per_split;
 
-        for (feat_idx_t feat_idx = 0; feat_idx < num_splits_to_try; feat_idx++) {
+        // Only for the current block of candidates. The blocks are visited in order, so the
+        // thresholds drawn are the same whatever the block size is.
+        for (feat_idx_t feat_idx = candidate_block_start; feat_idx < (candidate_block_start + candidate_block_size); feat_idx++) {
             std::uniform_real_distribution<FeatT> thresh_dist(min_feature_values(feat_idx), max_feature_values(feat_idx));
 
             for (split_idx_t split_idx = 0; split_idx < threshes_per_split; split_idx++) {
@@ -24,6 +25,87 @@ namespace garf {
     }
 
 
+    template<typename FeatT, typename LabT>
+    void SplFitter<FeatT, LabT>::prepare_level(const split_idx_t num_slots) {
+        const split_idx_t num_splits_to_try = split_opts.num_splits_to_try;
+        const split_idx_t num_candidates = num_splits_to_try * split_opts.threshes_per_split;
+
+        if (level_min_values.rows() < num_slots) {
+            level_min_values.resize(num_slots, num_splits_to_try);
+            level_max_values.resize(num_slots, num_splits_to_try);
+        }
+        level_min_values.topRows(num_slots).setConstant(std::numeric_limits<FeatT>::max());
+        level_max_values.topRows(num_slots).setConstant(std::numeric_limits<FeatT>::lowest());
+
+        // assign() only reallocates when a level needs more than any before it
+        const size_t num_stats = static_cast<size_t>(num_slots) * num_candidates;
+        level_thresholds.resize(num_stats);
+        level_shifts.resize(static_cast<size_t>(num_slots) * label_dims);
+        level_counts.assign(num_stats, 0);
+        level_sums.assign(num_stats * label_dims, 0);
+        level_scatters.assign(num_stats * label_dims * label_dims, 0);
+        level_delta.resize(label_dims);
+    }
+
+    template<typename FeatT, typename LabT>
+    void SplFitter<FeatT, LabT>::finish_level_bins(const split_idx_t num_slots) {
+        const split_idx_t threshes_per_split = split_opts.threshes_per_split;
+        const size_t num_features = static_cast<size_t>(num_slots) * split_opts.num_splits_to_try;
+        const size_t scatter_size = label_dims * label_dims;
+
+        for (size_t f = 0; f < num_features; f++) {
+            for (size_t c = f * threshes_per_split + 1; c < (f + 1) * threshes_per_split; c++) {
+                level_counts[c] += level_counts[c - 1];
+                for (size_t d = 0; d < static_cast<size_t>(label_dims); d++) {
+                    level_sums[c * label_dims + d] += level_sums[(c - 1) * label_dims + d];
+                }
+                for (size_t d = 0; d < scatter_size; d++) {
+                    level_scatters[c * scatter_size + d] += level_scatters[(c - 1) * scatter_size + d];
+                }
+            }
+        }
+    }
+
+    template<typename FeatT, typename LabT>
+    void SplFitter<FeatT, LabT>::level_left_stats(const split_idx_t slot, const split_idx_t candidate_idx,
+                                                  util::SufficientStats<LabT> * const stats_out) const {
+        const size_t c = slot * split_opts.num_splits_to_try * split_opts.threshes_per_split + candidate_idx;
+        const double count = level_counts[c];
+        const double * const shift = &level_shifts[slot * label_dims];
+        const double * const sum = &level_sums[c * label_dims];
+        const double * const scatter = &level_scatters[c * label_dims * label_dims];
+
+        // Shifting back to the mean of just these labels
+        stats_out->count = count;
+        for (label_idx_t d = 0; d < label_dims; d++) {
+            stats_out->mean(d) = shift[d] + ((count > 0) ? (sum[d] / count) : 0);
+        }
+        for (label_idx_t d1 = 0; d1 < label_dims; d1++) {
+            for (label_idx_t d2 = 0; d2 < label_dims; d2++) {
+                stats_out->scatter(d1, d2) = scatter[d1 * label_dims + d2] -
+                    ((count > 0) ? (sum[d1] * sum[d2] / count) : 0);
+            }
+        }
+    }
+
+    template<typename FeatT, typename LabT>
+    void SplFitter<FeatT, LabT>::generate_level_thresholds(const split_idx_t num_slots) {
+        const split_idx_t num_splits_to_try = split_opts.num_splits_to_try;
+        const split_idx_t threshes_per_split = split_opts.threshes_per_split;
+
+        for (split_idx_t slot = 0; slot < num_slots; slot++) {
+            for (split_idx_t split_idx = 0; split_idx < num_splits_to_try; split_idx++) {
+                std::uniform_real_distribution<FeatT> thresh_dist(level_min_values(slot, split_idx),
+                                                                  level_max_values(slot, split_idx));
+                FeatT * const threshes = &level_thresholds[(slot * num_splits_to_try + split_idx) * threshes_per_split];
+                for (split_idx_t thresh_idx = 0; thresh_idx < threshes_per_split; thresh_idx++) {
+                    threshes[thresh_idx] = thresh_dist(rng);
+                }
+                std::sort(threshes, threshes + threshes_per_split);
+            }
+        }
+    }
+
     template<typename FeatT, typename LabT>
     void SplFitter<FeatT, LabT>::check_split_thresholds() {
         const feat_idx_t num_splits_to_try = split_opts.num_splits_to_try;
@@ -47,12 +129,14 @@ namespace garf {
     void SplFitter<FeatT, LabT>::find_min_max_features(const datapoint_idx_t num_in_parent) {
         // The feature_values matrix is almost certainly bigger than we need, so only look at the top rows
         // when working out the min and max
-        min_feature_values = candidate_feature_values.topRows(num_in_parent).colwise().minCoeff();
-        max_feature_values = candidate_feature_values.topRows(num_in_parent).colwise().maxCoeff();
+        min_feature_values.segment(candidate_block_start, candidate_block_size) =
+            candidate_feature_values.topLeftCorner(num_in_parent, candidate_block_size).colwise().minCoeff().transpose();
+        max_feature_values.segment(candidate_block_start, candidate_block_size) =
+            candidate_feature_values.topLeftCorner(num_in_parent, candidate_block_size).colwise().maxCoeff().transpose();
     }
 
     template<typename FeatT, typename LabT>
-    void SplFitter<FeatT, LabT>::evaluate_single_split(const data_indices_vec & data_indices,
+    void SplFitter<FeatT, LabT>::evaluate_single_split(const data_indices_range & data_indices,
                                                                   const datapoint_idx_t num_in_parent,
                                                                   split_idx_t split_feature, FeatT thresh,
                                                                   split_dir_vec * candidate_split_directions,
@@ -63,9 +147,10 @@ namespace garf {
         // Keep track of places to 
         datapoint_idx_t left_idx = 0;
         datapoint_idx_t right_idx = 0;
+        const split_idx_t column = split_feature - candidate_block_start;
 
         for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
-            if (this->candidate_feature_values(i, split_feature) <= thresh) {
+            if (this->candidate_feature_values(i, column) <= thresh) {
                 candidate_split_directions->coeffRef(i) = LEFT;
                 indices_going_left->coeffRef(left_idx) = data_indices(i);
                 left_idx++;
@@ -79,5 +164,195 @@ namespace garf {
         *num_going_right = right_idx;
     }
 
+    // Orders positions within a node by the value in one column of the candidate features
+    template<typename FeatT>
+    class candidate_value_order {
+        const feature_mtx<FeatT> & candidate_feature_values;
+        const split_idx_t column;
+    public:
+        candidate_value_order(const feature_mtx<FeatT> & _candidate_feature_values, split_idx_t _column)
+            : candidate_feature_values(_candidate_feature_values), column(_column) {}
+        inline bool operator() (datapoint_idx_t a, datapoint_idx_t b) const {
+            return candidate_feature_values(a, column) < candidate_feature_values(b, column);
+        }
+    };
+
+    template<typename FeatT, typename LabT>
+    void SplFitter<FeatT, LabT>::fit_node_stats(const label_mtx<LabT> & labels,
+                                                const data_indices_range & data_indices,
+                                                const datapoint_idx_t num_in_parent) {
+        node_stats.clear();
+        for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
+            node_stats.add(labels.row(data_indices(i)), sample_count(data_indices(i)));
+        }
+    }
+
+    template<typename FeatT, typename LabT>
+    bool SplFitter<FeatT, LabT>::find_best_exact_split(const label_mtx<LabT> & labels,
+                                                       const data_indices_range & data_indices,
+                                                       const datapoint_idx_t num_in_parent,
+                                                       const util::MultiDimGaussianX<LabT> & parent_dist,
+                                                       split_idx_t * const best_split_idx,
+                                                       FeatT * const best_thresh) {
+        const datapoint_idx_t parent_count = static_cast<datapoint_idx_t>(node_stats.count);
+
+        for (split_idx_t column = 0; column < candidate_block_size; column++) {
+            const split_idx_t split_idx = candidate_block_start + column;
+
+            // Sort this feature's values, then move datapoints from the right side
+            // to the left side one at a time in increasing order of value.
+            for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
+                sorted_order[i] = i;
+            }
+            std::sort(sorted_order.begin(), sorted_order.begin() + num_in_parent,
+                      candidate_value_order<FeatT>(candidate_feature_values, column));
+
+            left_stats.clear();
+            for (datapoint_idx_t k = 0; k < (num_in_parent - 1); k++) {
+                const FeatT this_value = candidate_feature_values(sorted_order[k], column);
+                const FeatT next_value = candidate_feature_values(sorted_order[k + 1], column);
+                const datapoint_idx_t data_idx = data_indices(sorted_order[k]);
+                left_stats.add(labels.row(data_idx), sample_count(data_idx));
+
+                // Can only put a threshold between distinct values
+                if (!(this_value < next_value)) {
+                    continue;
+                }
+                const datapoint_idx_t num_going_left = static_cast<datapoint_idx_t>(left_stats.count);
+                const datapoint_idx_t num_going_right = parent_count - num_going_left;
+                if (!is_admissible_split(num_going_left, num_going_right)) {
+                    continue;
+                }
+
+                right_stats.set_difference(node_stats, left_stats);
+                left_stats.to_gaussian(&left_child_dist);
+                right_stats.to_gaussian(&right_child_dist);
+                double inf_gain = information_gain(parent_dist, left_child_dist, right_child_dist,
+                                                   parent_count, num_going_left, num_going_right);
+                if (inf_gain > best_inf_gain) {
+                    good_split_found = true;
+                    best_inf_gain = inf_gain;
+                    *best_split_idx = split_idx;
+
+                    // Put the threshold halfway between the two values, unless they are
+                    // so close together that the midpoint rounds onto the upper one
+                    FeatT midpoint = this_value + (next_value - this_value) / 2;
+                    *best_thresh = (midpoint < next_value) ? midpoint : this_value;
+                }
+            }
+        }
+        return good_split_found;
+    }
+
+#ifdef GARF_PARALLELIZE_TBB
+    // Body for parallel_reduce over the flattened (candidate feature, threshold) index. Each
+    // copy has its own direction / index buffers and child distributions, and everything else
+    // it reads from the fitter is left untouched during the reduction.
+    template<typename FeatT, typename LabT>
+    class parallel_split_scorer {
+        const SplFitter<FeatT, LabT> & fitter;
+        const label_mtx<LabT> & labels;
+        const data_indices_range & data_indices;
+        const datapoint_idx_t num_in_parent;
+        const util::MultiDimGaussianX<LabT> & parent_dist;
+        const datapoint_idx_t parent_count;
+
+        split_dir_vec split_directions;
+        data_indices_vec going_left;
+        data_indices_vec going_right;
+        util::MultiDimGaussianX<LabT> left_dist;
+        util::MultiDimGaussianX<LabT> right_dist;
+        util::SufficientStats<LabT> scratch_stats;
+    public:
+        LabT best_inf_gain;
+        int64_t best_candidate;  // -1 until something admissible is found
+
+        void operator() (const blocked_range<split_idx_t> & r) {
+            const split_idx_t threshes_per_split = fitter.split_opts.threshes_per_split;
+            datapoint_idx_t num_going_left, num_going_right;
 
-}
\ No newline at end of file
+            for (split_idx_t c = r.begin(); c != r.end(); c++) {
+                const split_idx_t split_idx = c / threshes_per_split;
+                const split_idx_t thresh_idx = c % threshes_per_split;
+                fitter.evaluate_single_split(data_indices, num_in_parent, split_idx,
+                                             fitter.split_thresholds(split_idx, thresh_idx),
+                                             &split_directions, &going_left, &going_right,
+                                             &num_going_left, &num_going_right);
+                if ((num_going_left == 0) || (num_going_right == 0)) {
+                    continue;
+                }
+                const datapoint_idx_t count_going_left = fitter.total_sample_count(going_left, num_going_left);
+                const datapoint_idx_t count_going_right = parent_count - count_going_left;
+                if (!fitter.is_admissible_split(count_going_left, count_going_right)) {
+                    continue;
+                }
+
+                fitter.fit_dist(labels, going_left, num_going_left, &scratch_stats, &left_dist);
+                fitter.fit_dist(labels, going_right, num_going_right, &scratch_stats, &right_dist);
+                double inf_gain = information_gain(parent_dist, left_dist, right_dist,
+                                                   parent_count, count_going_left, count_going_right);
+                if (inf_gain > best_inf_gain) {
+                    best_inf_gain = inf_gain;
+                    best_candidate = c;
+                }
+            }
+        }
+
+        // Ranges are joined in order, but be explicit about ties so the serial answer wins
+        void join(const parallel_split_scorer<FeatT, LabT> & other) {
+            if (other.best_candidate < 0) {
+                return;
+            }
+            if ((best_candidate < 0) || (other.best_inf_gain > best_inf_gain) ||
+                ((other.best_inf_gain == best_inf_gain) && (other.best_candidate < best_candidate))) {
+                best_inf_gain = other.best_inf_gain;
+                best_candidate = other.best_candidate;
+            }
+        }
+
+        parallel_split_scorer(const SplFitter<FeatT, LabT> & _fitter,
+                              const label_mtx<LabT> & _labels,
+                              const data_indices_range & _data_indices,
+                              const datapoint_idx_t _num_in_parent,
+                              const util::MultiDimGaussianX<LabT> & _parent_dist)
+            : fitter(_fitter), labels(_labels), data_indices(_data_indices), num_in_parent(_num_in_parent),
+              parent_dist(_parent_dist), parent_count(_fitter.total_sample_count(_data_indices, _num_in_parent)),
+              split_directions(_num_in_parent), going_left(_num_in_parent),
+              going_right(_num_in_parent), left_dist(_fitter.label_dims), right_dist(_fitter.label_dims),
+              scratch_stats(_fitter.label_dims), best_inf_gain(-std::numeric_limits<LabT>::infinity()), best_candidate(-1) {
+        }
+
+        parallel_split_scorer(parallel_split_scorer<FeatT, LabT> & other, tbb::split)
+            : fitter(other.fitter), labels(other.labels), data_indices(other.data_indices),
+              num_in_parent(other.num_in_parent), parent_dist(other.parent_dist), parent_count(other.parent_count),
+              split_directions(other.num_in_parent), going_left(other.num_in_parent),
+              going_right(other.num_in_parent), left_dist(other.fitter.label_dims),
+              right_dist(other.fitter.label_dims), scratch_stats(other.fitter.label_dims),
+              best_inf_gain(-std::numeric_limits<LabT>::infinity()), best_candidate(-1) {
+        }
+    };
+
+    template<typename FeatT, typename LabT>
+    bool SplFitter<FeatT, LabT>::find_best_random_split_parallel(const label_mtx<LabT> & labels,
+                                                                  const data_indices_range & data_indices,
+                                                                  const datapoint_idx_t num_in_parent,
+                                                                  const util::MultiDimGaussianX<LabT> & parent_dist,
+                                                                  split_idx_t * const best_split_idx,
+                                                                  split_idx_t * const best_thresh_idx) {
+        const split_idx_t threshes_per_split = split_opts.threshes_per_split;
+        parallel_split_scorer<FeatT, LabT> scorer(*this, labels, data_indices, num_in_parent, parent_dist);
+        parallel_reduce(blocked_range<split_idx_t>(candidate_block_start * threshes_per_split,
+                                                   (candidate_block_start + candidate_block_size) * threshes_per_split, 1),
+                        scorer);
+
+        // Earlier blocks win ties, as in the serial search
+        if ((scorer.best_candidate >= 0) && (scorer.best_inf_gain > best_inf_gain)) {
+            good_split_found = true;
+            best_inf_gain = scorer.best_inf_gain;
+            *best_split_idx = scorer.best_candidate / threshes_per_split;
+            *best_thresh_idx = scorer.best_candidate % threshes_per_split;
+        }
+        return good_split_found;
+    }
+#endif
+}
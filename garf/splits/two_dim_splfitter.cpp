@@ -15,16 +15,51 @@ namespace garf {
         }        
     }
 
+    template<typename FeatT, typename LabT>
+    void TwoDimSplFitter<FeatT, LabT>::select_level_candidate_features(const split_idx_t num_slots) {
+        const feat_idx_t num_splits_to_try = this->split_opts.num_splits_to_try;
+        if (level_feat_indices_1.rows() < num_slots) {
+            level_feat_indices_1.resize(num_slots, num_splits_to_try);
+            level_feat_indices_2.resize(num_slots, num_splits_to_try);
+            level_weights_1.resize(num_slots, num_splits_to_try);
+            level_weights_2.resize(num_slots, num_splits_to_try);
+        }
+        for (split_idx_t slot = 0; slot < num_slots; slot++) {
+            for (feat_idx_t i = 0; i < num_splits_to_try; i++) {
+                level_feat_indices_1(slot, i) = feat_idx_dist(this->rng);
+                level_feat_indices_2(slot, i) = feat_idx_dist(this->rng);
+                level_weights_1(slot, i) = weight_dist(this->rng);
+                level_weights_2(slot, i) = weight_dist(this->rng);
+            }
+        }
+    }
+
+    template<typename FeatT, typename LabT>
+    void TwoDimSplFitter<FeatT, LabT>::set_level_parameters_in_splitter(const split_idx_t slot,
+                                                                        const split_idx_t split_idx,
+                                                                        const FeatT thresh,
+                                                                        TwoDimSplt<FeatT> * const splitter) const {
+        splitter->feat_1 = level_feat_indices_1(slot, split_idx);
+        splitter->feat_2 = level_feat_indices_2(slot, split_idx);
+        splitter->weight_feat_1 = level_weights_1(slot, split_idx);
+        splitter->weight_feat_2 = level_weights_2(slot, split_idx);
+        splitter->thresh = thresh;
+    }
+
     template<typename FeatT, typename LabT>
     void TwoDimSplFitter<FeatT, LabT>::evaluate_datapoints_at_each_feature(const feature_mtx<FeatT> & features,
-                                             const data_indices_vec & parent_data_indices,
-                                             const datapoint_idx_t num_in_parent) {
+                                             const data_indices_range & parent_data_indices,
+                                             const datapoint_idx_t num_in_parent,
+                                             const split_idx_t block_start,
+                                             const split_idx_t block_size) {
 
-        const feat_idx_t num_splits_to_try = this->split_opts.num_splits_to_try;
+        this->candidate_block_start = block_start;
+        this->candidate_block_size = block_size;
 
         for (datapoint_idx_t d_id = 0; d_id < num_in_parent; d_id++) {
-            for (feat_idx_t f_id = 0; f_id < num_splits_to_try; f_id++) {
+            for (feat_idx_t block_id = 0; block_id < block_size; block_id++) {
                 datapoint_idx_t this_datapoint = parent_data_indices(d_id);
+                feat_idx_t f_id = block_start + block_id;
 
                 // get the two elements out of the relevant row of the feature vector, then multiply by
                 // the individual weights
@@ -32,7 +67,7 @@ namespace garf {
                 feat_val += weights_2_to_evaluate(f_id) * features(this_datapoint, feat_indices_2_to_evaluate(f_id));
 
                 // Store in the matrix so we can threshold it, etc.
-                this->candidate_feature_values(d_id, f_id) = feat_val;
+                this->candidate_feature_values(d_id, block_id) = feat_val;
             }
         }
     }
@@ -52,26 +87,36 @@ namespace garf {
         splitter->thresh = this->split_thresholds(split_idx, thresh_idx);
     }
 
+    template<typename FeatT, typename LabT>
+    void TwoDimSplFitter<FeatT, LabT>::set_parameters_in_splitter(const split_idx_t split_idx,
+                                                                  const FeatT thresh,
+                                                                  TwoDimSplt<FeatT> * const splitter) {
+        splitter->feat_1 = this->feat_indices_1_to_evaluate(split_idx);
+        splitter->feat_2 = this->feat_indices_2_to_evaluate(split_idx);
+
+        splitter->weight_feat_1 = this->weights_1_to_evaluate(split_idx);
+        splitter->weight_feat_2 = this->weights_2_to_evaluate(split_idx);
+
+        splitter->thresh = thresh;
+    }
+
     template<typename FeatT, typename LabT>
     bool TwoDimSplFitter<FeatT, LabT>::choose_split_parameters(const feature_mtx<FeatT> & all_features,
                                                        const feature_mtx<LabT> & all_labels,
-                                                       const data_indices_vec & parent_data_indices,
+                                                       data_indices_range & parent_data_indices,
                                                        const util::MultiDimGaussianX<LabT> & parent_dist,
                                                        TwoDimSplt<FeatT> * const split,
-                                                       data_indices_vec * left_child_indices_out,
-                                                       data_indices_vec * right_child_indices_out) {
+                                                       datapoint_idx_t * const num_going_left_out) {
         const datapoint_idx_t num_in_parent = parent_data_indices.size();
         const SplitOptions & split_opts = this->split_opts;
 
         select_candidate_features();
-        evaluate_datapoints_at_each_feature(all_features, parent_data_indices, num_in_parent);
-        this->find_min_max_features(num_in_parent);
-        this->generate_split_thresholds();
-
-        // this->check_split_thresholds();
 
-        // Store best information gain so far in here
+        // Store best information gain so far in here, and which candidate it came from
         this->best_inf_gain = -std::numeric_limits<LabT>::infinity();
+        split_idx_t best_split_idx = 0;
+        split_idx_t best_thresh_idx = 0;
+        FeatT best_thresh = 0;  // only for exact search, otherwise the threshold is picked by index
         this->good_split_found = false;
         // Create references to access parent class public variables. These normally require
         // the use of this-> because of some template bullshit - thanks C++
@@ -80,64 +125,125 @@ namespace garf {
 
         num_going_left = num_going_right = 0;
 
-        for (split_idx_t split_idx = 0; split_idx < split_opts.num_splits_to_try; split_idx++) {
-            for (split_idx_t thresh_idx = 0; thresh_idx < split_opts.threshes_per_split; thresh_idx++) {
-                this->evaluate_single_split(parent_data_indices, num_in_parent, split_idx, this->split_thresholds(split_idx, thresh_idx),
-                                            &this->candidate_split_directions, &this->samples_going_left, &this->samples_going_right,
-                                            &num_going_left, &num_going_right);
+        // Information gain is weighted by bagged draws, which are just the numbers of indices
+        // unless counted bagging is in use
+        const datapoint_idx_t parent_count = this->total_sample_count(parent_data_indices, num_in_parent);
+        datapoint_idx_t count_going_left = 0;
+        datapoint_idx_t count_going_right = 0;
+
+        const bool exact_search = (split_opts.split_search == SEARCH_EXACT);
+        if (exact_search) {
+            this->fit_node_stats(all_labels, parent_data_indices, num_in_parent);
+        }
+#ifdef GARF_PARALLELIZE_TBB
+        const bool parallel_search = (split_opts.min_samples_for_parallel_split_search > 0) &&
+            (num_in_parent >= split_opts.min_samples_for_parallel_split_search);
+#endif
+
+        // Gather and score the candidate features a block at a time, only keeping the best split
+        // found so far, so scratch space is num_in_parent x block_capacity
+        const split_idx_t block_capacity = this->candidate_block_capacity(split_opts);
+        for (split_idx_t block_start = 0; block_start < split_opts.num_splits_to_try; block_start += block_capacity) {
+            evaluate_datapoints_at_each_feature(all_features, parent_data_indices, num_in_parent, block_start,
+                                                std::min(block_capacity, split_opts.num_splits_to_try - block_start));
+
+            if (exact_search) {
+                this->find_best_exact_split(all_labels, parent_data_indices, num_in_parent, parent_dist,
+                                            &best_split_idx, &best_thresh);
+                continue;
+            }
+
+            this->find_min_max_features(num_in_parent);
+            this->generate_split_thresholds();
 
-                if ((num_going_left == 0) || (num_going_right == 0)) {
+#ifdef GARF_PARALLELIZE_TBB
+            if (parallel_search) {
+                this->find_best_random_split_parallel(all_labels, parent_data_indices, num_in_parent, parent_dist,
+                                                      &best_split_idx, &best_thresh_idx);
+                continue;
+            }
+#endif
 
-                    std::cout << "feature values = " << this->candidate_feature_values.topRows(num_in_parent) << std::endl;
+            for (split_idx_t split_idx = this->candidate_block_start;
+                 split_idx < (this->candidate_block_start + this->candidate_block_size); split_idx++) {
+                for (split_idx_t thresh_idx = 0; thresh_idx < split_opts.threshes_per_split; thresh_idx++) {
+                    this->evaluate_single_split(parent_data_indices, num_in_parent, split_idx, this->split_thresholds(split_idx, thresh_idx),
+                                                &this->candidate_split_directions, &this->samples_going_left, &this->samples_going_right,
+                                                &num_going_left, &num_going_right);
 
-                    for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
-                        std::cout << i << ":" << parent_data_indices(i) << ": "
-                            << all_features.row(parent_data_indices(i)) << std::endl;
-                    }
+                    if ((num_going_left == 0) || (num_going_right == 0)) {
 
+                        std::cout << "feature values = " << this->candidate_feature_values.topRows(num_in_parent) << std::endl;
 
-                    // this is a bit weird - figure out why it happened
-                    std::cout << "split #" << split_idx << " thresh #" << thresh_idx << " = " << this->split_thresholds(split_idx, thresh_idx);
-                    std::cout << ", feature range is [" << this->min_feature_values(split_idx) << "," << this->max_feature_values(split_idx);
-                    std::cout << "], candidate split directions = ";
-                    for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
-                        if (this->candidate_split_directions(i) == LEFT) {
-                            std::cout << "L";
-                        } else {
-                            std::cout << "R";
+                        for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
+                            std::cout << i << ":" << parent_data_indices(i) << ": "
+                                << all_features.row(parent_data_indices(i)) << std::endl;
                         }
-                    }
-                    std::cout << " " << num_going_left << " going left: [" << this->samples_going_left.head(num_going_left).transpose() << "] : "
-                        << num_going_right << " going right: [" << this->samples_going_right.head(num_going_right).transpose() << "]" << std::endl;
 
-                }
 
-                // Now work out the information gain. First fit gaussians
-                this->left_child_dist.fit_params(all_labels, this->samples_going_left, num_going_left);
-                this->right_child_dist.fit_params(all_labels, this->samples_going_right, num_going_right);
+                        // this is a bit weird - figure out why it happened
+                        std::cout << "split #" << split_idx << " thresh #" << thresh_idx << " = " << this->split_thresholds(split_idx, thresh_idx);
+                        std::cout << ", feature range is [" << this->min_feature_values(split_idx) << "," << this->max_feature_values(split_idx);
+                        std::cout << "], candidate split directions = ";
+                        for (datapoint_idx_t i = 0; i < num_in_parent; i++) {
+                            if (this->candidate_split_directions(i) == LEFT) {
+                                std::cout << "L";
+                            } else {
+                                std::cout << "R";
+                            }
+                        }
+                        std::cout << " " << num_going_left << " going left: [" << this->samples_going_left.head(num_going_left).transpose() << "] : "
+                            << num_going_right << " going right: [" << this->samples_going_right.head(num_going_right).transpose() << "]" << std::endl;
+
+                    }
+
+                    // Now work out the information gain. First fit gaussians
+                    this->fit_dist(all_labels, this->samples_going_left, num_going_left, &this->left_stats, &this->left_child_dist);
+                    this->fit_dist(all_labels, this->samples_going_right, num_going_right, &this->right_stats, &this->right_child_dist);
+                    count_going_left = this->total_sample_count(this->samples_going_left, num_going_left);
+                    count_going_right = parent_count - count_going_left;
 
-                double inf_gain = information_gain(parent_dist, this->left_child_dist, this->right_child_dist,
-                                                   num_in_parent, num_going_left, num_going_right);
+                    double inf_gain = information_gain(parent_dist, this->left_child_dist, this->right_child_dist,
+                                                       parent_count, count_going_left, count_going_right);
 
-                if ((inf_gain > this->best_inf_gain)
-                    && this->is_admissible_split(num_going_left, num_going_right)) {
+                    if ((inf_gain > this->best_inf_gain)
+                        && this->is_admissible_split(count_going_left, count_going_right)) {
                     
-                    // Record that we have found a decent split
-                    this->good_split_found = true;
-                    this->best_inf_gain = inf_gain;
+                        // Record that we have found a decent split
+                        this->good_split_found = true;
+                        this->best_inf_gain = inf_gain;
 
-                    // Store the parameters into the split node (which is actually part of the
-                    // prediction node).
-                    set_parameters_in_splitter(split_idx, thresh_idx, split);
+                        // Store the parameters into the split node (which is actually part of the
+                        // prediction node).
+                        set_parameters_in_splitter(split_idx, thresh_idx, split);
 
-                    // Send the output data (ie which data goes left / right) to node::train()
-                    *left_child_indices_out = this->samples_going_left.head(num_going_left);
-                    *right_child_indices_out = this->samples_going_right.head(num_going_right);
+                        best_split_idx = split_idx;
+                        best_thresh_idx = thresh_idx;
+                    }
                 }
             }
         }
 
-        return this->good_split_found;
+        if (!this->good_split_found) {
+            return false;
+        }
+        if (!exact_search) {
+            best_thresh = this->split_thresholds(best_split_idx, best_thresh_idx);
+        }
+        set_parameters_in_splitter(best_split_idx, best_thresh, split);
+
+        // The scratch buffers hold whichever candidate was evaluated last, maybe from a later block
+        // of candidate features, so redo the winner and partition the node's datapoints in place
+        // for the children
+        if (!this->in_candidate_block(best_split_idx)) {
+            evaluate_datapoints_at_each_feature(all_features, parent_data_indices, num_in_parent, best_split_idx, 1);
+        }
+        this->evaluate_single_split(parent_data_indices, num_in_parent, best_split_idx, best_thresh,
+                                    &this->candidate_split_directions, &this->samples_going_left, &this->samples_going_right,
+                                    &num_going_left, &num_going_right);
+        this->partition_indices(parent_data_indices);
+        *num_going_left_out = num_going_left;
+        return true;
     }
 
 }
\ No newline at end of file
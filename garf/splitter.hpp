@@ -28,7 +28,9 @@ namespace garf {
     public:
         feat_idx_t feat_idx;
         FeatT thresh;
-        inline split_dir_t evaluate(const feature_vec<FeatT> & fvec) const {
+        // fvec can be any Eigen vector of FeatT, eg a feature_vec or a Map over a raw array
+        template<class FeatVecT>
+        inline split_dir_t evaluate(const FeatVecT & fvec) const {
             if (fvec(feat_idx) <= thresh) {
                 return LEFT;
             }
@@ -60,7 +62,8 @@ namespace garf {
         weight_t weight_feat_1;
         weight_t weight_feat_2;
         FeatT thresh;
-        inline split_dir_t evaluate(const feature_vec<FeatT> & fvec) const {
+        template<class FeatVecT>
+        inline split_dir_t evaluate(const FeatVecT & fvec) const {
             double test_val = (fvec(feat_1) * weight_feat_1) + 
                               (fvec(feat_2) * weight_feat_2);
             if (test_val <= thresh) {
@@ -30,11 +30,24 @@ namespace garf {
     typedef eigen_idx_t data_dim_idx_t;
     typedef eigen_idx_t datapoint_idx_t;
     typedef eigen_idx_t split_idx_t;
+    typedef uint32_t sample_count_t;
     typedef double importance_t;
     typedef double error_t;
     typedef double weight_t;
     typedef enum { LEFT=0, RIGHT=1 } split_dir_t;
 
+    // How the split fitters look for a threshold once they have some candidate features
+    typedef enum { SEARCH_RANDOM_THRESHOLDS=0, SEARCH_HISTOGRAM=1, SEARCH_EXACT=2 } split_search_t;
+
+    // Whether trees are grown recursively node by node, or a whole depth level at a time
+    typedef enum { GROW_DEPTH_FIRST=0, GROW_LEVEL_WISE=1 } tree_growth_t;
+
+    // Vector instruction sets which compiled forests can use to send several rows through a tree at once
+    typedef enum { SIMD_NONE=0, SIMD_AVX2=1, SIMD_AVX512=2 } simd_level_t;
+
+    // Features are quantized into at most 256 bins when doing histogram split search
+    typedef uint8_t bin_idx_t;
+
     typedef std::mt19937_64 RngSource;
 
     // This will only compile with C++ 11. Sorry folks. There is lots of redundancy here, but
@@ -47,18 +60,29 @@ namespace garf {
     template <typename T> using variance_vec = Eigen::Matrix<T, Eigen::Dynamic, 1>;
 
     typedef Eigen::Matrix<datapoint_idx_t, Eigen::Dynamic, 1> data_indices_vec;
+    // A node's datapoints are a contiguous range of its tree's index buffer
+    typedef Eigen::VectorBlock<data_indices_vec> data_indices_range;
+    typedef Eigen::VectorBlock<const data_indices_vec> const_data_indices_range;
     typedef Eigen::Matrix<datapoint_idx_t, Eigen::Dynamic, Eigen::Dynamic> data_indices_mtx;
 
     typedef Eigen::Matrix<node_idx_t, Eigen::Dynamic, Eigen::Dynamic> tree_idx_mtx;
+    // How many trees were used for each datapoint, see RegressionForest::predict_anytime
+    typedef Eigen::Matrix<tree_idx_t, Eigen::Dynamic, 1> tree_count_vec;
     typedef Eigen::Matrix<feat_idx_t, Eigen::Dynamic, 1> feat_idx_vec;
+    typedef Eigen::Matrix<feat_idx_t, Eigen::Dynamic, Eigen::Dynamic> feat_idx_mtx;
     typedef Eigen::Matrix<split_dir_t, Eigen::Dynamic, 1> split_dir_vec;
     typedef Eigen::Matrix<bool, Eigen::Dynamic, 1> bool_vec;
+    // How many times each datapoint was drawn when bagging with counts
+    typedef Eigen::Matrix<sample_count_t, Eigen::Dynamic, 1> sample_count_vec;
 
     typedef Eigen::Matrix<importance_t, Eigen::Dynamic, 1> importance_vec;
     typedef Eigen::Matrix<error_t, Eigen::Dynamic, 1> error_vec;
     typedef Eigen::Matrix<error_t, Eigen::Dynamic, Eigen::Dynamic> error_mtx;
 
     typedef Eigen::Matrix<weight_t, Eigen::Dynamic, 1> weight_vec;
+    typedef Eigen::Matrix<weight_t, Eigen::Dynamic, Eigen::Dynamic> weight_mtx;
+
+    typedef Eigen::Matrix<bin_idx_t, Eigen::Dynamic, Eigen::Dynamic> bin_idx_mtx;
 }
 
 #endif
\ No newline at end of file
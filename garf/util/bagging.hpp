@@ -0,0 +1,97 @@
+#ifndef GARF_UTIL_BAGGING_HPP
+#define GARF_UTIL_BAGGING_HPP
+
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+#include "../types.hpp"
+#include "../options.hpp"
+
+namespace garf { namespace util {
+
+    // Draw num_draws datapoints from [0, num_datapoints) with replacement, the same as normal
+    // bagging, but rather than listing repeats give each drawn datapoint once (in increasing
+    // order) and record how many times it was drawn. counts_out is indexed by datapoint and
+    // is zero for anything out of bag.
+    template<typename RngT>
+    void counted_bootstrap(const datapoint_idx_t num_datapoints, const datapoint_idx_t num_draws, RngT * const rng,
+                           data_indices_vec * const indices_out, sample_count_vec * const counts_out) {
+        std::uniform_int_distribution<datapoint_idx_t> bagging_index_picker(0, num_datapoints - 1);
+
+        counts_out->setZero(num_datapoints);
+        datapoint_idx_t num_unique = 0;
+        for (datapoint_idx_t d = 0; d < num_draws; d++) {
+            sample_count_t & count = (*counts_out)(bagging_index_picker(*rng));
+            if (count == 0) {
+                num_unique++;
+            }
+            count++;
+        }
+
+        indices_out->resize(num_unique);
+        datapoint_idx_t next = 0;
+        for (datapoint_idx_t d = 0; d < num_datapoints; d++) {
+            if ((*counts_out)(d) > 0) {
+                (*indices_out)(next++) = d;
+            }
+        }
+    }
+
+    // Draw num_draws distinct datapoints from [0, num_datapoints), returned in increasing order.
+    // Selection sampling (Knuth's Algorithm S), so this is a single pass with no scratch space.
+    template<typename RngT>
+    void sample_without_replacement(const datapoint_idx_t num_datapoints, const datapoint_idx_t num_draws,
+                                    RngT * const rng, data_indices_vec * const indices_out) {
+        std::uniform_real_distribution<double> unif(0.0, 1.0);
+
+        indices_out->resize(num_draws);
+        datapoint_idx_t num_chosen = 0;
+        for (datapoint_idx_t d = 0; (d < num_datapoints) && (num_chosen < num_draws); d++) {
+            if (((num_datapoints - d) * unif(*rng)) < (num_draws - num_chosen)) {
+                (*indices_out)(num_chosen++) = d;
+            }
+        }
+    }
+
+    // How many datapoints each tree gets, according to bag_fraction. Always at least one.
+    inline datapoint_idx_t bag_size(const ForestOptions & forest_opts, const datapoint_idx_t num_datapoints) {
+        if (!forest_opts.bagging) {
+            return num_datapoints;
+        }
+        if (!(forest_opts.bag_fraction > 0.0) || (forest_opts.bag_fraction > 1.0)) {
+            throw std::invalid_argument("bag_fraction must be in (0, 1]");
+        }
+        datapoint_idx_t size = static_cast<datapoint_idx_t>(std::floor(forest_opts.bag_fraction * num_datapoints + 0.5));
+        return (size < 1) ? 1 : size;
+    }
+
+    // Pick the training indices for a single tree according to the forest options. Returns true
+    // if counts_out was filled in (counted bagging), in which case the tree should be trained with
+    // those sample counts. Without replacement every datapoint appears at most once, so there is
+    // never anything to count.
+    template<typename RngT>
+    bool draw_bag(const ForestOptions & forest_opts, const datapoint_idx_t num_datapoints, RngT * const rng,
+                  data_indices_vec * const indices_out, sample_count_vec * const counts_out) {
+        const datapoint_idx_t num_draws = bag_size(forest_opts, num_datapoints);
+        if (!forest_opts.bagging) {
+            // gives us a vector [0, 1, 2, 3, ... num_data_points-1]
+            indices_out->setLinSpaced(num_datapoints, 0, num_datapoints - 1);
+        } else if (!forest_opts.bag_with_replacement) {
+            sample_without_replacement(num_datapoints, num_draws, rng, indices_out);
+        } else if (forest_opts.counted_bagging) {
+            counted_bootstrap(num_datapoints, num_draws, rng, indices_out, counts_out);
+            return true;
+        } else {
+            // Sample indices from the full dataset WITH REPLACEMENT!!!
+            std::uniform_int_distribution<datapoint_idx_t> bagging_index_picker(0, num_datapoints - 1);
+            indices_out->resize(num_draws);
+            for (datapoint_idx_t d = 0; d < num_draws; d++) {
+                (*indices_out)(d) = bagging_index_picker(*rng);
+            }
+        }
+        return false;
+    }
+}}
+
+#endif
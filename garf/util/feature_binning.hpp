@@ -0,0 +1,88 @@
+#ifndef GARF_UTIL_FEATURE_BINNING_HPP
+#define GARF_UTIL_FEATURE_BINNING_HPP
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "../types.hpp"
+
+namespace garf { namespace util {
+
+    // Quantizes every feature of a training set into a small number of bins, done once
+    // per forest for histogram split search. Bin edges are placed at quantiles of each
+    // feature, and each edge is the largest value in its bin, so that for any value x
+    //     bin(x) <= b   <=>   x <= upper_edge(f, b)
+    // which means a split at a bin boundary can be stored as an ordinary threshold.
+    template<typename FeatT>
+    class FeatureBinning {
+    public:
+        const feat_idx_t num_features;
+        const split_idx_t max_bins;
+
+        // num_datapoints x num_features, same layout as the feature matrix
+        bin_idx_mtx binned_features;
+
+        // Upper (inclusive) edge of each bin, for each feature. Features with few distinct
+        // values may use fewer than max_bins bins.
+        std::vector<std::vector<FeatT> > upper_edges;
+
+        FeatureBinning(const feature_mtx<FeatT> & features, split_idx_t _max_bins)
+            : num_features(features.cols()), max_bins(_max_bins),
+              binned_features(features.rows(), features.cols()), upper_edges(features.cols()) {
+            if ((max_bins < 2) || (max_bins > 256)) {
+                throw std::invalid_argument("num_histogram_bins must be between 2 and 256");
+            }
+
+            const datapoint_idx_t num_datapoints = features.rows();
+            std::vector<FeatT> sorted_values(num_datapoints);
+
+            for (feat_idx_t f = 0; f < num_features; f++) {
+                for (datapoint_idx_t i = 0; i < num_datapoints; i++) {
+                    sorted_values[i] = features(i, f);
+                }
+                std::sort(sorted_values.begin(), sorted_values.end());
+
+                // Edges are taken at evenly spaced ranks, and duplicates (from heavily repeated
+                // values) removed. The final edge is always the maximum value.
+                std::vector<FeatT> & edges = upper_edges[f];
+                edges.clear();
+                for (split_idx_t b = 1; b <= max_bins; b++) {
+                    datapoint_idx_t rank = (b * num_datapoints) / max_bins - 1;
+                    if (rank < 0) {
+                        continue;
+                    }
+                    FeatT edge = sorted_values[rank];
+                    if (edges.empty() || (edge > edges.back())) {
+                        edges.push_back(edge);
+                    }
+                }
+
+                for (datapoint_idx_t i = 0; i < num_datapoints; i++) {
+                    binned_features(i, f) = bin_of_value(f, features(i, f));
+                }
+            }
+        }
+
+        inline split_idx_t num_bins(feat_idx_t f) const { return upper_edges[f].size(); }
+
+        inline bin_idx_t bin(datapoint_idx_t data_idx, feat_idx_t f) const {
+            return binned_features(data_idx, f);
+        }
+
+        inline FeatT upper_edge(feat_idx_t f, split_idx_t b) const { return upper_edges[f][b]; }
+
+        // The first bin whose upper edge is >= the value. Anything above the maximum value
+        // seen in training goes in the last bin.
+        inline bin_idx_t bin_of_value(feat_idx_t f, FeatT value) const {
+            const std::vector<FeatT> & edges = upper_edges[f];
+            typename std::vector<FeatT>::const_iterator it = std::lower_bound(edges.begin(), edges.end(), value);
+            if (it == edges.end()) {
+                return static_cast<bin_idx_t>(edges.size() - 1);
+            }
+            return static_cast<bin_idx_t>(it - edges.begin());
+        }
+    };
+}}
+
+#endif
@@ -107,8 +107,10 @@ namespace garf { namespace util {
         }
 
         // As above, but allows us to also pass a vector of indices indicating only
-        //   certain rows of the data matrix should be considered 
-        inline void fit_params(const mtx<T> & input_data, const data_indices_vec & valid_indices) {
+        //   certain rows of the data matrix should be considered. The indices can be any
+        //   vector expression, eg a node's range of a tree's index buffer.
+        template<typename IndicesT>
+        inline void fit_params(const mtx<T> & input_data, const Eigen::MatrixBase<IndicesT> & valid_indices) {
             check_data_dimensionality(input_data);
             eigen_idx_t num_input_datapoints = valid_indices.size();
 
@@ -214,8 +216,8 @@ namespace garf { namespace util {
             cov /= (num_input_datapoints - 1);
         }
 
-        template<typename T1>
-        friend std::ostream& operator<< (std::ostream& stream, const MultiDimGaussianX<T1>& mdg) {
+        // Not a template itself, or every instantiation of the class would define the same function
+        friend std::ostream& operator<< (std::ostream& stream, const MultiDimGaussianX<T>& mdg) {
             stream << "[mean[" << mdg.mean.transpose() << "]:cov[";
             for (eigen_idx_t r = 0; r < mdg.dimensions; r++) {
                 stream << mdg.cov.row(r);
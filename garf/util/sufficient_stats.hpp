@@ -0,0 +1,121 @@
+#ifndef GARF_UTIL_SUFFICIENT_STATS_HPP
+#define GARF_UTIL_SUFFICIENT_STATS_HPP
+
+#include <Eigen/Core>
+
+#include "../types.hpp"
+#include "multi_dim_gaussian.hpp"
+
+namespace garf { namespace util {
+
+    // Running count / mean / scatter matrix for a set of label vectors. This lets us build up
+    // (and combine, and take apart) the label distribution of a set of datapoints without
+    // going back over the data, which is what the histogram split search needs. Everything
+    // is accumulated in double precision regardless of the label type.
+    template<typename T>
+    class SufficientStats {
+    public:
+        const eigen_idx_t dimensions;
+        double count;
+        Eigen::VectorXd mean;
+        Eigen::MatrixXd scatter;
+
+        inline SufficientStats(eigen_idx_t _dimensions)
+            : dimensions(_dimensions), count(0), mean(_dimensions), scatter(_dimensions, _dimensions),
+              delta(_dimensions), other_delta(_dimensions) {
+            clear();
+        }
+
+        inline SufficientStats(const SufficientStats<T> & other)
+            : dimensions(other.dimensions), count(other.count), mean(other.mean), scatter(other.scatter),
+              delta(other.dimensions), other_delta(other.dimensions) {}
+
+        inline SufficientStats<T> & operator=(const SufficientStats<T> & other) {
+            if (other.dimensions != dimensions) {
+                throw std::invalid_argument("SufficientStats dimensions don't match");
+            }
+            count = other.count;
+            mean = other.mean;
+            scatter = other.scatter;
+            return *this;
+        }
+
+        inline void clear() {
+            count = 0;
+            mean.setZero();
+            scatter.setZero();
+        }
+
+        // Add a single label vector (any row / column expression will do). Weighted version
+        // of the recurrence in MultiDimGaussianX::fit_params, see West 1979.
+        template<typename VecT>
+        inline void add(const VecT & x, double weight = 1.0) {
+            double new_count = count + weight;
+            for (eigen_idx_t d = 0; d < dimensions; d++) {
+                delta(d) = static_cast<double>(x(d)) - mean(d);
+            }
+            mean += (weight / new_count) * delta;
+            scatter.noalias() += ((weight * count) / new_count) * delta * delta.transpose();
+            count = new_count;
+        }
+
+        // Exact inverse of add()
+        template<typename VecT>
+        inline void remove(const VecT & x, double weight = 1.0) {
+            double new_count = count - weight;
+            if (new_count <= 0) {
+                clear();
+                return;
+            }
+            for (eigen_idx_t d = 0; d < dimensions; d++) {
+                delta(d) = static_cast<double>(x(d)) - mean(d);
+            }
+            mean -= (weight / new_count) * delta;
+            scatter.noalias() -= ((weight * count) / new_count) * delta * delta.transpose();
+            count = new_count;
+        }
+
+        // Combine with the statistics of some other (disjoint) set of labels. Chan et al's
+        // pairwise update, see http://i.stanford.edu/pub/cstr/reports/cs/tr/79/773/CS-TR-79-773.pdf
+        inline void add(const SufficientStats<T> & other) {
+            if (other.count == 0) {
+                return;
+            }
+            double new_count = count + other.count;
+            delta = other.mean - mean;
+            mean += (other.count / new_count) * delta;
+            scatter += other.scatter;
+            scatter.noalias() += ((count * other.count) / new_count) * delta * delta.transpose();
+            count = new_count;
+        }
+
+        // Set this to be the statistics of everything in total which is not in part,
+        // where part must be a subset of total. Inverse of the pairwise add above.
+        inline void set_difference(const SufficientStats<T> & total, const SufficientStats<T> & part) {
+            count = total.count - part.count;
+            if (count <= 0) {
+                clear();
+                return;
+            }
+            mean = (total.count * total.mean - part.count * part.mean) / count;
+            other_delta = part.mean - mean;
+            scatter = total.scatter - part.scatter;
+            scatter.noalias() -= ((count * part.count) / total.count) * other_delta * other_delta.transpose();
+        }
+
+        // Fill in a gaussian. Note that like MultiDimGaussianX::fit_params(data, indices), the
+        // covariance is left as the unnormalised scatter matrix, so information gains calculated
+        // from these match those computed by fitting directly to the data.
+        inline void to_gaussian(MultiDimGaussianX<T> * const dist) const {
+            dist->mean = mean.cast<T>();
+            dist->cov = scatter.cast<T>();
+        }
+
+    private:
+        // Scratch space so that add() / remove() don't allocate
+        Eigen::VectorXd delta;
+        Eigen::VectorXd other_delta;
+    };
+}}
+
+#endif
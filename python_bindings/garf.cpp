@@ -18,6 +18,8 @@ using namespace boost::python;
 
 #include "garf/options.hpp"
 #include "garf/regression_forest.hpp"
+#include "garf/codegen.hpp"
+#include "garf/mapped_forest.hpp"
 
 using namespace garf;
 
@@ -28,19 +30,49 @@ BOOST_PYTHON_MODULE(_garf) {
 
     class_<ForestOptions>("ForestOptions")
         .def_readwrite("max_num_trees", &ForestOptions::max_num_trees)
-        .def_readwrite("bagging", &ForestOptions::bagging);
+        .def_readwrite("bagging", &ForestOptions::bagging)
+        .def_readwrite("keep_training_indices", &ForestOptions::keep_training_indices)
+        .def_readwrite("counted_bagging", &ForestOptions::counted_bagging)
+        .def_readwrite("bag_fraction", &ForestOptions::bag_fraction)
+        .def_readwrite("bag_with_replacement", &ForestOptions::bag_with_replacement);
+
+    enum_<tree_growth_t>("TreeGrowth")
+        .value("depth_first", GROW_DEPTH_FIRST)
+        .value("level_wise", GROW_LEVEL_WISE);
 
     class_<TreeOptions>("TreeOptions")
         .def_readwrite("max_depth", &TreeOptions::max_depth)
         .def_readwrite("min_sample_count", &TreeOptions::min_sample_count)
-        .def_readwrite("min_variance", &TreeOptions::min_variance);
+        .def_readwrite("min_variance", &TreeOptions::min_variance)
+        .def_readwrite("growth", &TreeOptions::growth)
+        .def_readwrite("min_samples_for_subtree_task", &TreeOptions::min_samples_for_subtree_task);
+
+    enum_<split_search_t>("SplitSearch")
+        .value("random_thresholds", SEARCH_RANDOM_THRESHOLDS)
+        .value("histogram", SEARCH_HISTOGRAM)
+        .value("exact", SEARCH_EXACT);
 
     class_<SplitOptions>("SplitOptions")
         .def_readwrite("num_splits_to_try", &SplitOptions::num_splits_to_try)
-        .def_readwrite("threshes_per_split", &SplitOptions::threshes_per_split);
+        .def_readwrite("threshes_per_split", &SplitOptions::threshes_per_split)
+        .def_readwrite("split_search", &SplitOptions::split_search)
+        .def_readwrite("num_histogram_bins", &SplitOptions::num_histogram_bins)
+        .def_readwrite("min_samples_for_parallel_split_search", &SplitOptions::min_samples_for_parallel_split_search)
+        .def_readwrite("feature_block_size", &SplitOptions::feature_block_size);
+
+    enum_<simd_level_t>("SimdLevel")
+        .value("none", SIMD_NONE)
+        .value("avx2", SIMD_AVX2)
+        .value("avx512", SIMD_AVX512);
 
     class_<PredictOptions>("PredictOptions")
-        .def_readwrite("maximum_depth", &PredictOptions::maximum_depth);
+        .def_readwrite("maximum_depth", &PredictOptions::maximum_depth)
+        .def_readwrite("rows_per_parallel_task", &PredictOptions::rows_per_parallel_task)
+        .def_readwrite("tree_major_block_size", &PredictOptions::tree_major_block_size)
+        .def_readwrite("max_simd_level", &PredictOptions::max_simd_level)
+        .def_readwrite("anytime_std_error_tolerance", &PredictOptions::anytime_std_error_tolerance)
+        .def_readwrite("anytime_min_trees", &PredictOptions::anytime_min_trees)
+        .def_readwrite("anytime_max_trees", &PredictOptions::anytime_max_trees);
 
     class_<ForestStats>("ForestStats")
         .def_readonly("data_dimensions", &ForestStats::data_dimensions)
@@ -48,6 +80,21 @@ BOOST_PYTHON_MODULE(_garf) {
         .def_readonly("num_training_datapoints", &ForestStats::num_training_datapoints)
         .def_readonly("num_trees", &ForestStats::num_trees);
 
+    // What peek_forest_header finds out about a saved forest, without loading it
+    class_<ForestFileInfo>("ForestFileInfo")
+        .def_readonly("format_version", &ForestFileInfo::format_version)
+        .def_readonly("feature_type", &ForestFileInfo::feature_type)
+        .def_readonly("label_type", &ForestFileInfo::label_type)
+        .def_readonly("split_type", &ForestFileInfo::split_type)
+        .def_readonly("trained", &ForestFileInfo::trained)
+        .def_readonly("stats", &ForestFileInfo::stats)
+        .def_readonly("forest_options", &ForestFileInfo::forest_options)
+        .def_readonly("tree_options", &ForestFileInfo::tree_options)
+        .def_readonly("split_options", &ForestFileInfo::split_options)
+        .def_readonly("predict_options", &ForestFileInfo::predict_options)
+        .def_readonly("file_size", &ForestFileInfo::file_size);
+    def("peek_forest_header", &peek_forest_header);
+
     // The following classes must be exposed multiple times, once for each type we
     // may want to use them with. Python does not know about our C++ templates, so we
     // must explicitly expose the MultiDimGaussian over doubles, and separately from that
@@ -80,12 +127,17 @@ BOOST_PYTHON_MODULE(_garf) {
         .def("_predict", &RegressionForest<F, L, S, SF>::py_predict_mean) \
         .def("_predict", &RegressionForest<F, L, S, SF>::py_predict_mean_var) \
         .def("_predict", &RegressionForest<F, L, S, SF>::py_predict_mean_var_leaves) \
+        .def("_predict_anytime", &RegressionForest<F, L, S, SF>::py_predict_anytime) \
         .def("_feature_importance", &RegressionForest<F, L, S, SF>::py_feature_importance) \
         .def("_clear", &RegressionForest<F, L, S, SF>::clear) \
+        .def("compile_for_inference", &RegressionForest<F, L, S, SF>::compile_for_inference) \
+        .add_property("compiled_for_inference", &RegressionForest<F, L, S, SF>::is_compiled_for_inference) \
         .def("get_tree", &RegressionForest<F, L, S, SF>::get_tree, \
              return_value_policy<copy_const_reference>()) \
         .def("load_forest", &RegressionForest<F, L, S, SF>::load_forest) \
-        .def("save_forest", &RegressionForest<F, L, S, SF>::save_forest); \
+        .def("save_forest", &RegressionForest<F, L, S, SF>::save_forest) \
+        .def("save_cpp_predictor", &save_cpp_predictor<F, L, S, SF>) \
+        .def("save_mapped_forest", &save_mapped_forest<F, L, S, SF>); \
     class_<RegressionTree<F, L, S, SF> >("RegTree" FN LN SN) \
         .def_readonly("tree_id", &RegressionTree<F, L, S, SF>::tree_id) \
         .add_property("root", make_function(&RegressionTree<F, L, S, SF>::get_root, \
@@ -139,7 +139,7 @@ def _predict_wrapper(self, features, mean_out=None, var_out=None, leaves_out=Non
 
     # Check the features, get to correct type
     if _any_invalid_numbers(features):
-        raise ValueError('training features contain NaN or infinity')
+        raise ValueError('prediction features contain NaN or infinity')
 
     num_data = features.shape[0]
     self.check_array(features, (num_data, self.stats.data_dimensions))
@@ -172,6 +172,28 @@ def _predict_wrapper(self, features, mean_out=None, var_out=None, leaves_out=Non
         return mean_out, var_out
 
 
+@forest_func("predict_anytime")
+def _predict_anytime_wrapper(self, features):
+    """Like predict, but each datapoint stops visiting trees once its mean has
+    converged or the tree budget runs out (see the anytime options in predict_options).
+    Returns the means, variances and how many trees were used for each datapoint"""
+    if not self.trained:
+        raise ValueError("cannot predict, forest is not trained")
+    if _any_invalid_numbers(features):
+        raise ValueError('prediction features contain NaN or infinity')
+
+    num_data = features.shape[0]
+    self.check_array(features, (num_data, self.stats.data_dimensions))
+    if features.dtype != self._feat_type:
+        features = features.astype(self._feat_type)
+
+    mean_out = np.zeros((num_data, self.stats.label_dimensions), dtype=self._label_type)
+    var_out = np.zeros((num_data, self.stats.label_dimensions), dtype=self._label_type)
+    trees_used = np.zeros((num_data, 1), dtype=self._index_type)
+    self._predict_anytime(features, mean_out, var_out, trees_used)
+    return mean_out, var_out, trees_used[:, 0]
+
+
 @forest_func("feature_importance")
 def _feature_importance_wrapper(self, features, labels, importance_out=None):
     if not self.trained:
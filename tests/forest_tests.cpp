@@ -2,6 +2,9 @@
 // #include <glog/logging.h>
 
 
+#include <cstdlib>
+#include <cstring>
+#include <thread>
 #include <iostream>
 #include <fstream>
 
@@ -17,6 +20,7 @@ using Eigen::Vector3d;
 using Eigen::VectorXd;
 using Eigen::Matrix3d;
 using Eigen::MatrixXd;
+using Eigen::MatrixXf;
 
 // #define VERBOSE
 #define GARF_SERIALIZE_ENABLE
@@ -24,7 +28,14 @@ using Eigen::MatrixXd;
 #define GARF_FEATURE_IMPORTANCE
 
 #include "garf/regression_forest.hpp"
+#include "garf/quick_scorer.hpp"
+#include "garf/codegen.hpp"
+#include "garf/mapped_forest.hpp"
+#include "garf/lazy_forest.hpp"
 typedef garf::RegressionForest<double, double, garf::TwoDimSplt, garf::TwoDimSplFitter> forest_ax_align;
+typedef garf::RegressionForest<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> forest_axis;
+typedef garf::RegressionForest<float, float, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> forest_axis_float;
+typedef garf::RegressionForest<float, float, garf::TwoDimSplt, garf::TwoDimSplFitter> forest_two_dim_float;
 
 
 const double tol = 0.00001;
@@ -91,13 +102,101 @@ void assert_forest_predictions_match(const ForestT & f1,
     std::cout << "forest outputs are equal!" << std::endl;
 }
 
+// Each node's datapoints should be its left child's followed by its right child's,
+// and they should all have gone the way the split says
+template<class NodeT>
+void check_node_indices_partitioned(const NodeT & node, const MatrixXd & data) {
+    if (node.is_leaf) {
+        return;
+    }
+    const NodeT & left = node.get_left();
+    const NodeT & right = node.get_right();
+    EXPECT_EQ(node.index_buffer.get(), left.index_buffer.get());
+    EXPECT_EQ(node.index_buffer.get(), right.index_buffer.get());
+    EXPECT_EQ(node.indices_begin, left.indices_begin);
+    EXPECT_EQ(node.indices_begin + left.num_samples(), right.indices_begin);
+    EXPECT_EQ(node.num_samples(), left.num_samples() + right.num_samples());
+
+    garf::feature_vec<double> fvec;
+    for (garf::datapoint_idx_t i = 0; i < left.num_samples(); i++) {
+        fvec = data.row(left.training_data_indices()(i));
+        EXPECT_EQ(garf::LEFT, node.split.evaluate(fvec));
+    }
+    for (garf::datapoint_idx_t i = 0; i < right.num_samples(); i++) {
+        fvec = data.row(right.training_data_indices()(i));
+        EXPECT_EQ(garf::RIGHT, node.split.evaluate(fvec));
+    }
+    check_node_indices_partitioned(left, data);
+    check_node_indices_partitioned(right, data);
+}
+
+// Every node's distribution should be that of the labels it was trained on, which for level wise
+// growth checks the binned label statistics
+template<class NodeT>
+void check_node_means_match_labels(const NodeT & node, const MatrixXd & labels) {
+    Eigen::VectorXd mean = Eigen::VectorXd::Zero(labels.cols());
+    for (garf::datapoint_idx_t i = 0; i < node.num_samples(); i++) {
+        mean += labels.row(node.training_data_indices()(i)).transpose();
+    }
+    mean /= node.num_samples();
+    for (garf::label_idx_t d = 0; d < labels.cols(); d++) {
+        EXPECT_NEAR(mean(d), node.dist.mean(d), 1e-9);
+    }
+    if (!node.is_leaf) {
+        check_node_means_match_labels(node.get_left(), labels);
+        check_node_means_match_labels(node.get_right(), labels);
+    }
+}
+
+// Everything saved about two nodes, and their subtrees, should be identical
+template<class NodeT>
+void expect_nodes_equal(const NodeT & n1, const NodeT & n2) {
+    EXPECT_EQ(n1.node_id, n2.node_id);
+    EXPECT_EQ(n1.depth, n2.depth);
+    EXPECT_EQ(n1.is_leaf, n2.is_leaf);
+    EXPECT_EQ(n1.num_samples(), n2.num_samples());
+    EXPECT_EQ(n1.bag_count, n2.bag_count);
+    expect_matrices_equal(n1.dist.mean, n2.dist.mean);
+    expect_matrices_equal(n1.dist.cov, n2.dist.cov);
+    ASSERT_EQ(n1.index_buffer.get() == NULL, n2.index_buffer.get() == NULL);
+    if (n1.index_buffer.get() != NULL) {
+        expect_matrices_equal(garf::data_indices_vec(n1.training_data_indices()),
+                              garf::data_indices_vec(n2.training_data_indices()));
+    }
+    if (!n1.is_leaf && !n2.is_leaf) {
+        EXPECT_EQ(n1.split.feat_idx, n2.split.feat_idx);
+        EXPECT_EQ(n1.split.thresh, n2.split.thresh);
+        expect_nodes_equal(n1.get_left(), n2.get_left());
+        expect_nodes_equal(n1.get_right(), n2.get_right());
+    }
+}
+
+template<class ForestT>
+void expect_forests_equal(const ForestT & f1, const ForestT & f2) {
+    ASSERT_EQ(f1.stats().num_trees, f2.stats().num_trees);
+    EXPECT_EQ(f1.stats().data_dimensions, f2.stats().data_dimensions);
+    EXPECT_EQ(f1.stats().label_dimensions, f2.stats().label_dimensions);
+    EXPECT_EQ(f1.stats().num_training_datapoints, f2.stats().num_training_datapoints);
+    EXPECT_EQ(f1.tree_options.max_depth, f2.tree_options.max_depth);
+    EXPECT_EQ(f1.forest_options.counted_bagging, f2.forest_options.counted_bagging);
+    EXPECT_EQ(f1.predict_options.anytime_min_trees, f2.predict_options.anytime_min_trees);
+    for (garf::tree_idx_t t = 0; t < f1.stats().num_trees; t++) {
+        EXPECT_EQ(f1.get_tree(t).tree_id, f2.get_tree(t).tree_id);
+        for (garf::datapoint_idx_t d = 0; d < f1.stats().num_training_datapoints; d++) {
+            EXPECT_EQ(f1.get_tree(t).is_in_bag(d), f2.get_tree(t).is_in_bag(d));
+        }
+        expect_nodes_equal(f1.get_tree(t).get_root(), f2.get_tree(t).get_root());
+    }
+}
+
 
 
 // Given a forest with training parameters already set, clear the forest,
 // generate a bunch of random training data, generate labels from this
 // data with the provided function pointer and other params, then check that the forest
 // 
-void test_forest_with_data(forest_ax_align & forest,
+template<class ForestT>
+void test_forest_with_data(ForestT & forest,
                            void (* label_generator)(const MatrixXd &, MatrixXd &),
                            uint64_t num_train_datapoints, uint64_t num_test_datapoints,
                            uint64_t data_dims, uint64_t label_dims,
@@ -146,6 +245,34 @@ void test_forest_with_data(forest_ax_align & forest,
     }
 }
 
+// The accuracy check shared by the split search, tree growth and bagging variants: a 10 tree,
+// depth 6 forest on 1000 noisy points of 2 dimensional data, where the label ignores one feature
+template<class ForestT>
+void test_forest_on_standard_data(ForestT & forest) {
+    forest.forest_options.max_num_trees = 10;
+    forest.tree_options.max_depth = 6;
+    forest.tree_options.min_sample_count = 2;
+    test_forest_with_data(forest, make_1d_labels_from_2d_data_squared_ignore_one_dim,
+                          1000, 100, 2, 1, 2.0, 0.1, 1.05);
+}
+
+// Random 3 dimensional data with two label dimensions (one depending on two features, one on a
+// third), and a forest trained on it with the given size - the setup the prediction tests share
+template<class ForestT>
+void train_forest_on_two_label_data(ForestT & forest, MatrixXd & data, MatrixXd & labels,
+                                    garf::datapoint_idx_t num_datapoints,
+                                    garf::tree_idx_t num_trees, garf::depth_idx_t max_depth) {
+    data.resize(num_datapoints, 3);
+    data.setRandom();
+    labels.resize(num_datapoints, 2);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+    labels.col(1) = data.col(2).cwiseAbs();
+
+    forest.forest_options.max_num_trees = num_trees;
+    forest.tree_options.max_depth = max_depth;
+    forest.train(data, labels);
+}
+
 // 
 
 TEST(ForestTest, RegTest1) {
@@ -245,6 +372,892 @@ TEST(ForestTest, RegTest2) {
                           noise_variance, answer_tolerance);
 }
 
+TEST(ForestTest, HistogramSplits) {
+    forest_axis forest;
+    forest.split_options.split_search = garf::SEARCH_HISTOGRAM;
+    forest.split_options.num_histogram_bins = 32;
+    test_forest_on_standard_data(forest);
+}
+
+TEST(ForestTest, ExactSplits) {
+    forest_ax_align forest;
+    forest.split_options.split_search = garf::SEARCH_EXACT;
+    test_forest_on_standard_data(forest);
+
+    // The sweep must find the best split there is, so compare a root split against trying every
+    // threshold between distinct values of every feature, fitting each side from scratch
+    MatrixXd data(300, 2);
+    data.setRandom();
+    MatrixXd labels(300, 1);
+    make_1d_labels_from_2d_data_squared_ignore_one_dim(data, labels);
+
+    forest_axis stump;
+    stump.forest_options.max_num_trees = 1;
+    stump.forest_options.bagging = false;
+    stump.tree_options.max_depth = 1;
+    stump.split_options.split_search = garf::SEARCH_EXACT;
+    stump.split_options.num_splits_to_try = 20;  // so both features are tried
+    stump.split_options.properly_random = false;
+    stump.train(data, labels);
+    const garf::RegressionNode<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> & root =
+        stump.get_tree(0).get_root();
+    ASSERT_FALSE(root.is_leaf);
+
+    const garf::datapoint_idx_t min_per_side = stump.split_options.num_per_side_for_viable_split;
+    garf::util::MultiDimGaussianX<double> left_dist(1);
+    garf::util::MultiDimGaussianX<double> right_dist(1);
+    double best_gain = -std::numeric_limits<double>::infinity();
+    double root_split_gain = -std::numeric_limits<double>::infinity();
+    for (garf::feat_idx_t f = 0; f < data.cols(); f++) {
+        std::vector<garf::datapoint_idx_t> order(data.rows());
+        for (garf::datapoint_idx_t i = 0; i < data.rows(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(),
+                  [&](garf::datapoint_idx_t a, garf::datapoint_idx_t b) { return data(a, f) < data(b, f); });
+        garf::data_indices_vec sorted(data.rows());
+        for (garf::datapoint_idx_t i = 0; i < data.rows(); i++) {
+            sorted(i) = order[i];
+        }
+
+        for (garf::datapoint_idx_t num_left = min_per_side; num_left <= (data.rows() - min_per_side); num_left++) {
+            if (!(data(order[num_left - 1], f) < data(order[num_left], f))) {
+                continue;
+            }
+            const garf::datapoint_idx_t num_right = data.rows() - num_left;
+            left_dist.fit_params(labels, sorted.head(num_left));
+            right_dist.fit_params(labels, sorted.tail(num_right));
+            const double gain = garf::util::information_gain(root.dist, left_dist, right_dist,
+                                                             data.rows(), num_left, num_right);
+            best_gain = std::max(best_gain, gain);
+            if ((f == root.split.feat_idx) && (data(order[num_left - 1], f) <= root.split.thresh) &&
+                (root.split.thresh < data(order[num_left], f))) {
+                root_split_gain = gain;
+            }
+        }
+    }
+    EXPECT_NEAR(best_gain, root_split_gain, tol);
+}
+
+TEST(ForestTest, LevelWiseGrowth) {
+    forest_axis forest;
+    forest.tree_options.growth = garf::GROW_LEVEL_WISE;
+    test_forest_on_standard_data(forest);
+}
+
+TEST(ForestTest, SubtreeTasks) {
+    forest_axis forest;
+    forest.tree_options.min_samples_for_subtree_task = 100;
+    test_forest_on_standard_data(forest);
+
+    // Without properly_random, subtree tasks must give the same trees however they are scheduled
+    MatrixXd data(1000, 2);
+    data.setRandom();
+    MatrixXd labels(1000, 1);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+
+    forest_axis forest1;
+    forest1.forest_options.max_num_trees = 2;
+    forest1.tree_options.max_depth = 8;
+    forest1.tree_options.min_samples_for_subtree_task = 100;
+    forest1.split_options.properly_random = false;
+    forest_axis forest2;
+    forest2.forest_options = forest1.forest_options;
+    forest2.tree_options = forest1.tree_options;
+    forest2.split_options = forest1.split_options;
+    forest1.train(data, labels);
+    forest2.train(data, labels);
+    expect_forests_equal(forest1, forest2);
+    for (garf::tree_idx_t t = 0; t < forest1.stats().num_trees; t++) {
+        check_node_indices_partitioned(forest1.get_tree(t).get_root(), data);
+    }
+
+    // Each task reseeds its right subtree's fitter, so if any were made the trees differ from serial ones
+    forest_axis serial_forest;
+    serial_forest.forest_options = forest1.forest_options;
+    serial_forest.tree_options = forest1.tree_options;
+    serial_forest.tree_options.min_samples_for_subtree_task = 0;
+    serial_forest.split_options = forest1.split_options;
+    serial_forest.train(data, labels);
+    garf::label_mtx<double> task_labels(data.rows(), 1);
+    garf::label_mtx<double> serial_labels(data.rows(), 1);
+    forest1.predict(data, &task_labels);
+    serial_forest.predict(data, &serial_labels);
+    EXPECT_NE(task_labels, serial_labels);
+}
+
+TEST(ForestTest, ParallelSplitSearchMatchesSerial) {
+    MatrixXd data(1000, 3);
+    data.setRandom();
+    MatrixXd labels(1000, 1);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+
+    // Not properly random, and few enough trees for a single fitter, so the
+    // same split candidates are generated in both forests
+    forest_axis serial_forest;
+    serial_forest.forest_options.max_num_trees = 2;
+    serial_forest.tree_options.max_depth = 6;
+    serial_forest.split_options.properly_random = false;
+    serial_forest.split_options.num_splits_to_try = 10;
+    serial_forest.split_options.threshes_per_split = 5;
+
+    forest_axis parallel_forest;
+    parallel_forest.forest_options = serial_forest.forest_options;
+    parallel_forest.tree_options = serial_forest.tree_options;
+    parallel_forest.split_options = serial_forest.split_options;
+    parallel_forest.split_options.min_samples_for_parallel_split_search = 50;
+
+    serial_forest.train(data, labels);
+    parallel_forest.train(data, labels);
+
+    assert_forest_predictions_match<double, double>(serial_forest, parallel_forest, data);
+}
+
+// Gathering the candidate features a few at a time should pick exactly the same splits
+template<class ForestT>
+void check_feature_blocks_match_unblocked(garf::split_search_t split_search) {
+    MatrixXd data(1000, 3);
+    data.setRandom();
+    MatrixXd labels(1000, 1);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+
+    ForestT unblocked_forest;
+    unblocked_forest.forest_options.max_num_trees = 2;
+    unblocked_forest.tree_options.max_depth = 6;
+    unblocked_forest.split_options.properly_random = false;
+    unblocked_forest.split_options.num_splits_to_try = 7;
+    unblocked_forest.split_options.threshes_per_split = 5;
+    unblocked_forest.split_options.split_search = split_search;
+
+    ForestT blocked_forest;
+    blocked_forest.forest_options = unblocked_forest.forest_options;
+    blocked_forest.tree_options = unblocked_forest.tree_options;
+    blocked_forest.split_options = unblocked_forest.split_options;
+    blocked_forest.split_options.feature_block_size = 3;
+
+    unblocked_forest.train(data, labels);
+    blocked_forest.train(data, labels);
+
+    assert_forest_predictions_match<double, double>(unblocked_forest, blocked_forest, data);
+}
+
+TEST(ForestTest, FeatureBlocksMatchUnblocked) {
+    check_feature_blocks_match_unblocked<forest_axis>(garf::SEARCH_RANDOM_THRESHOLDS);
+    check_feature_blocks_match_unblocked<forest_ax_align>(garf::SEARCH_RANDOM_THRESHOLDS);
+    check_feature_blocks_match_unblocked<forest_axis>(garf::SEARCH_EXACT);
+}
+
+// Compiling for inference should change nothing about the predictions, including when
+// prediction stops early at an internal node
+template<class ForestT>
+void check_compiled_forest_matches_nodes() {
+    MatrixXd data;
+    MatrixXd labels;
+    ForestT forest;
+    train_forest_on_two_label_data(forest, data, labels, 1000, 10, 8);
+
+    ForestT compiled_forest = forest;
+    EXPECT_FALSE(compiled_forest.is_compiled_for_inference());
+    compiled_forest.compile_for_inference();
+    EXPECT_TRUE(compiled_forest.is_compiled_for_inference());
+    EXPECT_FALSE(forest.is_compiled_for_inference());
+
+    assert_forest_predictions_match<double, double>(forest, compiled_forest, data);
+
+    forest.predict_options.maximum_depth = 3;
+    compiled_forest.predict_options.maximum_depth = 3;
+    assert_forest_predictions_match<double, double>(forest, compiled_forest, data);
+}
+
+TEST(ForestTest, CompiledForestMatchesNodes) {
+    check_compiled_forest_matches_nodes<forest_axis>();
+    check_compiled_forest_matches_nodes<forest_ax_align>();
+}
+
+TEST(ForestTest, ParallelPredictMatchesSerial) {
+    MatrixXd data(1000, 2);
+    data.setRandom();
+    MatrixXd labels(1000, 1);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+
+    forest_axis serial_forest;
+    serial_forest.forest_options.max_num_trees = 10;
+    serial_forest.tree_options.max_depth = 8;
+    serial_forest.train(data, labels);
+    serial_forest.predict_options.rows_per_parallel_task = 0;
+
+    forest_axis parallel_forest = serial_forest;
+    parallel_forest.predict_options.rows_per_parallel_task = 16;
+
+    assert_forest_predictions_match<double, double>(serial_forest, parallel_forest, data);
+
+    serial_forest.compile_for_inference();
+    parallel_forest.compile_for_inference();
+    assert_forest_predictions_match<double, double>(serial_forest, parallel_forest, data);
+}
+
+TEST(ForestTest, TreeMajorPredictMatchesRowMajor) {
+    MatrixXd data;
+    MatrixXd labels;
+    forest_axis row_major_forest;
+    train_forest_on_two_label_data(row_major_forest, data, labels, 1000, 10, 8);
+
+    // Block size doesn't divide the number of rows (or the parallel task size)
+    forest_axis tree_major_forest = row_major_forest;
+    tree_major_forest.predict_options.tree_major_block_size = 37;
+
+    assert_forest_predictions_match<double, double>(row_major_forest, tree_major_forest, data);
+
+    tree_major_forest.predict_options.rows_per_parallel_task = 100;
+    assert_forest_predictions_match<double, double>(row_major_forest, tree_major_forest, data);
+
+    // Means only take a different path
+    garf::label_mtx<double> row_major_means(1000, 2);
+    garf::label_mtx<double> tree_major_means(1000, 2);
+    row_major_forest.predict(data, &row_major_means);
+    tree_major_forest.predict(data, &tree_major_means);
+    expect_matrices_equal(row_major_means, tree_major_means);
+}
+
+template<class ForestT>
+void check_simd_predict_matches_scalar() {
+    // Number of rows isn't a multiple of the vector width, nor is the block size
+    MatrixXf data(1003, 4);
+    data.setRandom();
+    MatrixXf labels(1003, 2);
+    labels.col(0) = data.col(0).cwiseProduct(data.col(1));
+    labels.col(1) = data.col(2).cwiseAbs();
+
+    ForestT forest;
+    forest.forest_options.max_num_trees = 10;
+    forest.tree_options.max_depth = 10;
+    forest.train(data, labels);
+
+    ForestT simd_forest = forest;
+    simd_forest.compile_for_inference();
+    simd_forest.predict_options.tree_major_block_size = 203;
+
+    // NaN should go right whichever way the tree is evaluated
+    data(5, 0) = std::numeric_limits<float>::quiet_NaN();
+    data(500, 1) = std::numeric_limits<float>::quiet_NaN();
+
+    const garf::simd_level_t levels[] = {garf::SIMD_NONE, garf::SIMD_AVX2, garf::SIMD_AVX512};
+    for (int l = 0; l < 3; l++) {
+        simd_forest.predict_options.max_simd_level = levels[l];
+        assert_forest_predictions_match<float, float>(forest, simd_forest, data);
+    }
+
+    // Stopping early
+    forest.predict_options.maximum_depth = 3;
+    simd_forest.predict_options.maximum_depth = 3;
+    assert_forest_predictions_match<float, float>(forest, simd_forest, data);
+}
+
+// On a CPU without AVX2 / AVX-512 this just checks the scalar fallback
+TEST(ForestTest, SimdPredictMatchesScalar) {
+    check_simd_predict_matches_scalar<forest_axis_float>();
+    check_simd_predict_matches_scalar<forest_two_dim_float>();
+}
+
+// Each combination of outputs goes through its own kernel, they should all agree on what they share
+template<class ForestT>
+void check_predict_output_combinations_agree(const ForestT & forest, const MatrixXd & data) {
+    const garf::ForestStats & stats = forest.stats();
+    garf::label_mtx<double> means_only(data.rows(), stats.label_dimensions);
+    garf::label_mtx<double> means_with_leaves(data.rows(), stats.label_dimensions);
+    garf::label_mtx<double> means_with_var(data.rows(), stats.label_dimensions);
+    garf::label_mtx<double> means_with_all(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> var(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> var_with_leaves(data.rows(), stats.label_dimensions);
+    garf::tree_idx_mtx leaves(data.rows(), stats.num_trees);
+    garf::tree_idx_mtx leaves_with_var(data.rows(), stats.num_trees);
+
+    forest.predict(data, &means_only);
+    forest.predict(data, &means_with_leaves, NULL, &leaves);
+    forest.predict(data, &means_with_var, &var);
+    forest.predict(data, &means_with_all, &var_with_leaves, &leaves_with_var);
+
+    expect_matrices_equal(means_only, means_with_leaves);
+    expect_matrices_equal(means_with_var, means_with_all);
+    expect_matrices_equal(var, var_with_leaves);
+    expect_matrices_equal(leaves, leaves_with_var);
+    // The mean is calculated differently when the variance is wanted too
+    EXPECT_LT((means_only - means_with_var).cwiseAbs().maxCoeff(), tol);
+}
+
+TEST(ForestTest, PredictOutputCombinationsAgree) {
+    MatrixXd data;
+    MatrixXd labels;
+    forest_axis forest;
+    train_forest_on_two_label_data(forest, data, labels, 1000, 10, 8);
+    forest.predict_options.rows_per_parallel_task = 0;
+    check_predict_output_combinations_agree(forest, data);
+
+    forest.predict_options.tree_major_block_size = 37;
+    check_predict_output_combinations_agree(forest, data);
+}
+
+TEST(ForestTest, AnytimePredict) {
+    MatrixXd data;
+    MatrixXd labels;
+    forest_axis forest;
+    train_forest_on_two_label_data(forest, data, labels, 1000, 20, 6);
+    const garf::tree_idx_t num_trees = forest.stats().num_trees;
+
+    garf::label_mtx<double> means(1000, 2);
+    garf::variance_mtx<double> var(1000, 2);
+    garf::label_mtx<double> anytime_means(1000, 2);
+    garf::variance_mtx<double> anytime_var(1000, 2);
+    garf::tree_count_vec trees_used(1000);
+
+    // With no tolerance or budget every tree is used, and the answer is the same as predict()
+    forest.predict(data, &means, &var);
+    forest.predict_anytime(data, &anytime_means, &trees_used, &anytime_var);
+    expect_matrices_equal(means, anytime_means);
+    expect_matrices_equal(var, anytime_var);
+    EXPECT_EQ(num_trees, trees_used.minCoeff());
+    EXPECT_EQ(num_trees, trees_used.maxCoeff());
+    forest.predict(data, &means);
+    forest.predict_anytime(data, &anytime_means, &trees_used);
+    expect_matrices_equal(means, anytime_means);
+
+    forest.predict_options.anytime_max_trees = 5;
+    forest.predict_anytime(data, &anytime_means, &trees_used);
+    EXPECT_EQ(5, trees_used.minCoeff());
+    EXPECT_EQ(5, trees_used.maxCoeff());
+
+    // Rows which stopped early must have got within the tolerance, by the usual (n - 1) estimate of
+    // the standard error of the mean over the trees they used
+    forest.predict_options.anytime_max_trees = 0;
+    forest.predict_options.anytime_std_error_tolerance = 0.05;
+    forest.predict_options.anytime_min_trees = 2;
+    forest.predict_anytime(data, &anytime_means, &trees_used, &anytime_var);
+    EXPECT_GE(trees_used.minCoeff(), 2);
+    EXPECT_LT(trees_used.cast<double>().mean(), num_trees);
+    garf::feature_vec<double> fvec;
+    for (garf::datapoint_idx_t i = 0; i < 1000; i++) {
+        const garf::tree_idx_t n = trees_used(i);
+        fvec = data.row(i);
+        MatrixXd leaf_means(n, 2);
+        for (garf::tree_idx_t t = 0; t < n; t++) {
+            leaf_means.row(t) = forest.get_tree(t).evaluate(fvec, forest.predict_options).dist.mean;
+        }
+        const Eigen::RowVectorXd mean = leaf_means.colwise().mean();
+        for (garf::label_idx_t d = 0; d < 2; d++) {
+            EXPECT_NEAR(mean(d), anytime_means(i, d), tol);
+            if (n < num_trees) {
+                const double sample_var = (leaf_means.col(d).array() - mean(d)).square().sum() / (n - 1);
+                EXPECT_LE(std::sqrt(sample_var / n), 0.05 + tol);
+            }
+        }
+    }
+
+    garf::tree_count_vec wrong_size(10);
+    EXPECT_THROW(forest.predict_anytime(data, &anytime_means, &wrong_size), std::invalid_argument);
+    EXPECT_THROW(forest.predict_anytime(data, &anytime_means, NULL), std::invalid_argument);
+}
+
+template<class ForestT>
+void check_predict_one_matches_predict(const ForestT & forest, const MatrixXd & data) {
+    const garf::ForestStats & stats = forest.stats();
+    garf::label_mtx<double> means(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> var(data.rows(), stats.label_dimensions);
+    garf::label_mtx<double> means_only(data.rows(), stats.label_dimensions);
+    forest.predict(data, &means, &var);
+    forest.predict(data, &means_only);
+
+    // Row major, so each datapoint is contiguous
+    const Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> rows = data;
+    garf::label_mtx<double> one_mean(1, stats.label_dimensions);
+    garf::variance_mtx<double> one_var(1, stats.label_dimensions);
+    for (garf::datapoint_idx_t i = 0; i < data.rows(); i++) {
+        forest.predict_one(rows.row(i).data(), one_mean.data(), one_var.data());
+        expect_matrices_equal(garf::label_mtx<double>(means.row(i)), one_mean);
+        expect_matrices_equal(garf::variance_mtx<double>(var.row(i)), one_var);
+        forest.predict_one(rows.row(i).data(), one_mean.data());
+        expect_matrices_equal(garf::label_mtx<double>(means_only.row(i)), one_mean);
+    }
+}
+
+TEST(ForestTest, PredictOneMatchesPredict) {
+    MatrixXd data;
+    MatrixXd labels;
+    forest_axis forest;
+    EXPECT_THROW(forest.predict_one(data.data(), labels.data()), std::invalid_argument);
+    train_forest_on_two_label_data(forest, data, labels, 500, 10, 8);
+    check_predict_one_matches_predict(forest, data);
+
+    forest.compile_for_inference();
+    check_predict_one_matches_predict(forest, data);
+    EXPECT_THROW(forest.predict_one(data.data(), NULL), std::invalid_argument);
+}
+
+// Each output of predict_at_depths should be exactly what predict gives with that maximum depth
+void check_predict_at_depths(forest_axis & forest, const MatrixXd & data, const std::vector<garf::depth_idx_t> & depths) {
+    const garf::ForestStats & stats = forest.stats();
+    std::vector<garf::label_mtx<double> > means, means_only;
+    std::vector<garf::variance_mtx<double> > variances;
+    forest.predict_at_depths(data, depths, &means, &variances);
+    forest.predict_at_depths(data, depths, &means_only);
+    ASSERT_EQ(depths.size(), means.size());
+    ASSERT_EQ(depths.size(), variances.size());
+    ASSERT_EQ(depths.size(), means_only.size());
+
+    const garf::depth_idx_t original_max_depth = forest.predict_options.maximum_depth;
+    garf::label_mtx<double> l(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> v(data.rows(), stats.label_dimensions);
+    for (size_t k = 0; k < depths.size(); k++) {
+        forest.predict_options.maximum_depth = depths[k];
+        forest.predict(data, &l, &v);
+        expect_matrices_equal(l, means[k]);
+        expect_matrices_equal(v, variances[k]);
+        forest.predict(data, &l);
+        expect_matrices_equal(l, means_only[k]);
+    }
+    forest.predict_options.maximum_depth = original_max_depth;
+}
+
+TEST(ForestTest, PredictAtDepths) {
+    MatrixXd data;
+    MatrixXd labels;
+    forest_axis forest;
+    train_forest_on_two_label_data(forest, data, labels, 500, 10, 8);
+
+    // Out of order, repeated, zero and deeper than any tree all need to work
+    std::vector<garf::depth_idx_t> depths;
+    depths.push_back(5);
+    depths.push_back(0);
+    depths.push_back(2);
+    depths.push_back(100);
+    depths.push_back(2);
+    check_predict_at_depths(forest, data, depths);
+    forest.compile_for_inference();
+    check_predict_at_depths(forest, data, depths);
+
+    std::vector<garf::label_mtx<double> > means;
+    depths.push_back(-1);
+    EXPECT_THROW(forest.predict_at_depths(data, depths, &means), std::invalid_argument);
+    depths.pop_back();
+    EXPECT_THROW(forest.predict_at_depths(data, depths, NULL), std::invalid_argument);
+}
+
+// Check a QuickScorer gives exactly what the forest it was built from predicts
+void check_quick_scorer_matches_forest(const forest_axis & forest, const MatrixXd & data) {
+    garf::QuickScorer<double, double> scorer(forest);
+    const garf::ForestStats & stats = forest.stats();
+    garf::label_mtx<double> l1(data.rows(), stats.label_dimensions);
+    garf::label_mtx<double> l2(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> v1(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> v2(data.rows(), stats.label_dimensions);
+    garf::tree_idx_mtx t1(data.rows(), stats.num_trees);
+    garf::tree_idx_mtx t2(data.rows(), stats.num_trees);
+
+    forest.predict(data, &l1, &v1, &t1);
+    scorer.predict(data, &l2, &v2, &t2);
+    expect_matrices_equal(l1, l2);
+    expect_matrices_equal(v1, v2);
+    expect_matrices_equal(t1, t2);
+
+    forest.predict(data, &l1);
+    scorer.predict(data, &l2);
+    expect_matrices_equal(l1, l2);
+}
+
+TEST(ForestTest, QuickScorerMatchesForest) {
+    MatrixXd data;
+    MatrixXd labels;
+    forest_axis forest;
+    train_forest_on_two_label_data(forest, data, labels, 1000, 10, 6);
+    check_quick_scorer_matches_forest(forest, data);
+
+    // Stopping early is baked in when the scorer is built
+    forest.predict_options.maximum_depth = 3;
+    check_quick_scorer_matches_forest(forest, data);
+
+    forest_axis deep_forest;
+    deep_forest.forest_options.max_num_trees = 2;
+    deep_forest.tree_options.max_depth = 12;
+    deep_forest.tree_options.min_sample_count = 2;
+    deep_forest.train(data, labels);
+    typedef garf::QuickScorer<double, double> scorer_t;
+    EXPECT_THROW(scorer_t scorer(deep_forest), std::invalid_argument);
+}
+
+// Compile the generated source with $CXX (or c++) into a program which predicts every row of
+// data, and check that it gives what forest.predict does. Features reach the generated code as
+// floats, so data should hold values which are exactly representable as floats.
+template<class ForestT>
+void check_compiled_cpp_predictor(const ForestT & forest, const MatrixXd & data, const std::string & name) {
+    const std::string source_file = name + ".cpp";
+    std::ofstream source(source_file.c_str());
+    garf::write_cpp_predictor(forest, source, "my_model");
+    source << std::endl
+           << "#include <cstdio>" << std::endl
+           << "int main(int argc, char ** argv) {" << std::endl
+           << "    std::FILE * in = std::fopen(argv[1], \"rb\");" << std::endl
+           << "    std::FILE * out = std::fopen(argv[2], \"wb\");" << std::endl
+           << "    float features[my_model::num_features];" << std::endl
+           << "    float labels[my_model::num_labels];" << std::endl
+           << "    while (std::fread(features, sizeof(float), my_model::num_features, in) == my_model::num_features) {" << std::endl
+           << "        my_model::predict(features, labels);" << std::endl
+           << "        std::fwrite(labels, sizeof(float), my_model::num_labels, out);" << std::endl
+           << "    }" << std::endl
+           << "    std::fclose(out);" << std::endl
+           << "    return 0;" << std::endl
+           << "}" << std::endl;
+    source.close();
+
+    const MatrixXf features = data.cast<float>();
+    std::ofstream features_file((name + ".features").c_str(), std::ios::binary);
+    for (garf::datapoint_idx_t i = 0; i < features.rows(); i++) {
+        for (garf::feat_idx_t f = 0; f < features.cols(); f++) {
+            const float value = features(i, f);
+            features_file.write(reinterpret_cast<const char *>(&value), sizeof(float));
+        }
+    }
+    features_file.close();
+
+    const char * const cxx = std::getenv("CXX");
+    const std::string compile = std::string((cxx != NULL) ? cxx : "c++") + " -O3 -o " + name + " " + source_file;
+    ASSERT_EQ(0, std::system(compile.c_str())) << compile;
+    const std::string run = "./" + name + " " + name + ".features " + name + ".labels";
+    ASSERT_EQ(0, std::system(run.c_str())) << run;
+
+    MatrixXd expected(data.rows(), forest.stats().label_dimensions);
+    forest.predict(data, &expected);
+    std::ifstream labels_file((name + ".labels").c_str(), std::ios::binary);
+    for (garf::datapoint_idx_t i = 0; i < expected.rows(); i++) {
+        for (garf::label_idx_t l = 0; l < expected.cols(); l++) {
+            float value;
+            ASSERT_TRUE(labels_file.read(reinterpret_cast<char *>(&value), sizeof(float)));
+            EXPECT_NEAR(expected(i, l), value, tol * std::max(1.0, std::abs(expected(i, l))));
+        }
+    }
+}
+
+template<class ForestT>
+void check_generated_cpp_predictor(const std::string & name) {
+    MatrixXd data(500, 3);
+    data.setRandom();
+    data = data.cast<float>().cast<double>();
+    MatrixXd labels(500, 1);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+
+    ForestT forest;
+    EXPECT_THROW(garf::write_cpp_predictor(forest, std::cout), std::invalid_argument);
+    forest.forest_options.max_num_trees = 4;
+    forest.tree_options.max_depth = 5;
+    forest.train(data, labels);
+
+    std::ostringstream generated;
+    garf::write_cpp_predictor(forest, generated, "my_model");
+    const std::string source = generated.str();
+    EXPECT_NE(std::string::npos, source.find("namespace my_model {"));
+    EXPECT_NE(std::string::npos, source.find("void predict(const float * features, float * labels_out) {"));
+    for (garf::tree_idx_t t = 0; t < forest.stats().num_trees; t++) {
+        std::ostringstream tree_function;
+        tree_function << "inline void tree_" << t << "(const float * f, label_t * sum) {";
+        EXPECT_NE(std::string::npos, source.find(tree_function.str()));
+    }
+    check_compiled_cpp_predictor(forest, data, name);
+
+    // Stopping early is baked in as well
+    forest.predict_options.maximum_depth = 2;
+    check_compiled_cpp_predictor(forest, data, name + "_depth");
+}
+
+TEST(ForestTest, GenerateCppPredictor) {
+    check_generated_cpp_predictor<forest_axis>("test_codegen_axis");
+    check_generated_cpp_predictor<forest_ax_align>("test_codegen_two_dim");
+
+    // A single split should come out exactly, with constants that read back identically
+    MatrixXd data(100, 1);
+    data.setRandom();
+    MatrixXd labels(100, 1);
+    make_1d_labels_from_1d_data_abs(data, labels);
+    forest_axis stump;
+    stump.forest_options.max_num_trees = 1;
+    stump.tree_options.max_depth = 1;
+    stump.train(data, labels);
+    typedef garf::RegressionNode<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> node_t;
+    const node_t & root = stump.get_tree(0).get_root();
+    ASSERT_FALSE(root.is_leaf);
+
+    std::ostringstream expected;
+    expected << std::setprecision(17)
+             << "            if (static_cast<feature_t>(f[0]) <= " << root.split.thresh << ") {\n"
+             << "                sum[0] += " << root.get_left().dist.mean(0) << ";\n"
+             << "            } else {\n"
+             << "                sum[0] += " << root.get_right().dist.mean(0) << ";\n"
+             << "            }\n";
+    std::ostringstream generated;
+    garf::write_cpp_predictor(stump, generated);
+    EXPECT_NE(std::string::npos, generated.str().find(expected.str()));
+
+    // A tree nested deeper than codegen_max_nesting has its lower levels in helper functions.
+    // Each feature picks out one group of datapoints, so every split can only peel a group off
+    // the rest and the tree is a chain as deep as there are groups.
+    const garf::feat_idx_t num_groups = garf::codegen_max_nesting + 6;
+    const garf::datapoint_idx_t group_size = 5;
+    MatrixXd chain_data = MatrixXd::Zero((num_groups + 1) * group_size, num_groups);
+    MatrixXd chain_labels(chain_data.rows(), 1);
+    for (garf::datapoint_idx_t i = 0; i < chain_data.rows(); i++) {
+        const garf::feat_idx_t group = i / group_size;
+        if (group < num_groups) {
+            chain_data(i, group) = 1;
+        }
+        chain_labels(i, 0) = group + 0.1 * (i % group_size);
+    }
+    forest_axis chain;
+    chain.forest_options.max_num_trees = 1;
+    chain.forest_options.bagging = false;
+    chain.tree_options.max_depth = 2 * num_groups;
+    chain.tree_options.min_sample_count = 2;
+    chain.split_options.split_search = garf::SEARCH_EXACT;
+    chain.split_options.num_splits_to_try = 4 * num_groups;
+    chain.train(chain_data, chain_labels);
+
+    std::ostringstream chain_generated;
+    garf::write_cpp_predictor(chain, chain_generated);
+    ASSERT_NE(std::string::npos, chain_generated.str().find("inline void tree_0_part_1(const float * f, label_t * sum) {"));
+    check_compiled_cpp_predictor(chain, chain_data, "test_codegen_chain");
+}
+
+TEST(ForestTest, NodeIndicesPartitionedInPlace) {
+    MatrixXd data(500, 2);
+    data.setRandom();
+    MatrixXd labels(500, 1);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+
+    forest_axis forest;
+    forest.forest_options.max_num_trees = 2;
+    forest.tree_options.max_depth = 5;
+    forest.train(data, labels);
+    for (garf::tree_idx_t t = 0; t < forest.stats().num_trees; t++) {
+        check_node_indices_partitioned(forest.get_tree(t).get_root(), data);
+    }
+
+    forest_axis level_wise_forest;
+    level_wise_forest.forest_options.max_num_trees = 2;
+    level_wise_forest.tree_options.max_depth = 5;
+    level_wise_forest.tree_options.growth = garf::GROW_LEVEL_WISE;
+    level_wise_forest.train(data, labels);
+    for (garf::tree_idx_t t = 0; t < level_wise_forest.stats().num_trees; t++) {
+        check_node_indices_partitioned(level_wise_forest.get_tree(t).get_root(), data);
+        check_node_means_match_labels(level_wise_forest.get_tree(t).get_root(), labels);
+    }
+}
+
+TEST(ForestTest, DiscardTrainingIndices) {
+    MatrixXd data(500, 2);
+    data.setRandom();
+    MatrixXd labels(500, 1);
+    make_1d_labels_from_2d_data_squared_ignore_one_dim(data, labels);
+
+    forest_axis forest;
+    forest.forest_options.max_num_trees = 4;
+    forest.forest_options.keep_training_indices = false;
+    forest.tree_options.max_depth = 5;
+    forest.train(data, labels);
+
+    for (garf::tree_idx_t t = 0; t < forest.stats().num_trees; t++) {
+        const garf::RegressionNode<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> & root =
+            forest.get_tree(t).get_root();
+        EXPECT_EQ(500, root.num_samples());
+        EXPECT_EQ(NULL, root.index_buffer.get());
+        EXPECT_THROW(root.training_data_indices(), std::logic_error);
+        if (!root.is_leaf) {
+            EXPECT_EQ(root.num_samples(), root.get_left().num_samples() + root.get_right().num_samples());
+        }
+    }
+
+    // Importance only needs the in bag bitmaps
+    garf::importance_vec importance(2);
+    forest.calculate_feature_importance(data, labels, &importance);
+    EXPECT_GT(importance(0), importance(1));
+
+    // The bitmaps are only made when the indices go, and say the same as the indices did
+    forest_axis lean;
+    lean.forest_options = forest.forest_options;
+    lean.tree_options = forest.tree_options;
+    lean.split_options.properly_random = false;
+    forest_axis kept;
+    kept.forest_options = lean.forest_options;
+    kept.forest_options.keep_training_indices = true;
+    kept.tree_options = lean.tree_options;
+    kept.split_options = lean.split_options;
+    lean.train(data, labels);
+    kept.train(data, labels);
+    garf::bool_vec lean_mask(500);
+    garf::bool_vec kept_mask(500);
+    for (garf::tree_idx_t t = 0; t < lean.stats().num_trees; t++) {
+        EXPECT_TRUE(lean.get_tree(t).has_in_bag());
+        EXPECT_FALSE(kept.get_tree(t).has_in_bag());
+        lean.get_tree(t).in_bag_mask(&lean_mask);
+        kept.get_tree(t).in_bag_mask(&kept_mask);
+        EXPECT_EQ(kept_mask, lean_mask);
+        EXPECT_LT(kept_mask.count(), 500);
+        for (garf::datapoint_idx_t d = 0; d < 500; d++) {
+            EXPECT_EQ(kept.get_tree(t).is_in_bag(d), lean.get_tree(t).is_in_bag(d));
+        }
+    }
+
+    // Both kinds of file keep the bitmaps
+    forest_axis loaded;
+    lean.save_forest("test_lean.forest");
+    loaded.load_forest("test_lean.forest");
+    expect_forests_equal(lean, loaded);
+    {
+        std::ofstream ofs("test_lean_text.forest");
+        boost::archive::text_oarchive oa(ofs);
+        oa << lean;
+    }
+    forest_axis loaded_text;
+    loaded_text.load_forest("test_lean_text.forest");
+    expect_forests_equal(lean, loaded_text);
+}
+
+TEST(ForestTest, CountedBootstrap) {
+    garf::RngSource rng;
+    garf::data_indices_vec indices;
+    garf::sample_count_vec counts;
+    garf::util::counted_bootstrap(1000, 1000, &rng, &indices, &counts);
+
+    EXPECT_EQ(1000, counts.size());
+    EXPECT_EQ(1000u, counts.sum());
+    EXPECT_LT(indices.size(), 1000);
+    for (garf::datapoint_idx_t i = 0; i < indices.size(); i++) {
+        EXPECT_GT(counts(indices(i)), 0u);
+        if (i > 0) {
+            EXPECT_LT(indices(i - 1), indices(i));
+        }
+    }
+    EXPECT_EQ(indices.size(), (counts.array() > 0).count());
+}
+
+// A tree trained on counted indices against one trained on the same bag with each index repeated
+// as many times as it was counted. Every node must have the same split, draws and distribution.
+template<class NodeT>
+void expect_counted_node_matches_expanded(const NodeT & counted, const NodeT & expanded) {
+    EXPECT_EQ(expanded.bag_count, counted.bag_count);
+    EXPECT_EQ(expanded.indices_count, counted.bag_count);
+    for (garf::eigen_idx_t i = 0; i < expanded.dist.mean.size(); i++) {
+        EXPECT_NEAR(expanded.dist.mean(i), counted.dist.mean(i), tol);
+        for (garf::eigen_idx_t j = 0; j < expanded.dist.mean.size(); j++) {
+            EXPECT_NEAR(expanded.dist.cov(i, j), counted.dist.cov(i, j), tol);
+        }
+    }
+    ASSERT_EQ(expanded.is_leaf, counted.is_leaf);
+    if (!expanded.is_leaf) {
+        EXPECT_EQ(expanded.split.feat_idx, counted.split.feat_idx);
+        EXPECT_EQ(expanded.split.thresh, counted.split.thresh);
+        expect_counted_node_matches_expanded(counted.get_left(), expanded.get_left());
+        expect_counted_node_matches_expanded(counted.get_right(), expanded.get_right());
+    }
+}
+
+TEST(ForestTest, CountedBagging) {
+    forest_axis forest;
+    forest.forest_options.counted_bagging = true;
+    test_forest_on_standard_data(forest);
+
+    // Roots hold each drawn datapoint once, but count every draw
+    const garf::RegressionNode<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> & root =
+        forest.get_tree(0).get_root();
+    EXPECT_LT(root.num_samples(), 1000);
+    EXPECT_EQ(1000, root.bag_count);
+
+    // Counting draws must be the same statistically as repeating indices
+    typedef garf::AxisAlignedSplFitter<double, double> fitter_t;
+    MatrixXd data(200, 1);
+    data.setRandom();
+    MatrixXd labels(200, 2);
+    labels.col(0) = data.col(0).cwiseAbs();
+    labels.col(1).setRandom();
+    garf::data_indices_vec counted_indices(200);
+    garf::sample_count_vec counts(200);
+    std::vector<garf::datapoint_idx_t> repeated;
+    for (garf::datapoint_idx_t i = 0; i < 200; i++) {
+        counted_indices(i) = i;
+        counts(i) = 1 + (i % 3);
+        repeated.insert(repeated.end(), counts(i), i);
+    }
+    garf::data_indices_vec expanded_indices(repeated.size());
+    for (size_t i = 0; i < repeated.size(); i++) {
+        expanded_indices(i) = repeated[i];
+    }
+
+    garf::SplitOptions split_opts;
+    split_opts.split_search = garf::SEARCH_EXACT;
+    split_opts.properly_random = false;
+    // With at most 3 draws per index, a side of 10 draws has at least 3 distinct labels, so no
+    // child covariance is singular in one version and merely tiny from rounding in the other
+    split_opts.num_per_side_for_viable_split = 10;
+    garf::TreeOptions tree_opts;
+    tree_opts.max_depth = 4;
+    tbb::mutex print_mutex;
+
+    // The root's fit and best split
+    fitter_t counted_fitter(split_opts, expanded_indices.size(), 1, 2, print_mutex, NULL);
+    fitter_t expanded_fitter(split_opts, expanded_indices.size(), 1, 2, print_mutex, NULL);
+    counted_fitter.sample_counts = &counts;
+    garf::util::SufficientStats<double> scratch(2);
+    garf::util::MultiDimGaussianX<double> counted_dist(2);
+    garf::util::MultiDimGaussianX<double> expanded_dist(2);
+    counted_fitter.fit_dist(labels, counted_indices, 200, &scratch, &counted_dist);
+    expanded_dist.fit_params(labels, expanded_indices);
+    garf::AxisAlignedSplt<double> counted_split;
+    garf::AxisAlignedSplt<double> expanded_split;
+    garf::datapoint_idx_t num_left;
+    garf::data_indices_vec counted_scratch = counted_indices;
+    garf::data_indices_vec expanded_scratch = expanded_indices;
+    garf::data_indices_range counted_range = counted_scratch.segment(0, counted_scratch.size());
+    garf::data_indices_range expanded_range = expanded_scratch.segment(0, expanded_scratch.size());
+    ASSERT_TRUE(counted_fitter.choose_split_parameters(data, labels, counted_range, counted_dist, &counted_split, &num_left));
+    ASSERT_TRUE(expanded_fitter.choose_split_parameters(data, labels, expanded_range, expanded_dist, &expanded_split, &num_left));
+    EXPECT_NEAR(expanded_fitter.best_inf_gain, counted_fitter.best_inf_gain, tol);
+    EXPECT_EQ(expanded_split.thresh, counted_split.thresh);
+
+    // And whole trees
+    garf::RegressionTree<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> counted_tree;
+    garf::RegressionTree<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> expanded_tree;
+    counted_tree.train(data, labels, counted_indices, tree_opts, &counted_fitter, &counts);
+    expanded_tree.train(data, labels, expanded_indices, tree_opts, &expanded_fitter);
+    expect_counted_node_matches_expanded(counted_tree.get_root(), expanded_tree.get_root());
+}
+
+TEST(ForestTest, BagFractionWithoutReplacement) {
+    forest_axis forest;
+    forest.forest_options.bag_fraction = 0.3;
+    forest.forest_options.bag_with_replacement = false;
+    test_forest_on_standard_data(forest);
+
+    // Each tree sees 300 distinct datapoints, and everything else is out of bag
+    for (garf::tree_idx_t t = 0; t < forest.forest_options.max_num_trees; t++) {
+        const garf::RegressionTree<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> & tree =
+            forest.get_tree(t);
+        EXPECT_EQ(300, tree.get_root().num_samples());
+        garf::datapoint_idx_t num_in_bag = 0;
+        for (garf::datapoint_idx_t d = 0; d < 1000; d++) {
+            if (tree.is_in_bag(d)) {
+                num_in_bag++;
+            }
+        }
+        EXPECT_EQ(300, num_in_bag);
+    }
+}
+
+TEST(ForestTest, BadBagFraction) {
+    garf::feature_mtx<double> data(100, 2);
+    data.setRandom();
+    garf::label_mtx<double> labels(100, 1);
+    labels.setRandom();
+
+    forest_axis forest;
+    forest.forest_options.bag_fraction = 1.5;
+    EXPECT_THROW(forest.train(data, labels), std::invalid_argument);
+}
+
 TEST(ForestTest, Serialize) {
     typedef double feat_t;
     typedef double label_t;
@@ -273,6 +1286,361 @@ TEST(ForestTest, Serialize) {
     assert_forest_predictions_match<feat_t, label_t, forest_ax_align>(forest1, forest2, data);
 }
 
+TEST(ForestTest, BinaryFormat) {
+    MatrixXd data(500, 2);
+    data.setRandom();
+    MatrixXd labels(500, 2);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+    labels.col(1) = data.col(1).cwiseAbs();
+
+    forest_axis forest1;
+    forest1.forest_options.max_num_trees = 5;
+    forest1.forest_options.counted_bagging = true;
+    forest1.tree_options.max_depth = 7;
+    forest1.predict_options.anytime_min_trees = 3;
+    forest1.train(data, labels);
+    forest1.save_forest("test_binary.forest");
+    forest_axis forest2;
+    forest2.load_forest("test_binary.forest");
+    expect_forests_equal(forest1, forest2);
+    assert_forest_predictions_match<double, double, forest_axis>(forest1, forest2, data);
+
+    // Without training indices, and then with float features and two dimensional splits
+    forest1.clear();
+    forest1.forest_options.keep_training_indices = false;
+    forest1.train(data, labels);
+    forest1.save_forest("test_binary.forest");
+    forest2.load_forest("test_binary.forest");
+    expect_forests_equal(forest1, forest2);
+
+    forest_two_dim_float float_forest1;
+    float_forest1.forest_options.max_num_trees = 5;
+    float_forest1.train(data.cast<float>(), labels.cast<float>());
+    float_forest1.save_forest("test_binary_float.forest");
+    forest_two_dim_float float_forest2;
+    float_forest2.load_forest("test_binary_float.forest");
+    assert_forest_predictions_match<float, float, forest_two_dim_float>(float_forest1, float_forest2, data.cast<float>());
+
+    // Untrained forests keep their options
+    forest_axis untrained1;
+    untrained1.tree_options.max_depth = 3;
+    untrained1.save_forest("test_binary_untrained.forest");
+    forest_axis untrained2;
+    untrained2.load_forest("test_binary_untrained.forest");
+    EXPECT_FALSE(untrained2.is_trained());
+    EXPECT_EQ(3, untrained2.tree_options.max_depth);
+
+    // Version 1 files are the same without the tree offset table, which starts where an
+    // untrained forest's file ends
+    {
+        std::ifstream v2_ifs("test_binary.forest", std::ios::binary);
+        std::string v2((std::istreambuf_iterator<char>(v2_ifs)), std::istreambuf_iterator<char>());
+        std::ifstream untrained_ifs("test_binary_untrained.forest", std::ios::binary);
+        const size_t table_begin = std::string((std::istreambuf_iterator<char>(untrained_ifs)),
+                                               std::istreambuf_iterator<char>()).size();
+        std::string v1 = v2.substr(0, table_begin) + v2.substr(table_begin + 16 * forest1.stats().num_trees);
+        v1[8] = 1;
+        std::ofstream v1_ofs("test_binary_v1.forest", std::ios::binary);
+        v1_ofs.write(v1.data(), v1.size());
+    }
+    forest_axis v1_forest;
+    v1_forest.load_forest("test_binary_v1.forest");
+    expect_forests_equal(forest1, v1_forest);
+    size_t table_begin;
+    {
+        std::ifstream untrained_ifs("test_binary_untrained.forest", std::ios::binary | std::ios::ate);
+        table_begin = untrained_ifs.tellg();
+    }
+
+    // Files for a different kind of forest, or which have been cut short, are refused
+    forest_axis_float wrong_types;
+    EXPECT_THROW(wrong_types.load_forest("test_binary.forest"), std::invalid_argument);
+    forest_ax_align wrong_splits;
+    EXPECT_THROW(wrong_splits.load_forest("test_binary.forest"), std::invalid_argument);
+
+    std::ifstream ifs("test_binary.forest", std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    std::ofstream ofs("test_binary_truncated.forest", std::ios::binary);
+    ofs.write(contents.data(), contents.size() / 2);
+    ofs.close();
+    EXPECT_THROW(forest2.load_forest("test_binary_truncated.forest"), std::invalid_argument);
+    EXPECT_THROW(forest2.load_forest("no_such_file.forest"), std::invalid_argument);
+
+    // A tree which fails to decode (here the last one claims far too many nodes) leaves the
+    // forest as it was, rather than half loaded
+    std::string corrupt = contents;
+    const size_t last_block = table_begin + 16 * forest1.stats().num_trees +
+        *reinterpret_cast<const uint64_t *>(&contents[table_begin + 8 * (forest1.stats().num_trees - 1)]);
+    const int64_t too_many_nodes = int64_t(1) << 40;
+    std::memcpy(&corrupt[last_block + 8], &too_many_nodes, sizeof(too_many_nodes));
+    std::ofstream corrupt_ofs("test_binary_corrupt.forest", std::ios::binary);
+    corrupt_ofs.write(corrupt.data(), corrupt.size());
+    corrupt_ofs.close();
+    EXPECT_THROW(forest2.load_forest("test_binary_corrupt.forest"), std::invalid_argument);
+    expect_forests_equal(forest1, forest2);
+    assert_forest_predictions_match<double, double, forest_axis>(forest1, forest2, data);
+
+    std::string v1_truncated = contents.substr(0, table_begin) +
+        contents.substr(table_begin + 16 * forest1.stats().num_trees, contents.size() / 2);
+    v1_truncated[8] = 1;
+    std::ofstream v1_truncated_ofs("test_binary_v1_truncated.forest", std::ios::binary);
+    v1_truncated_ofs.write(v1_truncated.data(), v1_truncated.size());
+    v1_truncated_ofs.close();
+    EXPECT_THROW(forest2.load_forest("test_binary_v1_truncated.forest"), std::invalid_argument);
+    expect_forests_equal(forest1, forest2);
+}
+
+TEST(ForestTest, ConvertTextForest) {
+    MatrixXd data(500, 2);
+    data.setRandom();
+    MatrixXd labels(500, 1);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+
+    forest_axis forest1;
+    forest1.forest_options.max_num_trees = 5;
+    forest1.train(data, labels);
+    {
+        // What save_forest used to write
+        std::ofstream ofs("test_text.forest");
+        boost::archive::text_oarchive oa(ofs);
+        oa << forest1;
+    }
+
+    forest_axis forest2;
+    forest2.load_forest("test_text.forest");
+    expect_forests_equal(forest1, forest2);
+
+    garf::convert_forest_to_binary<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter>(
+        "test_text.forest", "test_converted.forest");
+    forest_axis forest3;
+    forest3.load_forest("test_converted.forest");
+    expect_forests_equal(forest1, forest3);
+    assert_forest_predictions_match<double, double, forest_axis>(forest1, forest3, data);
+}
+
+// A MappedForest should predict exactly what the forest it was saved from does
+template<class ForestT, class MappedT>
+void check_mapped_forest_matches(const ForestT & forest, const MappedT & mapped, const MatrixXd & data) {
+    const garf::ForestStats & stats = forest.stats();
+    garf::label_mtx<double> l1(data.rows(), stats.label_dimensions);
+    garf::label_mtx<double> l2(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> v1(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> v2(data.rows(), stats.label_dimensions);
+    garf::tree_idx_mtx t1(data.rows(), stats.num_trees);
+    garf::tree_idx_mtx t2(data.rows(), stats.num_trees);
+
+    forest.predict(data, &l1, &v1, &t1);
+    mapped.predict(data, &l2, &v2, &t2);
+    expect_matrices_equal(l1, l2);
+    expect_matrices_equal(v1, v2);
+    expect_matrices_equal(t1, t2);
+
+    forest.predict(data, &l1);
+    mapped.predict(data, &l2);
+    expect_matrices_equal(l1, l2);
+
+    garf::feature_vec<double> row = data.row(0);
+    garf::label_vec<double> mean(stats.label_dimensions);
+    garf::label_vec<double> var(stats.label_dimensions);
+    mapped.predict_one(row.data(), mean.data(), var.data());
+    expect_matrices_equal(garf::label_mtx<double>(v1.row(0)), garf::label_mtx<double>(var.transpose()));
+}
+
+TEST(ForestTest, MappedForest) {
+    typedef garf::MappedForest<double, double, garf::AxisAlignedSplt> mapped_axis;
+    MatrixXd data;
+    MatrixXd labels;
+    forest_axis forest;
+    EXPECT_THROW(garf::save_mapped_forest(forest, "test_mapped.forest"), std::invalid_argument);
+    train_forest_on_two_label_data(forest, data, labels, 500, 8, 9);
+    garf::save_mapped_forest(forest, "test_mapped.forest");
+    mapped_axis mapped("test_mapped.forest");
+    EXPECT_EQ(forest.stats().num_trees, mapped.stats().num_trees);
+    check_mapped_forest_matches(forest, mapped, data);
+
+    // The saved maximum depth comes along, and can be changed afterwards like the forest's
+    forest.predict_options.maximum_depth = 4;
+    garf::save_mapped_forest(forest, "test_mapped_depth.forest");
+    mapped_axis mapped_depth("test_mapped_depth.forest");
+    EXPECT_EQ(4, mapped_depth.predict_options.maximum_depth);
+    check_mapped_forest_matches(forest, mapped_depth, data);
+    forest.predict_options.maximum_depth = 2;
+    mapped_depth.predict_options.maximum_depth = 2;
+    check_mapped_forest_matches(forest, mapped_depth, data);
+
+    // Refuse the wrong kind of forest, a normal forest file, or a truncated one
+    typedef garf::MappedForest<float, float, garf::AxisAlignedSplt> mapped_axis_float;
+    typedef garf::MappedForest<double, double, garf::TwoDimSplt> mapped_two_dim;
+    EXPECT_THROW(mapped_axis_float wrong_types("test_mapped.forest"), std::invalid_argument);
+    EXPECT_THROW(mapped_two_dim wrong_splits("test_mapped.forest"), std::invalid_argument);
+    forest.save_forest("test_not_mapped.forest");
+    EXPECT_THROW(mapped_axis not_mapped("test_not_mapped.forest"), std::invalid_argument);
+    EXPECT_THROW(mapped_axis no_file("no_such_file.forest"), std::invalid_argument);
+
+    std::ifstream ifs("test_mapped.forest", std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    std::ofstream ofs("test_mapped_truncated.forest", std::ios::binary);
+    ofs.write(contents.data(), contents.size() - 100);
+    ofs.close();
+    EXPECT_THROW(mapped_axis truncated("test_mapped_truncated.forest"), std::invalid_argument);
+
+    // Or one whose children would loop back up the tree, or point past its nodes
+    garf::MappedForestHeader header;
+    std::memcpy(&header, contents.data(), sizeof(header));
+    garf::MappedTreeEntry entry;
+    std::memcpy(&entry, contents.data() + header.tree_entries_offset, sizeof(entry));
+    ASSERT_GT(entry.num_internal_nodes, 1);
+    const int32_t corrupt_children[] = {0, static_cast<int32_t>(entry.num_internal_nodes),
+                                        -static_cast<int32_t>(entry.num_leaves) - 1};
+    for (size_t c = 0; c < 3; c++) {
+        std::string corrupt = contents;
+        std::memcpy(&corrupt[entry.children_offset + sizeof(int32_t)], &corrupt_children[c], sizeof(int32_t));
+        std::ofstream corrupt_ofs("test_mapped_corrupt.forest", std::ios::binary);
+        corrupt_ofs.write(corrupt.data(), corrupt.size());
+        corrupt_ofs.close();
+        EXPECT_THROW(mapped_axis corrupt_forest("test_mapped_corrupt.forest"), std::invalid_argument);
+    }
+}
+
+TEST(ForestTest, LazyForest) {
+    typedef garf::LazyForest<double, double, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> lazy_axis;
+    MatrixXd data;
+    MatrixXd labels;
+    forest_axis forest;
+    train_forest_on_two_label_data(forest, data, labels, 500, 6, 8);
+    forest.save_forest("test_lazy.forest");
+
+    // Nothing is read until it's needed
+    lazy_axis lazy("test_lazy.forest");
+    EXPECT_EQ(forest.stats().num_trees, lazy.stats().num_trees);
+    EXPECT_EQ(0u, lazy.num_resident_trees());
+    boost::shared_ptr<const lazy_axis::tree_t> tree_2 = lazy.get_tree(2);
+    EXPECT_EQ(1u, lazy.num_resident_trees());
+    expect_nodes_equal(forest.get_tree(2).get_root(), tree_2->get_root());
+    EXPECT_EQ(tree_2.get(), lazy.get_tree(2).get());
+    EXPECT_THROW(lazy.get_tree(6), std::invalid_argument);
+
+    const garf::ForestStats & stats = forest.stats();
+    garf::label_mtx<double> l1(data.rows(), stats.label_dimensions);
+    garf::label_mtx<double> l2(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> v1(data.rows(), stats.label_dimensions);
+    garf::variance_mtx<double> v2(data.rows(), stats.label_dimensions);
+    garf::tree_idx_mtx t1(data.rows(), stats.num_trees);
+    garf::tree_idx_mtx t2(data.rows(), stats.num_trees);
+    forest.predict(data, &l1, &v1, &t1);
+    lazy.predict(data, &l2, &v2, &t2);
+    expect_matrices_equal(l1, l2);
+    expect_matrices_equal(v1, v2);
+    expect_matrices_equal(t1, t2);
+    forest.predict(data, &l1);
+    lazy.predict(data, &l2);
+    expect_matrices_equal(l1, l2);
+    EXPECT_EQ(6u, lazy.num_resident_trees());
+
+    // The cache is charged what the decoded trees take, which is more than the whole file
+    size_t decoded_bytes = 0;
+    for (garf::tree_idx_t t = 0; t < stats.num_trees; t++) {
+        decoded_bytes += lazy.get_tree(t)->memory_bytes();
+    }
+    EXPECT_EQ(decoded_bytes, lazy.resident_bytes());
+    std::ifstream saved("test_lazy.forest", std::ios::binary | std::ios::ate);
+    EXPECT_GT(lazy.resident_bytes(), static_cast<size_t>(saved.tellg()));
+
+    // Threads sharing one forest all get the same trees and the same answers
+    lazy_axis shared("test_lazy.forest");
+    std::vector<garf::label_mtx<double> > thread_labels(4, garf::label_mtx<double>(data.rows(), stats.label_dimensions));
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_labels.size(); i++) {
+        threads.push_back(std::thread([&shared, &data, &thread_labels, i] { shared.predict(data, &thread_labels[i]); }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+        expect_matrices_equal(l1, thread_labels[i]);
+    }
+    EXPECT_EQ(6u, shared.num_resident_trees());
+
+    // With a cap only the most recent trees stay, but trees handed out stay usable
+    lazy_axis capped("test_lazy.forest", 1);
+    boost::shared_ptr<const lazy_axis::tree_t> tree_0 = capped.get_tree(0);
+    capped.predict(data, &l2, &v2, &t2);
+    expect_matrices_equal(v1, v2);
+    expect_matrices_equal(t1, t2);
+    EXPECT_EQ(1u, capped.num_resident_trees());
+    expect_nodes_equal(forest.get_tree(0).get_root(), tree_0->get_root());
+    EXPECT_NE(tree_0.get(), capped.get_tree(0).get());
+
+    capped.max_resident_bytes = 3 * lazy.resident_bytes() / 6;
+    capped.predict(data, &l2);
+    expect_matrices_equal(l1, l2);
+    EXPECT_LE(capped.resident_bytes(), capped.max_resident_bytes);
+    EXPECT_GE(capped.num_resident_trees(), 1u);
+
+    typedef garf::LazyForest<float, float, garf::AxisAlignedSplt, garf::AxisAlignedSplFitter> lazy_axis_float;
+    EXPECT_THROW(lazy_axis_float wrong("test_lazy.forest"), std::invalid_argument);
+    EXPECT_THROW(lazy_axis no_file("no_such_file.forest"), std::invalid_argument);
+}
+
+TEST(ForestTest, PeekForestHeader) {
+    MatrixXd data(300, 2);
+    data.setRandom();
+    MatrixXd labels(300, 1);
+    make_1d_labels_from_2d_data_squared_diff(data, labels);
+
+    forest_two_dim_float forest;
+    forest.forest_options.max_num_trees = 4;
+    forest.tree_options.max_depth = 7;
+    forest.split_options.num_splits_to_try = 13;
+    forest.predict_options.maximum_depth = 5;
+    forest.train(data.cast<float>(), labels.cast<float>());
+    forest.save_forest("test_peek.forest");
+
+    const garf::ForestFileInfo info = garf::peek_forest_header("test_peek.forest");
+    EXPECT_EQ(garf::binary_forest_format_version, info.format_version);
+    EXPECT_EQ("float", info.feature_type);
+    EXPECT_EQ("float", info.label_type);
+    EXPECT_EQ("2_dim_hyp", info.split_type);
+    EXPECT_TRUE(info.trained);
+    EXPECT_EQ(forest.stats().num_trees, info.stats.num_trees);
+    EXPECT_EQ(forest.stats().data_dimensions, info.stats.data_dimensions);
+    EXPECT_EQ(forest.stats().label_dimensions, info.stats.label_dimensions);
+    EXPECT_EQ(forest.stats().num_training_datapoints, info.stats.num_training_datapoints);
+    EXPECT_EQ(4, info.forest_options.max_num_trees);
+    EXPECT_EQ(7, info.tree_options.max_depth);
+    EXPECT_EQ(13, info.split_options.num_splits_to_try);
+    EXPECT_EQ(5, info.predict_options.maximum_depth);
+    std::ifstream saved("test_peek.forest", std::ios::binary | std::ios::ate);
+    EXPECT_EQ(static_cast<uint64_t>(saved.tellg()), info.file_size);
+
+    // Only the header and options are read, nothing past them
+    saved.seekg(0, std::ios::beg);
+    garf::BinaryForestHeader header;
+    garf::ForestOptions forest_options;
+    garf::TreeOptions tree_options;
+    garf::SplitOptions split_options;
+    garf::PredictOptions predict_options;
+    uint64_t prefix_size;
+    garf::read_binary_forest_prefix(saved, &header, &forest_options, &tree_options, &split_options,
+                                    &predict_options, &prefix_size);
+    EXPECT_EQ(prefix_size, static_cast<uint64_t>(saved.tellg()));
+    EXPECT_LT(prefix_size, 512u);
+
+    forest_axis untrained;
+    untrained.save_forest("test_peek_untrained.forest");
+    const garf::ForestFileInfo untrained_info = garf::peek_forest_header("test_peek_untrained.forest");
+    EXPECT_FALSE(untrained_info.trained);
+    EXPECT_EQ("double", untrained_info.feature_type);
+    EXPECT_EQ("axis_aligned", untrained_info.split_type);
+
+    // Text archives don't record their types, and there's nothing to read without a file
+    {
+        std::ofstream ofs("test_peek_text.forest");
+        boost::archive::text_oarchive oa(ofs);
+        oa << untrained;
+    }
+    EXPECT_THROW(garf::peek_forest_header("test_peek_text.forest"), std::invalid_argument);
+    EXPECT_THROW(garf::peek_forest_header("no_such_file.forest"), std::invalid_argument);
+}
+
 GTEST_API_ int main(int argc, char **argv) {
     // Print everything, including INFO and WARNING
     // FLAGS_stderrthreshold = 0;
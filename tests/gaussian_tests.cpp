@@ -14,6 +14,7 @@ using Eigen::Matrix3d;
 using Eigen::MatrixXd;
 
 #include "garf/util/multi_dim_gaussian.hpp"
+#include "garf/util/sufficient_stats.hpp"
 
 const double tol = 0.00001;
 
@@ -49,6 +50,41 @@ TEST(MDGTest, VariableSize) {
 }
 
 
+TEST(MDGTest, SufficientStatsMatchFit) {
+    MatrixXd data(20, 3);
+    data.setRandom();
+    garf::data_indices_vec all_indices(20), left_indices(8);
+    all_indices.setLinSpaced(20, 0, 19);
+    left_indices.setLinSpaced(8, 0, 7);
+
+    garf::util::MultiDimGaussianX<double> fitted(3), from_stats(3);
+    garf::util::SufficientStats<double> total(3), left(3), right(3);
+    for (int i = 0; i < 20; i++) {
+        total.add(data.row(i));
+    }
+    for (int i = 0; i < 8; i++) {
+        left.add(data.row(i));
+    }
+
+    // Whole dataset
+    fitted.fit_params(data, all_indices);
+    total.to_gaussian(&from_stats);
+    EXPECT_TRUE(fitted.mean.isApprox(from_stats.mean, tol));
+    EXPECT_TRUE(fitted.cov.isApprox(from_stats.cov, tol));
+
+    // Subset, and the complement of that subset
+    fitted.fit_params(data, left_indices);
+    left.to_gaussian(&from_stats);
+    EXPECT_TRUE(fitted.cov.isApprox(from_stats.cov, tol));
+
+    right.set_difference(total, left);
+    for (int i = 0; i < 8; i++) {
+        total.remove(data.row(i));
+    }
+    EXPECT_NEAR(right.count, 12, tol);
+    EXPECT_TRUE(right.mean.isApprox(total.mean, tol));
+    EXPECT_TRUE(right.scatter.isApprox(total.scatter, tol));
+}
 
 GTEST_API_ int main(int argc, char **argv) {
     // FLAGS_stderrthreshold = 0;